@@ -8,17 +8,18 @@
 
 # Environment variables
 SERIAL_PROGRAM="bin/wolves-squirrels-serial"
+GENERATOR_PROGRAM="bin/gen-world"
 OUTPUT_DIR="test/generated"
 
 # Simulator variables
-NUMBER_TESTS=1
-MAX_WORLD_SIZE=200
+NUMBER_TESTS=${NUMBER_TESTS:-1}
+MAX_WORLD_SIZE=${MAX_WORLD_SIZE:-200}
 MAX_WOLF_BREEDING_PERIOD=5
 MAX_SQUIRREL_BREEDING_PERIOD=5
 MAX_WOLF_STARVATION_PERIOD=5
 MAX_NUMBER_GENERATIONS=10
 
-if [ -x $SERIAL_PROGRAM ]
+if [ -x $SERIAL_PROGRAM ] && [ -x $GENERATOR_PROGRAM ]
 then
 	rm -rf $OUTPUT_DIR
 	mkdir -p $OUTPUT_DIR
@@ -28,23 +29,17 @@ then
 		file="${OUTPUT_DIR}/${count}"
 
 		# generating .in
-		pieces=('$' 'w' 's' 'i' 't' 'e')
+		layouts=('uniform' 'clustered' 'striped')
 		input="${file}.in"
 
 		world_size=$RANDOM
 		let "world_size %= $MAX_WORLD_SIZE"
-		echo "$world_size" >> $input
+		let "world_size += 1"
+		layout=$RANDOM
+		let "layout %= ${#layouts[@]}"
 
-		for (( i = 0; i < $world_size; i++ )); do
-			for (( j = 0; j < $world_size; j++ )); do
-				pos=$RANDOM
-				let "pos %= ${#pieces[@]}"
-				if [ ${pieces[${pos}]} != 'e' ]
-				then
-					echo "$i $j ${pieces[${pos}]}" >> $input
-				fi			
-			done
-		done
+		./$GENERATOR_PROGRAM $world_size --seed $RANDOM \
+				--layout ${layouts[${layout}]} > $input 2> /dev/null
 
 		# generating .header
 		header="${file}.header"
@@ -66,5 +61,5 @@ then
 				$wolf_starvation_period $number_generations > "${file}.out"
 	done
 else
-	echo "$SERIAL_PROGRAM doesn't exist."
+	echo "$SERIAL_PROGRAM or $GENERATOR_PROGRAM doesn't exist."
 fi	
@@ -0,0 +1,394 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <math.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <omp.h>
+
+#define FALSE 0
+#define TRUE 1
+#define max(a,b) ((a) > (b) ? (a) : (b))
+#define min(a,b) ((a) < (b) ? (a) : (b))
+
+// Types of the positions
+#define EMPTY 0
+#define WOLF 1
+#define SQUIRREL 2
+#define TREE 3
+#define ICE 4
+#define SQUIRREL_ON_TREE 5
+#define NUM_TYPES 6
+
+// Binary maps start with these 8 bytes and the world's size as a 32
+// bit integer, followed by a byte per cell
+#define BINARY_MAGIC "WSQMAP01"
+#define BINARY_MAGIC_SIZE 8
+
+// The map is written in blocks of rows generated in OUTPUT_BUFFER
+// sized buffers, MAX_CELL_TEXT characters at most per cell
+#define OUTPUT_BUFFER (1 << 20)
+#define MAX_CELL_TEXT 26
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+typedef enum {
+	LAYOUT_UNIFORM = 0,
+	LAYOUT_CLUSTERED = 1,
+	LAYOUT_STRIPED = 2
+} layout_e;
+
+// A disc of the world holding animals in the clustered layout
+typedef struct {
+	long row;
+	long col;
+} cluster_t;
+
+unsigned long splitmix64(unsigned long *state);
+char ttoa(unsigned char type);
+layout_e atolayout(const char *name);
+double atod(const char *value);
+void parseOptions(int argc, char **argv);
+void initClusters();
+void populatedCells(int row, unsigned char *populated);
+void generateRow(int row, unsigned char *populated, unsigned char *types);
+char *formatInt(char *text, int value);
+char *formatRow(char *text, int row, const unsigned char *types);
+void writeBlocks(struct iovec *blocks, int count);
+void writeHeader();
+void generateWorld();
+
+const int NUM_ARGUMENTS = 2;
+int WORLD_SIZE;
+unsigned long SEED = 1;
+int BINARY = FALSE;
+layout_e LAYOUT = LAYOUT_UNIFORM;
+
+// Chance of each type in a populated cell, as in gen-test.sh by default
+double densities[NUM_TYPES] = {0, 1.0/6, 1.0/6, 1.0/6, 1.0/6, 1.0/6};
+
+// A cell takes the first type whose threshold is above a random 32 bit
+// number, or is left empty
+unsigned long thresholds[NUM_TYPES];
+
+// The clustered layout only populates NUM_CLUSTERS discs of
+// CLUSTER_RADIUS cells around random centres, and the striped one bands
+// of STRIPE_WIDTH rows, or columns when VERTICAL_STRIPES, every other
+// one
+int NUM_CLUSTERS = 8;
+int CLUSTER_RADIUS = 0;
+cluster_t *clusters = NULL;
+int STRIPE_WIDTH = 0;
+int VERTICAL_STRIPES = FALSE;
+
+// Splitmix64, a small generator good enough to seed one per row, so the
+// map is the same whatever the number of threads
+unsigned long splitmix64(unsigned long *state) {
+	unsigned long z = (*state += 0x9e3779b97f4a7c15UL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9UL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebUL;
+	return z ^ (z >> 31);
+}
+
+char ttoa(unsigned char type) {
+	switch (type) {
+		case WOLF:             return 'w';
+		case SQUIRREL:         return 's';
+		case ICE:              return 'i';
+		case TREE:             return 't';
+		case SQUIRREL_ON_TREE: return '$';
+	}
+	return ' ';
+}
+
+layout_e atolayout(const char *name) {
+	if (strcmp(name, "uniform") == 0) {
+		return LAYOUT_UNIFORM;
+	}
+	if (strcmp(name, "clustered") == 0) {
+		return LAYOUT_CLUSTERED;
+	}
+	if (strcmp(name, "striped") == 0) {
+		return LAYOUT_STRIPED;
+	}
+
+	fprintf(stderr, "Unknown layout: %s\n", name);
+	exit(EXIT_FAILURE);
+}
+
+double atod(const char *value) {
+	double density = atof(value);
+	if ((density < 0) || (density > 1)) {
+		fprintf(stderr, "Densities must be between 0 and 1: %s\n", value);
+		exit(EXIT_FAILURE);
+	}
+	return density;
+}
+
+void parseOptions(int argc, char **argv) {
+	WORLD_SIZE = atoi(argv[1]);
+	if (WORLD_SIZE < 1) {
+		fprintf(stderr, "The world needs a size\n");
+		exit(EXIT_FAILURE);
+	}
+
+	int i;
+	for (i = NUM_ARGUMENTS; i < argc; i++) {
+		if ((strcmp(argv[i], "--seed") == 0) && (i+1 < argc)) {
+			SEED = strtoul(argv[++i], NULL, 10);
+		} else if ((strcmp(argv[i], "--format") == 0) && (i+1 < argc)) {
+			BINARY = (strcmp(argv[++i], "binary") == 0);
+		} else if ((strcmp(argv[i], "--layout") == 0) && (i+1 < argc)) {
+			LAYOUT = atolayout(argv[++i]);
+		} else if ((strcmp(argv[i], "--wolves") == 0) && (i+1 < argc)) {
+			densities[WOLF] = atod(argv[++i]);
+		} else if ((strcmp(argv[i], "--squirrels") == 0) && (i+1 < argc)) {
+			densities[SQUIRREL] = atod(argv[++i]);
+		} else if ((strcmp(argv[i], "--trees") == 0) && (i+1 < argc)) {
+			densities[TREE] = atod(argv[++i]);
+		} else if ((strcmp(argv[i], "--ice") == 0) && (i+1 < argc)) {
+			densities[ICE] = atod(argv[++i]);
+		} else if ((strcmp(argv[i], "--squirrels-on-trees") == 0) && (i+1 < argc)) {
+			densities[SQUIRREL_ON_TREE] = atod(argv[++i]);
+		} else if ((strcmp(argv[i], "--clusters") == 0) && (i+1 < argc)) {
+			NUM_CLUSTERS = atoi(argv[++i]);
+		} else if ((strcmp(argv[i], "--cluster-radius") == 0) && (i+1 < argc)) {
+			CLUSTER_RADIUS = atoi(argv[++i]);
+		} else if ((strcmp(argv[i], "--stripe-width") == 0) && (i+1 < argc)) {
+			STRIPE_WIDTH = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--vertical") == 0) {
+			VERTICAL_STRIPES = TRUE;
+		} else {
+			fprintf(stderr, "Unknown option: %s\n", argv[i]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	double total = 0;
+	int type;
+	for (type = 0; type < NUM_TYPES; type++) {
+		total += densities[type];
+		thresholds[type] = (unsigned long) (min(total, 1.0) * 4294967296.0);
+	}
+	if (total > 1 + 1e-9) {
+		fprintf(stderr, "The densities add up to more than 1\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (CLUSTER_RADIUS <= 0) {
+		CLUSTER_RADIUS = max(WORLD_SIZE / 8, 1);
+	}
+	if (STRIPE_WIDTH <= 0) {
+		STRIPE_WIDTH = max(WORLD_SIZE / 16, 1);
+	}
+	if (NUM_CLUSTERS < 0) {
+		NUM_CLUSTERS = 0;
+	}
+}
+
+void initClusters() {
+	clusters = malloc(sizeof(cluster_t) * max(NUM_CLUSTERS, 1));
+	unsigned long state = SEED;
+	int i;
+	for (i = 0; i < NUM_CLUSTERS; i++) {
+		clusters[i].row = splitmix64(&state) % WORLD_SIZE;
+		clusters[i].col = splitmix64(&state) % WORLD_SIZE;
+	}
+}
+
+// Marks the cells of a row the layout populates
+void populatedCells(int row, unsigned char *populated) {
+	if (LAYOUT == LAYOUT_UNIFORM) {
+		memset(populated, TRUE, WORLD_SIZE);
+	} else if (LAYOUT == LAYOUT_STRIPED) {
+		if (VERTICAL_STRIPES) {
+			int col;
+			for (col = 0; col < WORLD_SIZE; col++) {
+				populated[col] = (col / STRIPE_WIDTH) % 2 == 0;
+			}
+		} else {
+			memset(populated, (row / STRIPE_WIDTH) % 2 == 0, WORLD_SIZE);
+		}
+	} else {
+		// The columns of each disc crossing the row
+		memset(populated, FALSE, WORLD_SIZE);
+		long radius = CLUSTER_RADIUS;
+		int i;
+		for (i = 0; i < NUM_CLUSTERS; i++) {
+			long dy = row - clusters[i].row;
+			if ((dy < -radius) || (dy > radius)) {
+				continue;
+			}
+			long dx = (long) sqrt((double) (radius * radius - dy * dy));
+			while ((dx + 1) * (dx + 1) + dy * dy <= radius * radius) {
+				dx++;
+			}
+			while (dx * dx + dy * dy > radius * radius) {
+				dx--;
+			}
+			long first = max(clusters[i].col - dx, 0);
+			long last = min(clusters[i].col + dx, WORLD_SIZE - 1);
+			memset(populated + first, TRUE, last - first + 1);
+		}
+	}
+}
+
+void generateRow(int row, unsigned char *populated, unsigned char *types) {
+	unsigned long state = SEED ^ ((unsigned long) row * 0xd1342543de82ef95UL);
+	splitmix64(&state);
+	populatedCells(row, populated);
+
+	int col;
+	for (col = 0; col < WORLD_SIZE; col++) {
+		// Every cell draws a number, so the populated cells of two
+		// layouts with the same seed are the same,
+		// and the type is counted from the thresholds below the number
+		// without branches
+		unsigned long number = splitmix64(&state) >> 32;
+		int below = 0;
+		int t;
+		for (t = WOLF; t < NUM_TYPES; t++) {
+			below += (number >= thresholds[t]);
+		}
+		unsigned char type = (below < NUM_TYPES - 1) ? below + 1 : EMPTY;
+		types[col] = populated[col] ? type : EMPTY;
+	}
+}
+
+// Writes the digits of a non negative integer, returning where they end
+char *formatInt(char *text, int value) {
+	char digits[12];
+	int length = 0;
+	do {
+		digits[length++] = '0' + value % 10;
+		value /= 10;
+	} while (value > 0);
+
+	while (length > 0) {
+		*text++ = digits[--length];
+	}
+	return text;
+}
+
+// Writes a "row col type" line per cell of a row that isn't empty,
+// returning where they end
+char *formatRow(char *text, int row, const unsigned char *types) {
+	char rowText[12];
+	int rowLength = formatInt(rowText, row) - rowText;
+	rowText[rowLength++] = ' ';
+
+	int col;
+	for (col = 0; col < WORLD_SIZE; col++) {
+		if (types[col] != EMPTY) {
+			memcpy(text, rowText, rowLength);
+			text = formatInt(text + rowLength, col);
+			*text++ = ' ';
+			*text++ = ttoa(types[col]);
+			*text++ = '\n';
+		}
+	}
+	return text;
+}
+
+// Writes blocks of text to stdout, as many at a time as the system takes
+void writeBlocks(struct iovec *blocks, int count) {
+	while (count > 0) {
+		ssize_t written = writev(STDOUT_FILENO, blocks, min(count, IOV_MAX));
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "Can't write the map\n");
+			exit(EXIT_FAILURE);
+		}
+
+		while ((count > 0) && ((size_t) written >= blocks->iov_len)) {
+			written -= blocks->iov_len;
+			blocks++;
+			count--;
+		}
+		if (count > 0) {
+			blocks->iov_base = (char *) blocks->iov_base + written;
+			blocks->iov_len -= written;
+		}
+	}
+}
+
+void writeHeader() {
+	char header[BINARY_MAGIC_SIZE + sizeof(int32_t)];
+	struct iovec block;
+	block.iov_base = header;
+	if (BINARY) {
+		int32_t size = WORLD_SIZE;
+		memcpy(header, BINARY_MAGIC, BINARY_MAGIC_SIZE);
+		memcpy(header + BINARY_MAGIC_SIZE, &size, sizeof(size));
+		block.iov_len = sizeof(header);
+	} else {
+		char *text = formatInt(header, WORLD_SIZE);
+		*text++ = '\n';
+		block.iov_len = text - header;
+	}
+	writeBlocks(&block, 1);
+}
+
+// Each thread generates a block of rows in its own buffer, and the
+// blocks are written in order
+void generateWorld() {
+	int threads = omp_get_max_threads();
+	int cellText = BINARY ? 1 : MAX_CELL_TEXT;
+	int blockRows = max(OUTPUT_BUFFER / ((long) WORLD_SIZE * cellText), 1);
+	size_t bufferSize = (size_t) blockRows * WORLD_SIZE * cellText;
+	char *buffers = malloc(bufferSize * threads);
+	unsigned char *rows = malloc((size_t) 2 * WORLD_SIZE * threads);
+	struct iovec *blocks = malloc(sizeof(struct iovec) * threads);
+
+	int row, t;
+	for (row = 0; row < WORLD_SIZE; row += blockRows * threads) {
+		#pragma omp parallel for private(t)
+		for (t = 0; t < threads; t++) {
+			char *buffer = buffers + bufferSize * t;
+			unsigned char *populated = rows + (size_t) 2 * WORLD_SIZE * t;
+			unsigned char *types = populated + WORLD_SIZE;
+			char *text = buffer;
+			int i;
+			for (i = row + t*blockRows; i < min(row + (t+1)*blockRows, WORLD_SIZE); i++) {
+				if (BINARY) {
+					generateRow(i, populated, (unsigned char *) text);
+					text += WORLD_SIZE;
+				} else {
+					generateRow(i, populated, types);
+					text = formatRow(text, i, types);
+				}
+			}
+			blocks[t].iov_base = buffer;
+			blocks[t].iov_len = text - buffer;
+		}
+		writeBlocks(blocks, threads);
+	}
+
+	free(buffers);
+	free(rows);
+	free(blocks);
+}
+
+int main(int argc, char **argv) {
+	if (argc < NUM_ARGUMENTS) {
+		fprintf(stderr, "Usage: %s size [options] > map\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	parseOptions(argc, argv);
+	initClusters();
+
+	double start = omp_get_wtime();
+	writeHeader();
+	generateWorld();
+	fprintf(stderr, "Took %f\n", omp_get_wtime() - start);
+
+	free(clusters);
+	return 0;
+}
@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define EMPTY 0
+#define WOLF 1
+#define SQUIRREL 2
+#define TREE 3
+#define ICE 4
+#define SQUIRREL_ON_TREE 5
+
+// Trajectories start with these 8 bytes, the world's size and the
+// keyframe interval as 32 bit integers, and then hold a frame per
+// generation, as written by the serial and omp builds' --trajectory
+#define TRAJECTORY_MAGIC "WSQTRJ01"
+#define TRAJECTORY_MAGIC_SIZE 8
+#define TRAJECTORY_HEADER_SIZE 16
+#define KEYFRAME 0
+#define DELTA_FRAME 1
+
+// A frame of the trajectory, its rows from data to end
+typedef struct {
+	int kind;
+	long generation;
+	const unsigned char *data;
+	const unsigned char *end;
+	const unsigned char *next;
+} frame_t;
+
+char ttoa(unsigned char type);
+const unsigned char *mapFile(const char *name, size_t *size);
+void corrupted();
+const unsigned char *parseVarint(const unsigned char *p, const unsigned char *end, unsigned long *value);
+const unsigned char *parseFrame(const unsigned char *p, frame_t *frame);
+void decodeKeyframe(frame_t *frame);
+void decodeDeltaFrame(frame_t *frame);
+void printWorld();
+
+const int NUM_ARGUMENTS = 3;
+int WORLD_SIZE;
+unsigned char *world;
+const unsigned char *trajectory_end;
+
+char ttoa(unsigned char type) {
+	switch (type) {
+		case WOLF:             return 'w';
+		case SQUIRREL:         return 's';
+		case ICE:              return 'i';
+		case TREE:             return 't';
+		case SQUIRREL_ON_TREE: return '$';
+	}
+
+	corrupted();
+	return ' ';
+}
+
+const unsigned char *mapFile(const char *name, size_t *size) {
+	int fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "File %s not found...\n", name);
+		exit(EXIT_FAILURE);
+	}
+
+	struct stat info;
+	if ((fstat(fd, &info) != 0) || (info.st_size == 0)) {
+		fprintf(stderr, "Can't read the trajectory's size\n");
+		exit(EXIT_FAILURE);
+	}
+	*size = info.st_size;
+
+	const unsigned char *map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Can't map %s in memory\n", name);
+		exit(EXIT_FAILURE);
+	}
+	return map;
+}
+
+void corrupted() {
+	fprintf(stderr, "The trajectory is corrupted\n");
+	exit(EXIT_FAILURE);
+}
+
+// Reads a varint, 7 bits per byte from the lowest ones, returning where
+// it ends
+const unsigned char *parseVarint(const unsigned char *p, const unsigned char *end, unsigned long *value) {
+	int shift = 0;
+	*value = 0;
+	while ((p < end) && (shift < 64)) {
+		*value |= (unsigned long) (*p & 0x7f) << shift;
+		if ((*p++ & 0x80) == 0) {
+			return p;
+		}
+		shift += 7;
+	}
+
+	corrupted();
+	return NULL;
+}
+
+// Reads the length, kind and generation of the frame at p, returning
+// where the next one starts, without decoding its rows
+const unsigned char *parseFrame(const unsigned char *p, frame_t *frame) {
+	unsigned long length, generation;
+	p = parseVarint(p, trajectory_end, &length);
+	if ((length < 2) || (length > (unsigned long) (trajectory_end - p))) {
+		corrupted();
+	}
+	frame->next = p + length;
+	frame->kind = *p++;
+	frame->data = parseVarint(p, frame->next, &generation);
+	frame->generation = generation;
+	frame->end = frame->next;
+	return frame->next;
+}
+
+// Keyframes hold every row as runs of a type, each a varint of the
+// run's length minus one shifted left by 3 bits plus the type
+void decodeKeyframe(frame_t *frame) {
+	const unsigned char *p = frame->data;
+	size_t cell = 0;
+	size_t cells = (size_t) WORLD_SIZE * WORLD_SIZE;
+	while (p < frame->end) {
+		unsigned long run;
+		p = parseVarint(p, frame->end, &run);
+		size_t length = (run >> 3) + 1;
+		if (length > cells - cell) {
+			corrupted();
+		}
+		memset(world + cell, run & 0x07, length);
+		cell += length;
+	}
+	if (cell != cells) {
+		corrupted();
+	}
+}
+
+// Other frames hold the rows that changed: the row, the number of
+// changes and, for each one, a varint of the columns skipped since the
+// previous change shifted left by 3 bits plus the new type
+void decodeDeltaFrame(frame_t *frame) {
+	const unsigned char *p = frame->data;
+	while (p < frame->end) {
+		unsigned long row, changes;
+		p = parseVarint(p, frame->end, &row);
+		p = parseVarint(p, frame->end, &changes);
+		if (row >= (unsigned long) WORLD_SIZE) {
+			corrupted();
+		}
+
+		unsigned long col = 0;
+		while (changes-- > 0) {
+			unsigned long change;
+			p = parseVarint(p, frame->end, &change);
+			col += change >> 3;
+			if (col >= (unsigned long) WORLD_SIZE) {
+				corrupted();
+			}
+			world[row*WORLD_SIZE + col] = change & 0x07;
+			col++;
+		}
+	}
+}
+
+// Prints the world as a map, its size and a "row col type" line per
+// cell that isn't empty
+void printWorld() {
+	printf("%d\n", WORLD_SIZE);
+
+	int row, col;
+	for (row = 0; row < WORLD_SIZE; row++) {
+		for (col = 0; col < WORLD_SIZE; col++) {
+			unsigned char type = world[(size_t) row*WORLD_SIZE + col];
+			if (type != EMPTY) {
+				printf("%d %d %c\n", row, col, ttoa(type));
+			}
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	if (argc < NUM_ARGUMENTS) {
+		fprintf(stderr, "Usage: %s trajectory generation\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	long generation = atol(argv[2]);
+
+	size_t size;
+	const unsigned char *map = mapFile(argv[1], &size);
+	if ((size < TRAJECTORY_HEADER_SIZE) || (memcmp(map, TRAJECTORY_MAGIC, TRAJECTORY_MAGIC_SIZE) != 0)) {
+		fprintf(stderr, "%s isn't a trajectory\n", argv[1]);
+		exit(EXIT_FAILURE);
+	}
+	int32_t header[2];
+	memcpy(header, map + TRAJECTORY_MAGIC_SIZE, sizeof(header));
+	WORLD_SIZE = header[0];
+	if (WORLD_SIZE < 1) {
+		corrupted();
+	}
+	trajectory_end = map + size;
+
+	// Skips from frame to frame to the last keyframe before the
+	// generation, and then applies the changes after it
+	const unsigned char *keyframe = NULL;
+	const unsigned char *p = map + TRAJECTORY_HEADER_SIZE;
+	frame_t frame;
+	while (p < trajectory_end) {
+		const unsigned char *next = parseFrame(p, &frame);
+		if (frame.generation > generation) {
+			break;
+		}
+		if (frame.kind == KEYFRAME) {
+			keyframe = p;
+		} else if (frame.kind != DELTA_FRAME) {
+			corrupted();
+		}
+		p = next;
+	}
+	if (keyframe == NULL) {
+		fprintf(stderr, "Generation %ld isn't in the trajectory\n", generation);
+		exit(EXIT_FAILURE);
+	}
+
+	world = malloc((size_t) WORLD_SIZE * WORLD_SIZE);
+	p = keyframe;
+	do {
+		p = parseFrame(p, &frame);
+		if (frame.kind == KEYFRAME) {
+			decodeKeyframe(&frame);
+		} else {
+			decodeDeltaFrame(&frame);
+		}
+	} while ((frame.generation < generation) && (p < trajectory_end));
+
+	if (frame.generation != generation) {
+		fprintf(stderr, "Generation %ld isn't in the trajectory\n", generation);
+		exit(EXIT_FAILURE);
+	}
+
+	printWorld();
+	munmap((void *) map, size);
+	free(world);
+	return 0;
+}
@@ -1,7 +1,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
 #include <mpi.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #define MASTER 0
 #define FALSE 0
@@ -28,6 +36,45 @@ typedef enum {
 
 #define type_e unsigned char
 
+// Binary maps start with BINARY_MAGIC and the world's size as a 32 bit
+// integer, followed by the type of every cell of the world, a byte each,
+// row by row
+#define BINARY_MAGIC "WSQMAP01"
+#define BINARY_MAGIC_SIZE 8
+#define BINARY_HEADER_SIZE 12
+
+// Longest line expected in a text map
+#define MAX_LINE 256
+
+// Longest output line of a cell: two integers, a type and the separators
+#define MAX_CELL_TEXT 26
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// Fewest cells worth updating with threads, in the hybrid build
+#define PARALLEL_CELLS 4096
+
+// Formats of the result
+#define OUTPUT_TEXT 0
+#define OUTPUT_BINARY 1
+
+// How border lines are sent to the neighbours: as they are, or in the
+// smallest of the encodings below
+#define HALO_RAW 0
+#define HALO_ADAPTIVE 1
+
+// Encodings of a border line, given by its first byte: the position and
+// value of each cell that isn't empty, or every cell (the types packed in
+// 3 bits each). A line with every cell empty is sent as an empty message.
+#define ENCODING_EMPTY 0
+#define ENCODING_SPARSE 1
+#define ENCODING_DENSE 2
+
+// Digests are the sums of the cells' digests over the whole world and
+// over each of the DIGEST_REGIONS x DIGEST_REGIONS regions it's split in
+#define DIGEST_REGIONS 4
+
 typedef struct {
 	type_e type;
 	unsigned char breeding_period;
@@ -38,6 +85,24 @@ typedef struct {
 typedef world_pos **world_t;
 typedef world_pos *world_pos_t;
 
+// Phases the run's time is split in, the same as in the serial and omp
+// versions. Num phases must always be the last one
+typedef enum {
+	PHASE_PARSE = 0,
+	PHASE_CULL = 1,
+	PHASE_COPY = 2,
+	PHASE_RED = 3,
+	PHASE_BLACK = 4,
+	PHASE_BREED = 5,
+	PHASE_SWEEP = 6,
+	PHASE_EXCHANGE = 7,
+	PHASE_CHECKPOINT = 8,
+	PHASE_TRAJECTORY = 9,
+	PHASE_DIGEST = 10,
+	PHASE_OUTPUT = 11,
+	NUM_PHASES = 12
+} phase_e;
+
 const int NUM_ARGUMENTS = 6;
 int WORLD_SIZE;
 int WOLF_BREEDING_LEVEL;
@@ -48,29 +113,144 @@ int NUM_GENERATIONS;
 int processor_id;
 int num_processors;
 
-unsigned char *top_send_line = NULL;
-unsigned char *bottom_send_line = NULL;
-
-unsigned char *top_line = NULL;
-world_pos_t top_changed_line = NULL;
+// The world is split in a grid of grid_cols x grid_rows sections, one
+// per process in row-major order, with grid_comm as its cartesian
+// communicator. Each process talks to the process next to it in each
+// direction, MPI_PROC_NULL at the world's edges.
+int grid_cols = 0;
+int grid_rows = 0;
+int neighbours[4];
+MPI_Comm grid_comm;
+
+// Line where the sections of each row of the grid start, and where
+// the last one ends
+int *line_starts = NULL;
+
+// Every rebalance_period generations (never when 0) lines move between
+// the processes of a grid of strips so that they all spend about the
+// same time computing. compute_time is the time spent computing since
+// the last rebalance.
+int rebalance_period = 0;
+double compute_time = 0;
+
+// With halo_lines ghost lines (none when 0), a grid of strips keeps
+// copies of that many lines of the processes above and below, in the
+// halo_top_lines first and halo_bottom_lines last lines of the section.
+// Every sub-generation only spoils the two outermost valid lines, so
+// the strips work on their own, as if the world ended at their ghost
+// lines, and only trade lines with halo_neighbours every halo_lines/4
+// generations.
+int halo_lines = 0;
+int halo_top_lines = 0;
+int halo_bottom_lines = 0;
+int halo_neighbours[4];
+
+// The result is written to output_name, in output_format, with every
+// process writing its own section, or printed by the Master process
+// when there is no output_name
+char *output_name = NULL;
+int output_format = OUTPUT_TEXT;
+
+// Indexed by the direction of the border: the types of the section's
+// border, the types of the neighbour's border just outside of it, the
+// animals that moved out of the section over it and the ones that
+// moved into the section over it
+unsigned char *send_lines[4];
+unsigned char *outside_lines[4];
+world_pos_t changed_lines[4];
+world_pos_t received_lines[4];
+
+// With the adaptive halo_encoding, the encoded version of each of the
+// border lines. halo_messages counts the messages sent in each encoding,
+// with their bytes and the largest one, and halo_bytes the bytes sent and
+// the bytes the raw lines would take. An exchange is the messages sent to
+// the neighbours at once, halo_exchange_bytes the ones of the current one.
+int halo_encoding = HALO_ADAPTIVE;
+int halo_stats = FALSE;
+unsigned char *encoded_send_lines[4];
+unsigned char *encoded_outside_lines[4];
+unsigned char *encoded_changed_lines[4];
+unsigned char *encoded_received_lines[4];
+long long halo_messages[3];
+long long halo_message_bytes[3];
+int halo_max_message[3];
+long long halo_bytes = 0;
+long long halo_raw_bytes = 0;
+long long halo_exchanges = 0;
+long long halo_exchange_bytes = -1;
+long long halo_max_exchange = 0;
+
+// The digest of the world is printed on stderr by the Master process
+// after every generation, adding up the digests of every section
+int print_digests = FALSE;
+
+// The time of every phase is added up in phase_times, from phase_clock
+// to the end of the phase, and written to timings_file by the Master
+// process as JSON, with the slowest process' time for each phase and
+// the cells updated and the moves of animals per second. A move is a
+// cell an animal moved into, counted by the process owning the cell.
+char *timings_file = NULL;
+const char *PHASE_NAMES[NUM_PHASES] = {
+	"parse", "cull", "copy", "red", "black", "breed", "sweep",
+	"exchange", "checkpoint", "trajectory", "digest", "output"
+};
+double phase_times[NUM_PHASES];
+double phase_clock = 0;
+long animal_moves = 0;
+
+// Communication plan, built once the borders are allocated and again
+// whenever they change: persistent requests receiving (first 4) and
+// sending (last 4) the border types and the changed lines, by direction,
+// and the ones trading the ghost lines of the deep halo mode. Encoded
+// lines change length every time, so the adaptive encoding sends them
+// with a new MPI_Isend in the sending slots.
+MPI_Request types_requests[8];
+MPI_Request changes_requests[8];
+MPI_Request halo_requests[4];
+int num_halo_requests = 0;
 
 world_t old_world_section = NULL;
 world_t new_world_section = NULL;
 
-world_pos_t bottom_changed_line = NULL;
-unsigned char *bottom_line = NULL;
 int section_lines = 0;
-int start_with_black = 0;
+int section_cols = 0;
 int real_row_start = 0;
+int real_col_start = 0;
 
 /* Function that returns the number of a position, given a row and a column. */ 
 int numberOfPosition(int row, int col) {
 	return row*WORLD_SIZE + col;
 }
 
+/* Function that returns the length of a part, when splitting a length in a number of parts. */
+int blockLength(int length, int parts, int part) {
+	return (length / parts) + (part < (length % parts));
+}
+
+/* Function that returns where a part starts, when splitting a length in a number of parts. */
+int blockStart(int length, int parts, int part) {
+	return part*(length / parts) + min(part, length % parts);
+}
+
 /* Function that returns the number of world section lines of a given process. */
 int numberLinesForProcess(int process_id) {
-	return ((WORLD_SIZE / num_processors) + ((WORLD_SIZE + (WORLD_SIZE%num_processors))/(WORLD_SIZE + process_id + 1)));
+	int gridRow = process_id / grid_cols;
+	return line_starts[gridRow+1] - line_starts[gridRow];
+}
+
+/* Function that returns the number of world section columns of a given process. */
+int numberColsForProcess(int process_id) {
+	return blockLength(WORLD_SIZE, grid_cols, process_id % grid_cols);
+}
+
+/* Function that returns the length of the section's border in a given direction. */
+int borderLength(move_e direction) {
+	return ((direction == TOP) || (direction == BOTTOM)) ? section_cols : section_lines;
+}
+
+/* Function that returns the opposite direction of a given one. */
+move_e oppositeMove(move_e move) {
+	return (move + 2) % 4;
 }
 
 /* Function that converts a given char into unsigned char, it's used when reading */
@@ -106,135 +286,723 @@ char ttoa(unsigned char type) {
 	exit(EXIT_FAILURE);
 }
 
-/* Function to initialize each process world section and respective lines to send to */
-/* other processes. */
-void init_proc_section(FILE *file, char **argv) {
+/* Function that parses the options given after the arguments. */
+void parseOptions(int argc, char **argv) {
+	int i;
+	for (i = NUM_ARGUMENTS; i < argc; i++) {
+		if ((strcmp(argv[i], "--grid") == 0) && (i+1 < argc)) {
+			if (sscanf(argv[++i], "%dx%d", &grid_cols, &grid_rows) != 2) {
+				fprintf(stderr, "Unknown grid: %s\n", argv[i]);
+				MPI_Finalize();
+				exit(EXIT_FAILURE);
+			}
+		} else if ((strcmp(argv[i], "--rebalance") == 0) && (i+1 < argc)) {
+			rebalance_period = atoi(argv[++i]);
+		} else if ((strcmp(argv[i], "--halo") == 0) && (i+1 < argc)) {
+			halo_lines = atoi(argv[++i]);
+		} else if ((strcmp(argv[i], "--halo-encoding") == 0) && (i+1 < argc)) {
+			i++;
+			if (strcmp(argv[i], "raw") == 0) {
+				halo_encoding = HALO_RAW;
+			} else if (strcmp(argv[i], "adaptive") == 0) {
+				halo_encoding = HALO_ADAPTIVE;
+			} else {
+				fprintf(stderr, "Unknown halo encoding: %s\n", argv[i]);
+				MPI_Finalize();
+				exit(EXIT_FAILURE);
+			}
+		} else if (strcmp(argv[i], "--halo-stats") == 0) {
+			halo_stats = TRUE;
+		} else if (strcmp(argv[i], "--digest") == 0) {
+			print_digests = TRUE;
+		} else if ((strcmp(argv[i], "--timings") == 0) && (i+1 < argc)) {
+			timings_file = argv[++i];
+		} else if ((strcmp(argv[i], "--output") == 0) && (i+1 < argc)) {
+			output_name = argv[++i];
+		} else if ((strcmp(argv[i], "--output-format") == 0) && (i+1 < argc)) {
+			i++;
+			if (strcmp(argv[i], "text") == 0) {
+				output_format = OUTPUT_TEXT;
+			} else if (strcmp(argv[i], "binary") == 0) {
+				output_format = OUTPUT_BINARY;
+			} else {
+				fprintf(stderr, "Unknown output format: %s\n", argv[i]);
+				MPI_Finalize();
+				exit(EXIT_FAILURE);
+			}
+		} else {
+			fprintf(stderr, "Unknown option: %s\n", argv[i]);
+			MPI_Finalize();
+			exit(EXIT_FAILURE);
+		}
+	}
 
-	if (fscanf(file, "%d", &WORLD_SIZE) == 0) {
+	if ((output_format == OUTPUT_BINARY) && (output_name == NULL)) {
+		fprintf(stderr, "The binary output format needs an --output file\n");
+		MPI_Finalize();
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Function that extends the section with the ghost lines of the deep halo mode, and leaves the */
+/* process without neighbours between exchanges of ghost lines. */
+void initHalo() {
+	if ((halo_lines < 4) || (grid_cols != 1) || (rebalance_period > 0)
+			|| ((grid_rows > 1) && (WORLD_SIZE / grid_rows < halo_lines))) {
+		if (processor_id == MASTER) {
+			fprintf(stderr, "A halo of %d lines needs a grid of strips (1xN) of at least as many lines, "
+					"at least 4 of them and no rebalancing\n", halo_lines);
+		}
+		MPI_Finalize();
+		exit(EXIT_FAILURE);
+	}
+
+	move_e d;
+	for (d = TOP; d < NONE; d++) {
+		halo_neighbours[d] = neighbours[d];
+		neighbours[d] = MPI_PROC_NULL;
+	}
+
+	halo_top_lines = (halo_neighbours[TOP] != MPI_PROC_NULL) ? halo_lines : 0;
+	halo_bottom_lines = (halo_neighbours[BOTTOM] != MPI_PROC_NULL) ? halo_lines : 0;
+	real_row_start -= halo_top_lines;
+	section_lines += halo_top_lines + halo_bottom_lines;
+}
+
+/* Function that picks the grid of sections when none is given: strips of lines while there are */
+/* enough lines for every process, and the squarest grid otherwise. Checks every process */
+/* gets at least a cell. */
+void initGrid() {
+	if (grid_cols == 0) {
+		int dims[2] = {num_processors, 1};
+		if (num_processors > WORLD_SIZE) {
+			dims[0] = 0;
+			dims[1] = 0;
+			MPI_Dims_create(num_processors, 2, dims);
+		}
+		grid_rows = dims[0];
+		grid_cols = dims[1];
+	}
+
+	if ((grid_cols < 1) || (grid_rows < 1) || (grid_cols*grid_rows != num_processors)
+			|| (grid_cols > WORLD_SIZE) || (grid_rows > WORLD_SIZE)) {
+		if (processor_id == MASTER) {
+			fprintf(stderr, "Can't split a world of size %d in %dx%d sections for %d processes\n",
+					WORLD_SIZE, grid_cols, grid_rows, num_processors);
+		}
 		MPI_Finalize();
 		exit(EXIT_FAILURE);
 	}
 
-	WOLF_BREEDING_LEVEL = atoi(argv[2]);
-	SQUIRREL_BREEDING_LEVEL = atoi(argv[3]);
-	WOLF_STARVING_LEVEL = atoi(argv[4]);
-	NUM_GENERATIONS = atoi(argv[5]);
+	if ((rebalance_period > 0) && (grid_cols != 1)) {
+		if (processor_id == MASTER) {
+			fprintf(stderr, "Can only rebalance a grid of strips (1xN)\n");
+		}
+		MPI_Finalize();
+		exit(EXIT_FAILURE);
+	}
 
 	int i;
+	line_starts = malloc(sizeof(int) * (grid_rows+1));
+	for (i = 0; i <= grid_rows; i++) {
+		line_starts[i] = blockStart(WORLD_SIZE, grid_rows, i);
+	}
+
+	// Keeps the ranks, the output is joined in the order of the processes
+	int dims[2] = {grid_rows, grid_cols};
+	int periods[2] = {FALSE, FALSE};
+	MPI_Cart_create(MPI_COMM_WORLD, 2, dims, periods, FALSE, &grid_comm);
+	MPI_Cart_shift(grid_comm, 0, 1, &neighbours[TOP], &neighbours[BOTTOM]);
+	MPI_Cart_shift(grid_comm, 1, 1, &neighbours[LEFT], &neighbours[RIGHT]);
+
+	int gridRow = processor_id / grid_cols;
+	int gridCol = processor_id % grid_cols;
+
 	section_lines = numberLinesForProcess(processor_id);
+	section_cols = numberColsForProcess(processor_id);
+	real_row_start = line_starts[gridRow];
+	real_col_start = blockStart(WORLD_SIZE, grid_cols, gridCol);
 
-	top_send_line = malloc(WORLD_SIZE*sizeof(unsigned char));
-	bottom_send_line = malloc(WORLD_SIZE*sizeof(unsigned char));
-	if (processor_id != num_processors-1) {
-		bottom_changed_line = malloc(sizeof(world_pos) * WORLD_SIZE);
-		bottom_line = malloc(sizeof(unsigned char) * WORLD_SIZE); 
-		memset(bottom_changed_line, 0, sizeof(world_pos) * WORLD_SIZE);	
+	if (halo_lines > 0) {
+		initHalo();
 	}
+}
 
-	if (processor_id != MASTER) {
-		top_changed_line = malloc(sizeof(world_pos) * WORLD_SIZE);
-		top_line = malloc(sizeof(unsigned char) * WORLD_SIZE);
-		memset(top_changed_line, 0, sizeof(world_pos) * WORLD_SIZE);
+/* Function that returns the longest encoding of a line of types of a given length. */
+int maxEncodedTypes(int length) {
+	return 1 + (3*length + 7) / 8;
+}
+
+/* Function that returns the longest encoding of a line of positions of a given length. */
+int maxEncodedChanges(int length) {
+	return 1 + length * sizeof(world_pos);
+}
+
+/* Function that (re)allocates the lines of the section's border in a given direction. */
+void allocBorder(move_e direction) {
+	int length = borderLength(direction);
+	send_lines[direction] = realloc(send_lines[direction], sizeof(unsigned char) * length);
+	outside_lines[direction] = realloc(outside_lines[direction], sizeof(unsigned char) * length);
+	changed_lines[direction] = realloc(changed_lines[direction], sizeof(world_pos) * length);
+	received_lines[direction] = realloc(received_lines[direction], sizeof(world_pos) * length);
+	encoded_send_lines[direction] = realloc(encoded_send_lines[direction], maxEncodedTypes(length));
+	encoded_outside_lines[direction] = realloc(encoded_outside_lines[direction], maxEncodedTypes(length));
+	encoded_changed_lines[direction] = realloc(encoded_changed_lines[direction], maxEncodedChanges(length));
+	encoded_received_lines[direction] = realloc(encoded_received_lines[direction], maxEncodedChanges(length));
+	memset(changed_lines[direction], 0, sizeof(world_pos) * length);
+
+	// Nothing is ever received over the world's edges
+	memset(received_lines[direction], 0, sizeof(world_pos) * length);
+}
+
+/* Function that allocates both world sections with a given number of lines, all empty. */
+void allocSection(int lines) {
+	world_pos_t oldWorldSection = malloc(sizeof(world_pos) * section_cols * lines);
+	world_pos_t newWorldSection = malloc(sizeof(world_pos) * section_cols * lines);
+	memset(oldWorldSection, 0, sizeof(world_pos) * lines * section_cols);
+	memset(newWorldSection, 0, sizeof(world_pos) * lines * section_cols);
+	old_world_section = malloc(sizeof(world_pos_t) * lines);
+	new_world_section = malloc(sizeof(world_pos_t) * lines);
+
+	int i;
+	for (i = 0; i < lines; i++) {
+		new_world_section[i] = newWorldSection + i*section_cols;
+		old_world_section[i] = oldWorldSection + i*section_cols;
+	}
+}
+
+/* Function that reads the map's header on the Master process, and sends the world's size and the */
+/* arguments to every process. Returns whether the map is a binary one. */
+int init_parameters(MPI_File file, char **argv) {
+	int parameters[6];
+	if (processor_id == MASTER) {
+		char header[MAX_LINE+1];
+		MPI_Status status;
+		int length;
+		MPI_File_read_at(file, 0, header, MAX_LINE, MPI_CHAR, &status);
+		MPI_Get_count(&status, MPI_CHAR, &length);
+		header[length] = '\0';
+
+		parameters[0] = -1;
+		parameters[5] = (length >= BINARY_HEADER_SIZE) && (memcmp(header, BINARY_MAGIC, BINARY_MAGIC_SIZE) == 0);
+		if (parameters[5]) {
+			int32_t size;
+			memcpy(&size, header + BINARY_MAGIC_SIZE, sizeof(int32_t));
+			parameters[0] = size;
+		} else if (sscanf(header, "%d", &parameters[0]) != 1) {
+			parameters[0] = -1;
+		}
+		parameters[1] = atoi(argv[2]);
+		parameters[2] = atoi(argv[3]);
+		parameters[3] = atoi(argv[4]);
+		parameters[4] = atoi(argv[5]);
 	}
 
-	world_pos_t oldWorldSection = malloc(sizeof(world_pos) * WORLD_SIZE * section_lines);
-	world_pos_t newWorldSection = malloc(sizeof(world_pos) * WORLD_SIZE * section_lines);
-	memset(oldWorldSection, 0, sizeof(world_pos) * section_lines * WORLD_SIZE);
-	memset(newWorldSection, 0, sizeof(world_pos) * section_lines * WORLD_SIZE);
-	old_world_section = malloc(sizeof(world_pos_t) * section_lines);
-	new_world_section = malloc(sizeof(world_pos_t) * section_lines);
+	MPI_Bcast(parameters, 6, MPI_INT, MASTER, MPI_COMM_WORLD);
+	if (parameters[0] < 1) {
+		if (processor_id == MASTER) {
+			fprintf(stderr, "Can't read the world's size\n");
+		}
+		MPI_Finalize();
+		exit(EXIT_FAILURE);
+	}
 
+	WORLD_SIZE = parameters[0];
+	WOLF_BREEDING_LEVEL = parameters[1];
+	SQUIRREL_BREEDING_LEVEL = parameters[2];
+	WOLF_STARVING_LEVEL = parameters[3];
+	NUM_GENERATIONS = parameters[4];
+	return parameters[5];
+}
 
-	for (i = 0; i < section_lines; i++) {
-		new_world_section[i] = newWorldSection + i*WORLD_SIZE;
-		old_world_section[i] = oldWorldSection + i*WORLD_SIZE;
+/* Function that returns which part a position falls in, when splitting a length in a number of parts. */
+int blockOf(int length, int parts, int position) {
+	int size = length / parts;
+	int bigger = length % parts;
+	if (position < bigger*(size+1)) {
+		return position / (size+1);
 	}
-	// initialize both worlds sections with the map
-	int row;
-	int col;
-	char type;
-	while (fscanf(file, "%d %d %c", &row, &col, &type) == 3) {
-		if ((row >= real_row_start) && (row < (real_row_start + section_lines))) {
-			new_world_section[row-real_row_start][col].type = atot(type);
-			old_world_section[row-real_row_start][col].type = atot(type);
+	return bigger + (position - bigger*(size+1)) / size;
+}
+
+/* Function that returns the processes whose section, with its ghost lines, holds a given position, */
+/* and how many there are. */
+int positionOwners(int row, int col, int *owners) {
+	int gridRow = blockOf(WORLD_SIZE, grid_rows, row);
+	int gridCol = blockOf(WORLD_SIZE, grid_cols, col);
+	int n = 0;
+	int i;
+	for (i = max(gridRow-1, 0); i <= min(gridRow+1, grid_rows-1); i++) {
+		int first = line_starts[i] - ((i > 0) ? halo_lines : 0);
+		int last = line_starts[i+1] + ((i+1 < grid_rows) ? halo_lines : 0);
+		if ((row >= first) && (row < last)) {
+			owners[n++] = i*grid_cols + gridCol;
 		}
 	}
+	return n;
 }
 
-/* Function that initializes master process world section, and sends to other processes */
-/* their world section first line index and a variable that indicates whether to start */ 
-/* with black or red. */
-void master_init(FILE *file, char **argv) {
-	
-	init_proc_section(file, argv);
+/* Function that sets a cell of both worlds sections, given its position in the world. */
+void init_cell(int row, int col, type_e type) {
+	new_world_section[row-real_row_start][col-real_col_start].type = type;
+	old_world_section[row-real_row_start][col-real_col_start].type = type;
+}
 
-	int start_black = 0 ^ (numberLinesForProcess(MASTER)%2);
-	int real_line_num = 0;
+/* Function that reads a text map. Each process reads an equal share of the file's bytes and parses */
+/* the lines starting in it, which can be in any order, and then sends every cell to the processes */
+/* whose section holds it. */
+void init_text_section(MPI_File file) {
+	MPI_Offset size;
+	MPI_File_get_size(file, &size);
+	MPI_Offset start = size * processor_id / num_processors;
+	MPI_Offset end = size * (processor_id+1) / num_processors;
+
+	// Also reads the byte before, to know whether a line starts right at the start,
+	// and enough bytes after to finish the last line
+	MPI_Offset from = max(start-1, 0);
+	MPI_Offset to = min(end + MAX_LINE, size);
+	char *chunk = malloc(to - from + 1);
+
+	// A read takes at most INT_MAX bytes, and every process has to make
+	// as many of them as the others since they are collective
+	long long pieces = (to - from + INT_MAX - 1) / INT_MAX;
+	MPI_Allreduce(MPI_IN_PLACE, &pieces, 1, MPI_LONG_LONG, MPI_MAX, MPI_COMM_WORLD);
+	MPI_Offset read = 0;
+	for (; pieces > 0; pieces--) {
+		int count = (int) min(to - from - read, (MPI_Offset) INT_MAX);
+		MPI_File_read_at_all(file, from + read, chunk + read, count, MPI_CHAR, MPI_STATUS_IGNORE);
+		read += count;
+	}
+	chunk[to - from] = '\0';
+
+	// The first line holds the world's size
+	char *line = chunk + (start - from);
+	char *chunkEnd = chunk + (end - from);
+	if ((start == 0) || (*(line-1) != '\n')) {
+		while ((line < chunkEnd) && (*line != '\n')) {
+			line++;
+		}
+		line++;
+	}
 
-	int i;
-	for (i = 1; i < num_processors; ++i) {
-		real_line_num += numberLinesForProcess(i-1);
-		MPI_Send(&real_line_num, 1, MPI_INT, i, i, MPI_COMM_WORLD);
-		MPI_Send(&start_black, 1, MPI_INT, i, i, MPI_COMM_WORLD);
-		start_black ^= (numberLinesForProcess(i)%2);
+	int capacity = 1024;
+	int numCells = 0;
+	int *cells = malloc(sizeof(int) * 3 * capacity);
+	while (line < chunkEnd) {
+		char *next = memchr(line, '\n', (chunk + (to - from)) - line);
+		if (next == NULL) {
+			if (to < size) {
+				fprintf(stderr, "Line longer than %d characters at byte %lld\n", MAX_LINE, (long long) (from + (line - chunk)));
+				MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+			}
+			next = chunk + (to - from);
+		}
+		*next = '\0';
+
+		int row, col;
+		char type;
+		line += strspn(line, " \t\r");
+		if (*line == '\0') {
+			line = next + 1;
+			continue;
+		}
+		if (sscanf(line, "%d %d %c", &row, &col, &type) != 3) {
+			fprintf(stderr, "Can't read the map at byte %lld\n", (long long) (from + (line - chunk)));
+			MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+		}
+
+		// Positions outside of the world are ignored
+		if ((row >= 0) && (row < WORLD_SIZE) && (col >= 0) && (col < WORLD_SIZE)) {
+			if (numCells == capacity) {
+				capacity *= 2;
+				cells = realloc(cells, sizeof(int) * 3 * capacity);
+			}
+			cells[3*numCells] = row;
+			cells[3*numCells+1] = col;
+			cells[3*numCells+2] = atot(type);
+			numCells++;
+		}
+		line = next + 1;
+	}
+	free(chunk);
+
+	// Sends every cell to its processes, grouped by process
+	int *sendCounts = calloc(num_processors, sizeof(int));
+	int *sendDispls = malloc(sizeof(int) * num_processors);
+	int *receiveCounts = malloc(sizeof(int) * num_processors);
+	int *receiveDispls = malloc(sizeof(int) * num_processors);
+	int owners[3];
+	int i, n, k;
+	for (i = 0; i < numCells; i++) {
+		k = positionOwners(cells[3*i], cells[3*i+1], owners);
+		for (n = 0; n < k; n++) {
+			sendCounts[owners[n]] += 3;
+		}
+	}
+	MPI_Alltoall(sendCounts, 1, MPI_INT, receiveCounts, 1, MPI_INT, MPI_COMM_WORLD);
+
+	int sendTotal = 0;
+	int receiveTotal = 0;
+	for (n = 0; n < num_processors; n++) {
+		sendDispls[n] = sendTotal;
+		receiveDispls[n] = receiveTotal;
+		sendTotal += sendCounts[n];
+		receiveTotal += receiveCounts[n];
+	}
+
+	int *sendCells = malloc(sizeof(int) * max(sendTotal, 1));
+	int *receiveCells = malloc(sizeof(int) * max(receiveTotal, 1));
+	memset(sendCounts, 0, sizeof(int) * num_processors);
+	for (i = 0; i < numCells; i++) {
+		k = positionOwners(cells[3*i], cells[3*i+1], owners);
+		for (n = 0; n < k; n++) {
+			memcpy(sendCells + sendDispls[owners[n]] + sendCounts[owners[n]], cells + 3*i, sizeof(int) * 3);
+			sendCounts[owners[n]] += 3;
+		}
+	}
+	free(cells);
+
+	MPI_Alltoallv(sendCells, sendCounts, sendDispls, MPI_INT, receiveCells, receiveCounts, receiveDispls, MPI_INT, MPI_COMM_WORLD);
+	for (i = 0; i < receiveTotal; i += 3) {
+		init_cell(receiveCells[i], receiveCells[i+1], receiveCells[i+2]);
+	}
+
+	free(sendCells);
+	free(receiveCells);
+	free(sendCounts);
+	free(sendDispls);
+	free(receiveCounts);
+	free(receiveDispls);
+}
+
+/* Function that reads a binary map. Each process reads the bytes of its section, with its ghost */
+/* lines, through a view of the file. */
+void init_binary_section(MPI_File file) {
+	int sizes[2] = {WORLD_SIZE, WORLD_SIZE};
+	int subsizes[2] = {section_lines, section_cols};
+	int starts[2] = {real_row_start, real_col_start};
+	MPI_Datatype section;
+	MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C, MPI_BYTE, &section);
+	MPI_Type_commit(&section);
+
+	unsigned char *types = malloc((size_t) section_lines * section_cols);
+	MPI_File_set_view(file, BINARY_HEADER_SIZE, MPI_BYTE, section, "native", MPI_INFO_NULL);
+	MPI_File_read_all(file, types, section_lines * section_cols, MPI_BYTE, MPI_STATUS_IGNORE);
+	MPI_Type_free(&section);
+
+	int i, j;
+	for (i = 0; i < section_lines; i++) {
+		for (j = 0; j < section_cols; j++) {
+			type_e type = types[i*section_cols + j];
+			if (type > SQUIRREL_ON_TREE) {
+				fprintf(stderr, "Unknown type: %d\n", type);
+				MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+			}
+			init_cell(real_row_start + i, real_col_start + j, type);
+		}
 	}
+	free(types);
 }
 
-/* Function that initializes the process world section, and receives its world section first */
-/* line index and a variable that indicates whether to start with black or red. */
-void proc_init(FILE *file, char **argv) {
+/* Function to initialize each process world section and respective lines to send to */
+/* other processes. */
+void init_proc_section(MPI_File file, char **argv) {
+	int binary = init_parameters(file, argv);
+
+	initGrid();
+
+	move_e d;
+	for (d = TOP; d < NONE; d++) {
+		allocBorder(d);
+	}
 
-	MPI_Recv(&real_row_start, 1, MPI_INT, MASTER, processor_id, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-	init_proc_section(file, argv);	
-	MPI_Recv(&start_with_black, 1, MPI_INT, MASTER, processor_id, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+	allocSection(section_lines);
+
+	// initialize both worlds sections with the map
+	if (binary) {
+		init_binary_section(file);
+	} else {
+		init_text_section(file);
+	}
 }
 
-/* Function that sends the process world section to the Master process. */ 
-void proc_final() {
-	int section_size = sizeof(world_pos)*WORLD_SIZE*section_lines;
-	MPI_Send(*new_world_section, section_size, MPI_BYTE, MASTER, processor_id, MPI_COMM_WORLD);
+/* Function that writes the digits of a non negative integer, returning where they end. */
+char *formatInt(char *text, int value) {
+	char digits[10];
+	int n = 0;
+	do {
+		digits[n++] = '0' + value % 10;
+		value /= 10;
+	} while (value > 0);
+
+	while (n > 0) {
+		*text++ = digits[--n];
+	}
+	return text;
 }
 
-/* Function that prints a given world section. */
-void printSection(world_t section, int sectionLines, int row) {
-	int i,j;
-	for (i = 0; i < sectionLines; i++) {
-		for (j = 0; j < WORLD_SIZE; j++) {
-			if (section[i][j].type != EMPTY){
-				fprintf(stdout, "%d %d %c\n", row+i,j, ttoa(section[i][j].type));
+/* Function that writes blocks of text to stdout, as many at a time as the system takes. */
+void writeBlocks(struct iovec *blocks, int count) {
+	while (count > 0) {
+		ssize_t written = writev(STDOUT_FILENO, blocks, min(count, IOV_MAX));
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
 			}
+			fprintf(stderr, "Can't print the world\n");
+			MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+		}
+
+		while ((count > 0) && ((size_t) written >= blocks->iov_len)) {
+			written -= blocks->iov_len;
+			blocks++;
+			count--;
+		}
+		if (count > 0) {
+			blocks->iov_base = (char *) blocks->iov_base + written;
+			blocks->iov_len -= written;
 		}
 	}
 }
 
-/* Function that receives each process' world section and prints it ordered by processor id. */
+/* Function that formats the non-empty cells of the process world section, returning the text */
+/* and the number of characters of each of its lines. */
+char *formatSection(int *lineLengths) {
+	int lines = numberLinesForProcess(processor_id);
+	int i, j, cells = 0;
+	for (i = 0; i < lines; i++) {
+		for (j = 0; j < section_cols; j++) {
+			cells += (new_world_section[halo_top_lines+i][j].type != EMPTY);
+		}
+	}
+
+	char *text = malloc((size_t) cells * MAX_CELL_TEXT + 1);
+	char *end = text;
+	for (i = 0; i < lines; i++) {
+		world_pos_t line = new_world_section[halo_top_lines+i];
+		char rowText[12];
+		int rowLength = formatInt(rowText, real_row_start + halo_top_lines + i) - rowText;
+		rowText[rowLength++] = ' ';
+
+		char *lineStart = end;
+		for (j = 0; j < section_cols; j++) {
+			if (line[j].type != EMPTY) {
+				memcpy(end, rowText, rowLength);
+				end = formatInt(end + rowLength, real_col_start + j);
+				*end++ = ' ';
+				*end++ = ttoa(line[j].type);
+				*end++ = '\n';
+			}
+		}
+		lineLengths[i] = end - lineStart;
+	}
+	return text;
+}
+
+/* Function that sends the text of the process world section to the Master process. */
+void proc_final() {
+	int lines = numberLinesForProcess(processor_id);
+	int *lineLengths = malloc(sizeof(int) * lines);
+	char *text = formatSection(lineLengths);
+
+	int i, length = 0;
+	for (i = 0; i < lines; i++) {
+		length += lineLengths[i];
+	}
+	MPI_Send(lineLengths, lines, MPI_INT, MASTER, processor_id, MPI_COMM_WORLD);
+	MPI_Send(text, length, MPI_CHAR, MASTER, processor_id, MPI_COMM_WORLD);
+
+	free(lineLengths);
+	free(text);
+}
+
+/* Function that prints the world, receiving the text of a row of the grid at a time and joining */
+/* the sections of each line. */
 void printWorld() {
-	int n;
+	int lines = numberLinesForProcess(MASTER);
+	int *masterLengths = malloc(sizeof(int) * lines);
+	char *masterText = formatSection(masterLengths);
+
+	// Whatever is buffered goes first
+	fflush(stdout);
+
+	char **texts = malloc(sizeof(char *) * grid_cols);
+	char **cursors = malloc(sizeof(char *) * grid_cols);
+	int **lineLengths = malloc(sizeof(int *) * grid_cols);
+	struct iovec *pieces = NULL;
+	int gridRow, gridCol, i;
+	for (gridRow = 0; gridRow < grid_rows; gridRow++) {
+		lines = numberLinesForProcess(gridRow*grid_cols);
+		for (gridCol = 0; gridCol < grid_cols; gridCol++) {
+			int n = gridRow*grid_cols + gridCol;
+			if (n == MASTER) {
+				texts[gridCol] = masterText;
+				lineLengths[gridCol] = masterLengths;
+				continue;
+			}
+
+			int length = 0;
+			lineLengths[gridCol] = malloc(sizeof(int) * lines);
+			MPI_Recv(lineLengths[gridCol], lines, MPI_INT, n, n, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+			for (i = 0; i < lines; i++) {
+				length += lineLengths[gridCol][i];
+			}
+			texts[gridCol] = malloc(length + 1);
+			MPI_Recv(texts[gridCol], length, MPI_CHAR, n, n, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+		}
+
+		// Prints each line, section after section, advancing through the texts
+		int numPieces = 0;
+		pieces = realloc(pieces, sizeof(struct iovec) * lines * grid_cols);
+		for (gridCol = 0; gridCol < grid_cols; gridCol++) {
+			cursors[gridCol] = texts[gridCol];
+		}
+		for (i = 0; i < lines; i++) {
+			for (gridCol = 0; gridCol < grid_cols; gridCol++) {
+				if (lineLengths[gridCol][i] > 0) {
+					pieces[numPieces].iov_base = cursors[gridCol];
+					pieces[numPieces].iov_len = lineLengths[gridCol][i];
+					numPieces++;
+				}
+				cursors[gridCol] += lineLengths[gridCol][i];
+			}
+		}
+		writeBlocks(pieces, numPieces);
 
-	printSection(new_world_section, section_lines, real_row_start);
-	int i, maxLines = 0 , procLines;
-	for (i = 0 ; i < num_processors ; i++) {
-		procLines = numberLinesForProcess(i);
-		if (procLines > maxLines) {
-			maxLines = procLines;
+		for (gridCol = 0; gridCol < grid_cols; gridCol++) {
+			if (gridRow*grid_cols + gridCol != MASTER) {
+				free(texts[gridCol]);
+				free(lineLengths[gridCol]);
+			}
 		}
 	}
-	void *buff = malloc(sizeof(world_pos) * maxLines * WORLD_SIZE);
-	world_t matrix_buff = malloc(sizeof(world_t) * maxLines);
-	for (i = 0; i < maxLines ;i++) {
-		matrix_buff[i] = buff + i*WORLD_SIZE*sizeof(world_pos);
+
+	free(texts);
+	free(cursors);
+	free(pieces);
+	free(lineLengths);
+	free(masterText);
+	free(masterLengths);
+}
+
+/* Function that writes the text of every process world section to a file at once. The lines of */
+/* a row of the grid go one after the other, each made of a piece of every section of the row, */
+/* so each process works out where its pieces go from the lengths of the pieces before them. */
+void writeText(MPI_File file) {
+	int lines = numberLinesForProcess(processor_id);
+	int *lineLengths = malloc(sizeof(int) * lines);
+	char *text = formatSection(lineLengths);
+
+	MPI_Comm gridRowComm;
+	MPI_Comm_split(MPI_COMM_WORLD, processor_id / grid_cols, processor_id % grid_cols, &gridRowComm);
+
+	long long *lengths = malloc(sizeof(long long) * lines);
+	long long *before = calloc(lines, sizeof(long long));
+	long long *lineTotals = malloc(sizeof(long long) * lines);
+	long long sectionLength = 0;
+	int i;
+	for (i = 0; i < lines; i++) {
+		lengths[i] = lineLengths[i];
+		sectionLength += lineLengths[i];
+	}
+
+	// Characters of each line in the sections to the left, and in the whole line
+	MPI_Exscan(lengths, before, lines, MPI_LONG_LONG, MPI_SUM, gridRowComm);
+	MPI_Allreduce(lengths, lineTotals, lines, MPI_LONG_LONG, MPI_SUM, gridRowComm);
+	if (processor_id % grid_cols == 0) {
+		memset(before, 0, sizeof(long long) * lines);
+	}
+
+	// Characters of the processes before this one, less the ones of the sections to the left,
+	// are the characters of the rows of the grid above
+	long long processesBefore = 0;
+	long long sectionsBefore = 0;
+	long long total;
+	MPI_Exscan(&sectionLength, &processesBefore, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+	MPI_Exscan(&sectionLength, &sectionsBefore, 1, MPI_LONG_LONG, MPI_SUM, gridRowComm);
+	MPI_Allreduce(&sectionLength, &total, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+	if (processor_id == MASTER) {
+		processesBefore = 0;
+	}
+	if (processor_id % grid_cols == 0) {
+		sectionsBefore = 0;
+	}
+
+	MPI_Aint *offsets = malloc(sizeof(MPI_Aint) * lines);
+	long long offset = processesBefore - sectionsBefore;
+	for (i = 0; i < lines; i++) {
+		offsets[i] = offset + before[i];
+		offset += lineTotals[i];
+	}
+
+	MPI_Datatype pieces;
+	MPI_Type_create_hindexed(lines, lineLengths, offsets, MPI_BYTE, &pieces);
+	MPI_Type_commit(&pieces);
+	MPI_File_set_size(file, total);
+	MPI_File_set_view(file, 0, MPI_BYTE, pieces, "native", MPI_INFO_NULL);
+	MPI_File_write_all(file, text, (int) sectionLength, MPI_BYTE, MPI_STATUS_IGNORE);
+	MPI_Type_free(&pieces);
+	MPI_Comm_free(&gridRowComm);
+
+	free(offsets);
+	free(lengths);
+	free(before);
+	free(lineTotals);
+	free(lineLengths);
+	free(text);
+}
+
+/* Function that writes the world to a binary map, each process writing the types of its world */
+/* section through a view of the file. */
+void writeBinary(MPI_File file) {
+	int lines = numberLinesForProcess(processor_id);
+	MPI_File_set_size(file, BINARY_HEADER_SIZE + (MPI_Offset) WORLD_SIZE * WORLD_SIZE);
+	if (processor_id == MASTER) {
+		char header[BINARY_HEADER_SIZE];
+		int32_t size = WORLD_SIZE;
+		memcpy(header, BINARY_MAGIC, BINARY_MAGIC_SIZE);
+		memcpy(header + BINARY_MAGIC_SIZE, &size, sizeof(int32_t));
+		MPI_File_write_at(file, 0, header, BINARY_HEADER_SIZE, MPI_BYTE, MPI_STATUS_IGNORE);
 	}
-	int row = section_lines;
-	for (n = 1; n < num_processors ; n++) { 
-		int sectionLines = numberLinesForProcess(n);
-		int section_size = sectionLines*WORLD_SIZE * sizeof(world_pos);
-		MPI_Recv(buff, section_size, MPI_BYTE, n, n, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-		printSection(matrix_buff, sectionLines, row);
-		row += sectionLines;
-		memset(buff, 0, sizeof(world_pos) * WORLD_SIZE * maxLines);
+
+	unsigned char *types = malloc((size_t) lines * section_cols);
+	int i, j;
+	for (i = 0; i < lines; i++) {
+		for (j = 0; j < section_cols; j++) {
+			types[i*section_cols + j] = new_world_section[halo_top_lines+i][j].type;
+		}
 	}
+
+	int sizes[2] = {WORLD_SIZE, WORLD_SIZE};
+	int subsizes[2] = {lines, section_cols};
+	int starts[2] = {real_row_start + halo_top_lines, real_col_start};
+	MPI_Datatype section;
+	MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C, MPI_BYTE, &section);
+	MPI_Type_commit(&section);
+	MPI_File_set_view(file, BINARY_HEADER_SIZE, MPI_BYTE, section, "native", MPI_INFO_NULL);
+	MPI_File_write_all(file, types, lines * section_cols, MPI_BYTE, MPI_STATUS_IGNORE);
+	MPI_Type_free(&section);
+	free(types);
 }
 
+/* Function that writes the world to the output file, in the output format. */
+void writeWorld() {
+	MPI_File file;
+	if (MPI_File_open(MPI_COMM_WORLD, output_name, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &file) != MPI_SUCCESS) {
+		if (processor_id == MASTER) {
+			fprintf(stderr, "Can't write to %s\n", output_name);
+		}
+		MPI_Finalize();
+		exit(EXIT_FAILURE);
+	}
+
+	if (output_format == OUTPUT_BINARY) {
+		writeBinary(file);
+	} else {
+		writeText(file);
+	}
+	MPI_File_close(&file);
+}
 
 /* Function that receives a position and sets all its values to zero. */
 void clean(world_pos_t pos) {
@@ -288,6 +1056,39 @@ int isWolfToSquirrel(type_e from, type_e to) {
 	return (from == WOLF) && (to == SQUIRREL);
 }
 
+/* Function that returns the type of the cell next to a given position in a given direction. It's taken */
+/* from the neighbour's border when outside of the section, and it's ICE outside of the world, where */
+/* nothing can move to. */
+type_e neighbourType(int row, int col, move_e direction) {
+	switch (direction) {
+		case TOP:
+			row--;
+			break;
+
+		case RIGHT:
+			col++;
+			break;
+
+		case BOTTOM:
+			row++;
+			break;
+
+		default:
+			col--;
+	}
+
+	if (row < 0) {
+		return (neighbours[TOP] != MPI_PROC_NULL) ? outside_lines[TOP][col] : ICE;
+	} else if (row >= section_lines) {
+		return (neighbours[BOTTOM] != MPI_PROC_NULL) ? outside_lines[BOTTOM][col] : ICE;
+	} else if (col < 0) {
+		return (neighbours[LEFT] != MPI_PROC_NULL) ? outside_lines[LEFT][row] : ICE;
+	} else if (col >= section_cols) {
+		return (neighbours[RIGHT] != MPI_PROC_NULL) ? outside_lines[RIGHT][row] : ICE;
+	}
+	return old_world_section[row][col].type;
+}
+
 /* Function that given a position, tests adjacent positions (in all directions) starting on the top position and */
 /* continuing to test in clockwise . Returns a move if it can move , or none otherwise. */
 move_e getMove(int row, int col) {
@@ -298,68 +1099,18 @@ move_e getMove(int row, int col) {
     int nSquirrels = 0;
 
     type_e cur = old_world_section[row][col].type;
-    type_e top_element = EMPTY;
-    int map_inbounds = 1;
-    if (processor_id != MASTER && (row-1 < 0)) {
-    	top_element = top_line[col]; 
-    } else if (row > 0) {
-    	top_element = old_world_section[row-1][col].type;
-    } else {
-    	map_inbounds = 0;
-    }
-
-    // TOP
-    if (map_inbounds && canMoveTo(cur, top_element))   {
-    	if (isWolfToSquirrel(cur, top_element)) {
-			available[TOP] = 2;
-            nSquirrels++;
-		} else {
-            available[TOP] = 1;
-            nAvailable++;
-        }
-    }
-    
-    // RIGHT
-    if ((col+1 < WORLD_SIZE) && canMoveTo(cur, old_world_section[row][col+1].type)) {
-    	if (isWolfToSquirrel(cur, old_world_section[row][col+1].type)) {
-			available[RIGHT] = 2;
-            nSquirrels++;
-		} else {
-            available[RIGHT] = 1;
-            nAvailable++;
-        }
-    }
-
-    map_inbounds = 1;
-    type_e bottom_element = EMPTY;
-    if (processor_id != num_processors-1 && (row+1 >= section_lines)) {
-    	bottom_element = bottom_line[col];
-    } else if (row+1 < section_lines) {
-    	bottom_element = old_world_section[row+1][col].type;
-    } else {
-    	map_inbounds = 0;
-    }
-
-    // BOTTOM
-    if (map_inbounds && canMoveTo(cur, bottom_element)) {
-    	if (isWolfToSquirrel(cur, bottom_element)) {
-			available[BOTTOM] = 2;
-            nSquirrels++;
-		} else {
-            available[BOTTOM] = 1;
-            nAvailable++;
-        }
-    } 
-
-    // LEFT
-    if ((col-1 >= 0) && canMoveTo(cur, old_world_section[row][col-1].type)) {
-    	if (isWolfToSquirrel(cur, old_world_section[row][col-1].type)) {
-			available[LEFT] = 2;
-            nSquirrels++;
-		} else {
-            available[LEFT] = 1;
-            nAvailable++;
-        }
+    int i;
+    for (i = 0; i < NUM_OPTION; i++) {
+    	type_e element = neighbourType(row, col, i);
+    	if (canMoveTo(cur, element)) {
+    		if (isWolfToSquirrel(cur, element)) {
+				available[i] = 2;
+	            nSquirrels++;
+			} else {
+	            available[i] = 1;
+	            nAvailable++;
+	        }
+    	}
     }
     
     if (nAvailable == 0 && nSquirrels == 0)
@@ -371,8 +1122,7 @@ move_e getMove(int row, int col) {
         n = 2;
     }
     
-    int selected = numberOfPosition((real_row_start+row), col) % nAvailable;
-    int i;
+    int selected = numberOfPosition((real_row_start+row), (real_col_start+col)) % nAvailable;
 	for (i = 0; i < NUM_OPTION; i++) {
 		if (available[i] == n) {
 			if (selected == 0){
@@ -524,8 +1274,9 @@ void breed(world_pos *pos) {
 /* Function that copies the new_world_section into the old_world_section. */
 void copyWorld() {
 	int i;
+	#pragma omp parallel for private(i)
 	for (i = 0; i < section_lines; i++) {
-		memcpy(old_world_section[i], new_world_section[i], sizeof(world_pos)*WORLD_SIZE);
+		memcpy(old_world_section[i], new_world_section[i], sizeof(world_pos)*section_cols);
 	}
 }
 
@@ -566,9 +1317,13 @@ void updatePos(int row, int col) {
 	world_pos *from = &(new_world_section[row][col]);
 	world_pos *to = NULL;
 	if (move == TOP && row == 0) {
-		to = &(top_changed_line[col]);
+		to = &(changed_lines[TOP][col]);
 	} else if (move == BOTTOM && row == section_lines-1) { 
-		to = &(bottom_changed_line[col]);
+		to = &(changed_lines[BOTTOM][col]);
+	} else if (move == LEFT && col == 0) {
+		to = &(changed_lines[LEFT][row]);
+	} else if (move == RIGHT && col == section_cols-1) {
+		to = &(changed_lines[RIGHT][row]);
 	} else {
 		to = getDestination(row, col, move);
 	}
@@ -587,173 +1342,652 @@ void updatePos(int row, int col) {
 	}
 }
 
-/* Function that given two lines sent by other processes, merge them with the process world section. */
-void merge(world_pos_t topLine , world_pos_t bottomLine) {
-	int j;
-	for (j = 0; j < WORLD_SIZE; j++) {
-		movePos(&topLine[j], &new_world_section[0][j]);
-		movePos(&bottomLine[j], &new_world_section[section_lines-1][j]);
+/* Function that merges the lines received from the neighbours with the process world section. */
+void merge() {
+	int i, j;
+	for (j = 0; j < section_cols; j++) {
+		movePos(&received_lines[TOP][j], &new_world_section[0][j]);
+		movePos(&received_lines[BOTTOM][j], &new_world_section[section_lines-1][j]);
+	}
+	for (i = 0; i < section_lines; i++) {
+		movePos(&received_lines[LEFT][i], &new_world_section[i][0]);
+		movePos(&received_lines[RIGHT][i], &new_world_section[i][section_cols-1]);
+	}
+}
+
+/* Function that encodes a line of types in the smallest encoding, returning its length. */
+int encodeTypes(unsigned char *types, int length, unsigned char *encoded) {
+	int i, cells = 0;
+	for (i = 0; i < length; i++) {
+		cells += (types[i] != EMPTY);
+	}
+	if (cells == 0) {
+		return 0;
+	}
+
+	int sparseLength = 1 + cells * (sizeof(int32_t) + 1);
+	int denseLength = maxEncodedTypes(length);
+	if (sparseLength < denseLength) {
+		unsigned char *entry = encoded + 1;
+		encoded[0] = ENCODING_SPARSE;
+		for (i = 0; i < length; i++) {
+			if (types[i] != EMPTY) {
+				int32_t position = i;
+				memcpy(entry, &position, sizeof(int32_t));
+				entry[sizeof(int32_t)] = types[i];
+				entry += sizeof(int32_t) + 1;
+			}
+		}
+		return sparseLength;
+	}
+
+	// A type can start in a byte and end in the next one
+	encoded[0] = ENCODING_DENSE;
+	memset(encoded + 1, 0, denseLength - 1);
+	for (i = 0; i < length; i++) {
+		int bit = 3*i;
+		unsigned int bits = types[i] << (bit % 8);
+		encoded[1 + bit/8] |= bits & 0xff;
+		if (bit % 8 > 5) {
+			encoded[2 + bit/8] |= bits >> 8;
+		}
+	}
+	return denseLength;
+}
+
+/* Function that decodes a line of types of a given encoded length. */
+void decodeTypes(unsigned char *encoded, int encodedLength, unsigned char *types, int length) {
+	int i;
+	if ((encodedLength == 0) || (encoded[0] == ENCODING_SPARSE)) {
+		memset(types, EMPTY, length);
+		unsigned char *entry;
+		for (entry = encoded + 1; entry < encoded + encodedLength; entry += sizeof(int32_t) + 1) {
+			int32_t position;
+			memcpy(&position, entry, sizeof(int32_t));
+			types[position] = entry[sizeof(int32_t)];
+		}
+		return;
+	}
+
+	for (i = 0; i < length; i++) {
+		int bit = 3*i;
+		unsigned int bits = encoded[1 + bit/8];
+		if (bit % 8 > 5) {
+			bits |= encoded[2 + bit/8] << 8;
+		}
+		types[i] = (bits >> (bit % 8)) & 7;
+	}
+}
+
+/* Function that encodes a line of positions in the smallest encoding, returning its length. */
+int encodeChanges(world_pos_t line, int length, unsigned char *encoded) {
+	int i, cells = 0;
+	for (i = 0; i < length; i++) {
+		cells += (line[i].type != EMPTY);
+	}
+	if (cells == 0) {
+		return 0;
+	}
+
+	int sparseLength = 1 + cells * (sizeof(int32_t) + sizeof(world_pos));
+	int denseLength = maxEncodedChanges(length);
+	if (sparseLength < denseLength) {
+		unsigned char *entry = encoded + 1;
+		encoded[0] = ENCODING_SPARSE;
+		for (i = 0; i < length; i++) {
+			if (line[i].type != EMPTY) {
+				int32_t position = i;
+				memcpy(entry, &position, sizeof(int32_t));
+				memcpy(entry + sizeof(int32_t), &line[i], sizeof(world_pos));
+				entry += sizeof(int32_t) + sizeof(world_pos);
+			}
+		}
+		return sparseLength;
+	}
+
+	encoded[0] = ENCODING_DENSE;
+	memcpy(encoded + 1, line, length * sizeof(world_pos));
+	return denseLength;
+}
+
+/* Function that decodes a line of positions of a given encoded length. */
+void decodeChanges(unsigned char *encoded, int encodedLength, world_pos_t line, int length) {
+	if ((encodedLength == 0) || (encoded[0] == ENCODING_SPARSE)) {
+		memset(line, 0, length * sizeof(world_pos));
+		unsigned char *entry;
+		for (entry = encoded + 1; entry < encoded + encodedLength; entry += sizeof(int32_t) + sizeof(world_pos)) {
+			int32_t position;
+			memcpy(&position, entry, sizeof(int32_t));
+			memcpy(&line[position], entry + sizeof(int32_t), sizeof(world_pos));
+		}
+		return;
+	}
+
+	memcpy(line, encoded + 1, length * sizeof(world_pos));
+}
+
+/* Function that returns the encoding of an encoded line of a given length. */
+int encodingOf(unsigned char *encoded, int encodedLength) {
+	return (encodedLength == 0) ? ENCODING_EMPTY : encoded[0];
+}
+
+/* Function that counts a message sent to a given neighbour, given its encoding, its length and the */
+/* one of the raw line. */
+void countHaloMessage(move_e direction, int encoding, int encodedLength, int rawLength) {
+	if (neighbours[direction] == MPI_PROC_NULL) {
+		return;
 	}
+	halo_messages[encoding]++;
+	halo_message_bytes[encoding] += encodedLength;
+	halo_max_message[encoding] = max(halo_max_message[encoding], encodedLength);
+	halo_bytes += encodedLength;
+	halo_raw_bytes += rawLength;
+	halo_exchange_bytes = max(halo_exchange_bytes, 0) + encodedLength;
+}
+
+/* Function that ends an exchange of border messages with the neighbours, if any were sent. */
+void countHaloExchange() {
+	if (halo_exchange_bytes < 0) {
+		return;
+	}
+	halo_exchanges++;
+	halo_max_exchange = max(halo_max_exchange, halo_exchange_bytes);
+	halo_exchange_bytes = -1;
+}
+
+/* Function that builds the communication plan for the current borders and world section. */
+void initPlan() {
+	move_e d;
+	for (d = TOP; d < NONE; d++) {
+		int length = borderLength(d);
+		if (halo_encoding == HALO_RAW) {
+			MPI_Recv_init(outside_lines[d], length, MPI_BYTE, neighbours[d], oppositeMove(d), grid_comm, &types_requests[d]);
+			MPI_Send_init(send_lines[d], length, MPI_BYTE, neighbours[d], d, grid_comm, &types_requests[4+d]);
+			MPI_Recv_init(received_lines[d], length*sizeof(world_pos), MPI_BYTE, neighbours[d], NONE + oppositeMove(d), grid_comm, &changes_requests[d]);
+			MPI_Send_init(changed_lines[d], length*sizeof(world_pos), MPI_BYTE, neighbours[d], NONE + d, grid_comm, &changes_requests[4+d]);
+		} else {
+			MPI_Recv_init(encoded_outside_lines[d], maxEncodedTypes(length), MPI_BYTE, neighbours[d], oppositeMove(d), grid_comm, &types_requests[d]);
+			MPI_Recv_init(encoded_received_lines[d], maxEncodedChanges(length), MPI_BYTE, neighbours[d], NONE + oppositeMove(d), grid_comm, &changes_requests[d]);
+			types_requests[4+d] = MPI_REQUEST_NULL;
+			changes_requests[4+d] = MPI_REQUEST_NULL;
+		}
+	}
+
+	// The ghost lines only go to the processes there are
+	num_halo_requests = 0;
+	if (halo_lines > 0) {
+		int haloSize = halo_lines*section_cols*sizeof(world_pos);
+		int ownedLines = section_lines - halo_top_lines - halo_bottom_lines;
+		if (halo_neighbours[TOP] != MPI_PROC_NULL) {
+			MPI_Recv_init(new_world_section[0], haloSize, MPI_BYTE, halo_neighbours[TOP], BOTTOM, grid_comm, &halo_requests[num_halo_requests++]);
+			MPI_Send_init(new_world_section[halo_top_lines], haloSize, MPI_BYTE, halo_neighbours[TOP], TOP, grid_comm, &halo_requests[num_halo_requests++]);
+		}
+		if (halo_neighbours[BOTTOM] != MPI_PROC_NULL) {
+			MPI_Recv_init(new_world_section[halo_top_lines + ownedLines], haloSize, MPI_BYTE, halo_neighbours[BOTTOM], TOP, grid_comm, &halo_requests[num_halo_requests++]);
+			MPI_Send_init(new_world_section[halo_top_lines + ownedLines - halo_lines], haloSize, MPI_BYTE, halo_neighbours[BOTTOM], BOTTOM, grid_comm, &halo_requests[num_halo_requests++]);
+		}
+	}
+}
+
+/* Function that frees the persistent requests of the communication plan. */
+void freePlan() {
+	int i;
+	for (i = 0; i < 8; i++) {
+		if (types_requests[i] != MPI_REQUEST_NULL) {
+			MPI_Request_free(&types_requests[i]);
+		}
+		if (changes_requests[i] != MPI_REQUEST_NULL) {
+			MPI_Request_free(&changes_requests[i]);
+		}
+	}
+	for (i = 0; i < num_halo_requests; i++) {
+		MPI_Request_free(&halo_requests[i]);
+	}
+	num_halo_requests = 0;
 }
 
 /* Function that  sends the border lines that are inside of the process's world's section. */
-/* Note: only sends cell types to the other process */
-void sendInsideBorders(MPI_Request *request1, MPI_Request *request2) {
-	int section_size = WORLD_SIZE*sizeof(unsigned char);
-	int j;
-	for (j = 0; j < WORLD_SIZE; ++j){
-		top_send_line[j] = new_world_section[0][j].type;
-		bottom_send_line[j] = new_world_section[section_lines-1][j].type;
-	}
-	if(processor_id == MASTER){
-		MPI_Isend(bottom_send_line, section_size, MPI_BYTE, processor_id+1, 1, MPI_COMM_WORLD, request2);
-	} else if(processor_id == num_processors-1){
-		MPI_Isend(top_send_line, section_size, MPI_BYTE, processor_id-1, 0, MPI_COMM_WORLD, request1);
-	} else {
-		MPI_Isend(top_send_line, section_size, MPI_BYTE, processor_id-1, 0, MPI_COMM_WORLD, request1);
-		MPI_Isend(bottom_send_line, section_size, MPI_BYTE, processor_id+1, 1, MPI_COMM_WORLD, request2);
+/* Note: only sends cell types to the other processes, tagged with the direction they're sent to */
+void sendInsideBorders() {
+	int i, j;
+	for (j = 0; j < section_cols; ++j){
+		send_lines[TOP][j] = new_world_section[0][j].type;
+		send_lines[BOTTOM][j] = new_world_section[section_lines-1][j].type;
+	}
+	for (i = 0; i < section_lines; ++i){
+		send_lines[LEFT][i] = new_world_section[i][0].type;
+		send_lines[RIGHT][i] = new_world_section[i][section_cols-1].type;
+	}
+
+	move_e d;
+	if (halo_encoding == HALO_RAW) {
+		for (d = TOP; d < NONE; d++) {
+			countHaloMessage(d, ENCODING_DENSE, borderLength(d), borderLength(d));
+		}
+		countHaloExchange();
+		MPI_Startall(4, types_requests + 4);
+		return;
 	}
+
+	for (d = TOP; d < NONE; d++) {
+		int length = encodeTypes(send_lines[d], borderLength(d), encoded_send_lines[d]);
+		countHaloMessage(d, encodingOf(encoded_send_lines[d], length), length, borderLength(d));
+		MPI_Isend(encoded_send_lines[d], length, MPI_BYTE, neighbours[d], d, grid_comm, &types_requests[4+d]);
+	}
+	countHaloExchange();
 }
 
-/* Function that receives the border lines that are outside of the process's world's section. */
-/* Note: only receives cell types from the other process */
+/* Function that starts receiving the border lines that are outside of the process's world's section. */
+/* Note: only receives cell types from the other processes */
 void receiveOutsideBorders() {
-	int section_size = WORLD_SIZE*sizeof(unsigned char);
-	if(processor_id == MASTER){
-		MPI_Recv(bottom_line, section_size, MPI_BYTE, processor_id+1, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-	} else if(processor_id == num_processors-1){
-		MPI_Recv(top_line, section_size, MPI_BYTE, processor_id-1, 1, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-	} else {
-		MPI_Recv(top_line, section_size, MPI_BYTE, processor_id-1, 1, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-		MPI_Recv(bottom_line, section_size, MPI_BYTE, processor_id+1, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+	MPI_Startall(4, types_requests);
+}
+
+/* Function that decodes the border lines outside of the process's world's section, once received. */
+void decodeOutsideBorders(MPI_Status *statuses) {
+	move_e d;
+	for (d = TOP; d < NONE; d++) {
+		if ((halo_encoding == HALO_ADAPTIVE) && (neighbours[d] != MPI_PROC_NULL)) {
+			int length;
+			MPI_Get_count(&statuses[d], MPI_BYTE, &length);
+			decodeTypes(encoded_outside_lines[d], length, outside_lines[d], borderLength(d));
+		}
 	}
 }
 
 /* Function that sends the border lines that affect other processes' world's section. */
-/* Note: sends a complete line (with all atributes) to the other process */
-void sendOutsideBorders(MPI_Request *request1, MPI_Request *request2) {
-	if(processor_id == MASTER){
-		MPI_Isend(bottom_changed_line, WORLD_SIZE*sizeof(world_pos), MPI_BYTE, processor_id+1, 1, MPI_COMM_WORLD, request2);
-	} else if(processor_id == num_processors-1){
-		MPI_Isend(top_changed_line, WORLD_SIZE*sizeof(world_pos), MPI_BYTE, processor_id-1, 0, MPI_COMM_WORLD, request1);
-	} else {
-		MPI_Isend(top_changed_line, WORLD_SIZE*sizeof(world_pos), MPI_BYTE, processor_id-1, 0, MPI_COMM_WORLD, request1);
-		MPI_Isend(bottom_changed_line, WORLD_SIZE*sizeof(world_pos), MPI_BYTE, processor_id+1, 1, MPI_COMM_WORLD, request2);
+/* Note: sends a complete line (with all atributes) to the other processes, with tags after the ones */
+/* of the cell types */
+void sendOutsideBorders() {
+	move_e d;
+	if (halo_encoding == HALO_RAW) {
+		for (d = TOP; d < NONE; d++) {
+			int rawLength = borderLength(d)*sizeof(world_pos);
+			countHaloMessage(d, ENCODING_DENSE, rawLength, rawLength);
+		}
+		countHaloExchange();
+		MPI_Startall(4, changes_requests + 4);
+		return;
 	}
+
+	for (d = TOP; d < NONE; d++) {
+		int length = encodeChanges(changed_lines[d], borderLength(d), encoded_changed_lines[d]);
+		countHaloMessage(d, encodingOf(encoded_changed_lines[d], length), length, borderLength(d)*sizeof(world_pos));
+		MPI_Isend(encoded_changed_lines[d], length, MPI_BYTE, neighbours[d], NONE + d, grid_comm, &changes_requests[4+d]);
+	}
+	countHaloExchange();
 }
 
-/* Function that receives the border lines that affect the process's world's section.
-/* These lines will be merged and conflicts are resolved. */
-/* Note: receives a complete line (with all atributes) from the other process. */
+/* Function that starts receiving the border lines that affect the process's world's section. */
+/* Once received, these lines will be merged and conflicts are resolved. */
+/* Note: receives a complete line (with all atributes) from the other processes. */
 void receiveInsideBorders() {
-	int section_size = WORLD_SIZE*sizeof(world_pos);
-	world_pos_t top_received_line = malloc(section_size);
-	world_pos_t bottom_received_line = malloc(section_size);
-	if(processor_id == MASTER){
-		memset(top_received_line, 0, section_size);
-		MPI_Recv(bottom_received_line, section_size, MPI_BYTE, processor_id+1, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-	} else if(processor_id == num_processors-1){
-		memset(bottom_received_line, 0, section_size);
-		MPI_Recv(top_received_line, section_size, MPI_BYTE, processor_id-1, 1, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-	} else {
-		MPI_Recv(top_received_line, section_size, MPI_BYTE, processor_id-1, 1, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-		MPI_Recv(bottom_received_line, section_size, MPI_BYTE, processor_id+1, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+	MPI_Startall(4, changes_requests);
+}
+
+/* Function that decodes the border lines that affect the process's world's section, once received. */
+void decodeInsideBorders(MPI_Status *statuses) {
+	move_e d;
+	for (d = TOP; d < NONE; d++) {
+		if ((halo_encoding == HALO_ADAPTIVE) && (neighbours[d] != MPI_PROC_NULL)) {
+			int length;
+			MPI_Get_count(&statuses[d], MPI_BYTE, &length);
+			decodeChanges(encoded_received_lines[d], length, received_lines[d], borderLength(d));
+		}
 	}
-	
-	merge(top_received_line, bottom_received_line);
-	
-	free(top_received_line);
-	free(bottom_received_line);
 }
 
-/* Function that resets the two border lines. */
-void resetOutsideBorders() {
-	int section_size = WORLD_SIZE*sizeof(world_pos);
-	if(processor_id != MASTER){
-		memset(top_changed_line, 0, section_size);
+/* Function that prints how many bytes the border lines took, on stderr: in all, per exchange and */
+/* per message of each encoding. */
+void printHaloStats() {
+	static const char *encodings[3] = {"empty", "sparse", "dense"};
+	long long messages = halo_messages[ENCODING_EMPTY] + halo_messages[ENCODING_SPARSE] + halo_messages[ENCODING_DENSE];
+	fprintf(stderr, "process %2d sent %lld border messages in %lld exchanges, %lld bytes instead of %lld, "
+			"%.1f bytes per exchange, at most %lld\n", processor_id, messages, halo_exchanges,
+			halo_bytes, halo_raw_bytes, (halo_exchanges > 0) ? (double) halo_bytes / halo_exchanges : 0.0,
+			halo_max_exchange);
+
+	int encoding;
+	for (encoding = ENCODING_EMPTY; encoding <= ENCODING_DENSE; encoding++) {
+		long long count = halo_messages[encoding];
+		fprintf(stderr, "process %2d sent %lld %s border messages, %lld bytes, %.1f bytes per message, "
+				"at most %d\n", processor_id, count, encodings[encoding], halo_message_bytes[encoding],
+				(count > 0) ? (double) halo_message_bytes[encoding] / count : 0.0, halo_max_message[encoding]);
 	}
-	if(processor_id != num_processors-1){
-		memset(bottom_changed_line, 0, section_size);
+}
+
+/* Function that mixes the bits of a key, as the last step of splitmix64. */
+unsigned long mix64(unsigned long key) {
+	key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9UL;
+	key = (key ^ (key >> 27)) * 0x94d049bb133111ebUL;
+	return key ^ (key >> 31);
+}
+
+/* Function that returns the digest of a cell, its position in the world and type and the counters */
+/* that matter to it, which is 0 for empty cells. Digests are added up, so the cells can be visited */
+/* in any order and by any process. */
+unsigned long cellDigest(int row, int col, world_pos_t pos) {
+	if (pos->type == EMPTY) {
+		return 0;
 	}
+
+	int isAnimal = (pos->type == WOLF) || (pos->type == SQUIRREL) || (pos->type == SQUIRREL_ON_TREE);
+	unsigned long key = (unsigned long) row * WORLD_SIZE + col;
+	key = (key << 8) | pos->type;
+	key = (key << 8) | (isAnimal ? pos->breeding_period : 0);
+	key = (key << 8) | ((pos->type == WOLF) ? pos->starvation_period : 0);
+	return mix64(key);
 }
 
-/* Function that processes the two sub-generations of each generation, dealing with the communication among processes. */
-void playGen() {
-	MPI_Request request1;
-	MPI_Request request2;
-	// Before generation, cleans starving animals
+/* Function that adds up the digests of the lines the process owns, for the whole world and for each */
+/* region, and has the Master process print the sums of every process: the generation, the digest of */
+/* the whole world and then the one of each region, row by row. */
+void printDigest(int generation) {
+	unsigned long digests[DIGEST_REGIONS * DIGEST_REGIONS + 1];
+	unsigned long worldDigests[DIGEST_REGIONS * DIGEST_REGIONS + 1];
+	memset(digests, 0, sizeof(digests));
+
+	int lines = numberLinesForProcess(processor_id);
 	int i, j;
-	for (i = 0; i < section_lines; i++) {
-		for (j = 0; j < WORLD_SIZE; j++) {
-			if (isStarving(&new_world_section[i][j])) {
-				clean(&new_world_section[i][j]);
+	for (i = 0; i < lines; i++) {
+		int row = real_row_start + halo_top_lines + i;
+		unsigned long *rowRegions = digests + 1 + (long) row * DIGEST_REGIONS / WORLD_SIZE * DIGEST_REGIONS;
+		for (j = 0; j < section_cols; j++) {
+			world_pos_t pos = &new_world_section[halo_top_lines+i][j];
+			if (pos->type != EMPTY) {
+				int col = real_col_start + j;
+				unsigned long digest = cellDigest(row, col, pos);
+				digests[0] += digest;
+				rowRegions[(long) col * DIGEST_REGIONS / WORLD_SIZE] += digest;
 			}
 		}
 	}
-	// Must keep consistency between worlds
-	sendInsideBorders(&request1,&request2);
-	receiveOutsideBorders();
-	if(processor_id != MASTER){
-		MPI_Wait(&request1, MPI_STATUS_IGNORE);
-	}
-	if(processor_id != num_processors-1){
-		MPI_Wait(&request2, MPI_STATUS_IGNORE);
-	}
-	copyWorld();
 
-	// Red sub-generation
-	for (i = 0; i < section_lines; i++) {
-		for (j = (i % 2)^start_with_black; j < WORLD_SIZE; j+=2) {
-			updatePos(i, j);
+	MPI_Reduce(digests, worldDigests, DIGEST_REGIONS * DIGEST_REGIONS + 1, MPI_UNSIGNED_LONG, MPI_SUM, MASTER, MPI_COMM_WORLD);
+	if (processor_id == MASTER) {
+		fprintf(stderr, "Digest %d", generation);
+		for (i = 0; i <= DIGEST_REGIONS * DIGEST_REGIONS; i++) {
+			fprintf(stderr, " %016lx", worldDigests[i]);
 		}
+		fprintf(stderr, "\n");
 	}
+}
 
-	// Must keep consistency between worlds
-	sendOutsideBorders(&request1,&request2);
-	receiveInsideBorders();
-	if(processor_id != MASTER){
-		MPI_Wait(&request1, MPI_STATUS_IGNORE);
+/* Function that adds the time since the last lap to a phase. */
+void lap(phase_e phase) {
+	double now = MPI_Wtime();
+	phase_times[phase] += now - phase_clock;
+	phase_clock = now;
+}
+
+/* Function that writes the time of every phase and the throughput of the generations, which took */
+/* the given time on this process, to timings_file. Every process takes part, the Master process */
+/* writes the file. */
+void writeTimings(double took, int generations) {
+	double times[NUM_PHASES];
+	double slowest;
+	long moves;
+	MPI_Reduce(phase_times, times, NUM_PHASES, MPI_DOUBLE, MPI_MAX, MASTER, MPI_COMM_WORLD);
+	MPI_Reduce(&took, &slowest, 1, MPI_DOUBLE, MPI_MAX, MASTER, MPI_COMM_WORLD);
+	MPI_Reduce(&animal_moves, &moves, 1, MPI_LONG, MPI_SUM, MASTER, MPI_COMM_WORLD);
+	if (processor_id != MASTER) {
+		return;
 	}
-	if(processor_id != num_processors-1){
-		MPI_Wait(&request2, MPI_STATUS_IGNORE);
+
+	FILE *file = fopen(timings_file, "w");
+	if (file == NULL) {
+		fprintf(stderr, "Can't create the timings %s\n", timings_file);
+		MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
 	}
-	resetOutsideBorders();
 
-	sendInsideBorders(&request1,&request2);
-	receiveOutsideBorders();
-	if(processor_id != MASTER){
-		MPI_Wait(&request1, MPI_STATUS_IGNORE);
+#ifdef _OPENMP
+	const char *binary = "hybrid";
+	int threads = omp_get_max_threads();
+#else
+	const char *binary = "mpi";
+	int threads = 1;
+#endif
+	double updates = (double) WORLD_SIZE * WORLD_SIZE * generations;
+	double seconds = (slowest > 0) ? slowest : 1;
+	fprintf(file, "{\n");
+	fprintf(file, "\t\"binary\": \"%s\",\n", binary);
+	fprintf(file, "\t\"engine\": \"dense\",\n");
+	fprintf(file, "\t\"threads\": %d,\n", threads);
+	fprintf(file, "\t\"processes\": %d,\n", num_processors);
+	fprintf(file, "\t\"world_size\": %d,\n", WORLD_SIZE);
+	fprintf(file, "\t\"generations\": %d,\n", generations);
+	fprintf(file, "\t\"took\": %f,\n", slowest);
+	fprintf(file, "\t\"phases\": {\n");
+	int i;
+	for (i = 0; i < NUM_PHASES; i++) {
+		fprintf(file, "\t\t\"%s\": %f%s\n", PHASE_NAMES[i], times[i], (i+1 < NUM_PHASES) ? "," : "");
 	}
-	if(processor_id != num_processors-1){
-		MPI_Wait(&request2, MPI_STATUS_IGNORE);
+	fprintf(file, "\t},\n");
+	fprintf(file, "\t\"cell_updates\": %.0f,\n", updates);
+	fprintf(file, "\t\"cell_updates_per_second\": %.0f,\n", updates / seconds);
+	fprintf(file, "\t\"animal_moves\": %ld,\n", moves);
+	fprintf(file, "\t\"animal_moves_per_second\": %.0f\n", moves / seconds);
+	fprintf(file, "}\n");
+
+	if (fclose(file) != 0) {
+		fprintf(stderr, "Can't write the timings %s\n", timings_file);
+		MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
 	}
-	copyWorld();
-	// Black sub-generation
-	for (i = 0; i < section_lines; i++) {
-		for (j = (!(i % 2))^start_with_black; j < WORLD_SIZE; j+=2) {
-			updatePos(i, j);
+}
+
+/* Function that resets the four border lines. */
+void resetOutsideBorders() {
+	move_e d;
+	for (d = TOP; d < NONE; d++) {
+		memset(changed_lines[d], 0, sizeof(world_pos) * borderLength(d));
+	}
+}
+
+/* Function that updates the cells of a sub-generation in the section's lines and columns from */
+/* first to last (not included). Red cells, parity 0, are the ones whose row and column in the */
+/* world have the same parity, black cells, parity 1, the others. */
+/* Note: an animal only writes its own line and the ones next to it, so threads update lines */
+/* three apart at a time, without locks. */
+void updateCells(int parity, int firstLine, int lastLine, int firstCol, int lastCol) {
+	int i, j, colour;
+	#pragma omp parallel private(i,j,colour) if ((lastLine-firstLine)*(lastCol-firstCol) >= PARALLEL_CELLS)
+	for (colour = 0; colour < 3; colour++) {
+		#pragma omp for schedule(dynamic)
+		for (i = firstLine + colour; i < lastLine; i += 3) {
+			int start = firstCol + (real_row_start + i + real_col_start + firstCol + parity) % 2;
+			for (j = start; j < lastCol; j+=2) {
+				updatePos(i, j);
+			}
 		}
 	}
+}
 
-	sendOutsideBorders(&request1,&request2);
+/* Function that processes a sub-generation. The cells inside of the section's border never look at */
+/* the neighbours' lines, so they're updated while those lines are on their way, and the first and */
+/* last lines and columns wait for them. The order cells are updated in doesn't matter, moves into the */
+/* same cell give the same result in any order. */
+void playSubGen(int parity) {
+	phase_e phase = parity ? PHASE_BLACK : PHASE_RED;
+	receiveOutsideBorders();
 	receiveInsideBorders();
-	if(processor_id != MASTER){
-		MPI_Wait(&request1, MPI_STATUS_IGNORE);
+	sendInsideBorders();
+	lap(PHASE_EXCHANGE);
+
+	// Must keep consistency between worlds
+	copyWorld();
+	lap(PHASE_COPY);
+
+	double time = MPI_Wtime();
+	updateCells(parity, 1, section_lines-1, 1, section_cols-1);
+	compute_time += MPI_Wtime() - time;
+	lap(phase);
+
+	MPI_Status typesStatuses[8];
+	MPI_Waitall(8, types_requests, typesStatuses);
+	decodeOutsideBorders(typesStatuses);
+	lap(PHASE_EXCHANGE);
+
+	time = MPI_Wtime();
+	updateCells(parity, 0, 1, 0, section_cols);
+	if (section_lines > 1) {
+		updateCells(parity, section_lines-1, section_lines, 0, section_cols);
 	}
-	if(processor_id != num_processors-1){
-		MPI_Wait(&request2, MPI_STATUS_IGNORE);
+	updateCells(parity, 1, section_lines-1, 0, 1);
+	if (section_cols > 1) {
+		updateCells(parity, 1, section_lines-1, section_cols-1, section_cols);
 	}
+	compute_time += MPI_Wtime() - time;
+	lap(phase);
+
+	// Must keep consistency between worlds
+	sendOutsideBorders();
+	MPI_Status changesStatuses[8];
+	MPI_Waitall(8, changes_requests, changesStatuses);
+	decodeInsideBorders(changesStatuses);
+	merge();
 	resetOutsideBorders();
+	lap(PHASE_EXCHANGE);
+}
+
+/* Function that processes the two sub-generations of each generation, dealing with the communication among processes. */
+void playGen() {
+	double time = MPI_Wtime();
+	// Before generation, cleans starving animals
+	int i, j;
+	#pragma omp parallel for private(i,j)
+	for (i = 0; i < section_lines; i++) {
+		for (j = 0; j < section_cols; j++) {
+			if (isStarving(&new_world_section[i][j])) {
+				clean(&new_world_section[i][j]);
+			}
+		}
+	}
+	compute_time += MPI_Wtime() - time;
+	lap(PHASE_CULL);
+
+	// Red sub-generation
+	playSubGen(0);
+
+	// Black sub-generation
+	playSubGen(1);
+
 	// After generation, increase breeding_period to the animals
-	// that moved
+	// that moved, counting the moves into the lines that aren't ghosts
+	time = MPI_Wtime();
+	long moves = 0;
+	#pragma omp parallel for private(i,j) reduction(+:moves)
 	for (i = 0; i < section_lines; i++) {
-		for (j = 0; j < WORLD_SIZE; j++) {
+		int owned = (i >= halo_top_lines) && (i < section_lines - halo_bottom_lines);
+		for (j = 0; j < section_cols; j++) {
 			if (new_world_section[i][j].has_moved) {
 				new_world_section[i][j].breeding_period++;
 				new_world_section[i][j].has_moved = FALSE;
+				moves += owned;
+			}
+		}
+	}
+	animal_moves += moves;
+	compute_time += MPI_Wtime() - time;
+	lap(PHASE_BREED);
+}
+
+/* Function that refreshes the ghost lines of the deep halo mode, sending the first and last lines the */
+/* process owns to the processes above and below, with all their attributes. */
+void exchangeHalo() {
+	MPI_Startall(num_halo_requests, halo_requests);
+	MPI_Waitall(num_halo_requests, halo_requests, MPI_STATUSES_IGNORE);
+}
+
+/* Function that picks where each process' section should start so that they all get the same share */
+/* of the compute time, taking the cost of a line as its process' compute time over its number of */
+/* lines. Boundaries only move inside the two sections around them, so lines only ever go to a */
+/* neighbour, and every process keeps at least one of its lines. */
+void balancedLineStarts(double *times, int *starts) {
+	double total = 0;
+	int n;
+	for (n = 0; n < num_processors; n++) {
+		total += times[n];
+	}
+
+	starts[0] = 0;
+	starts[num_processors] = WORLD_SIZE;
+	int p = 1;
+	double cost = 0;
+	for (n = 0; n < num_processors; n++) {
+		double lineCost = times[n] / numberLinesForProcess(n);
+		int row;
+		for (row = line_starts[n]; row < line_starts[n+1]; row++) {
+			cost += lineCost;
+			while ((p < num_processors) && (cost >= total * p / num_processors)) {
+				starts[p++] = row+1;
 			}
 		}
 	}
+	for (; p < num_processors; p++) {
+		starts[p] = line_starts[p];
+	}
+
+	for (p = 1; p < num_processors; p++) {
+		starts[p] = max(starts[p], starts[p-1]+1);
+	}
+	for (p = 1; p < num_processors; p++) {
+		starts[p] = max(starts[p], line_starts[p-1]+1);
+		starts[p] = min(starts[p], line_starts[p+1]-1);
+	}
+}
+
+/* Function that moves lines between neighbour processes, with all their attributes, so that each */
+/* process spends about the same time computing. Every process computes the same new sections */
+/* from the compute times of all of them. */
+void rebalance() {
+	double *times = malloc(sizeof(double) * num_processors);
+	MPI_Allgather(&compute_time, 1, MPI_DOUBLE, times, 1, MPI_DOUBLE, MPI_COMM_WORLD);
+	compute_time = 0;
+
+	int *starts = malloc(sizeof(int) * (num_processors+1));
+	balancedLineStarts(times, starts);
+	free(times);
+
+	int first = starts[processor_id];
+	int last = starts[processor_id+1];
+	int oldLast = real_row_start + section_lines;
+	int rowSize = section_cols*sizeof(world_pos);
+	world_t oldSection = new_world_section;
+	world_t oldSectionCopy = old_world_section;
+	allocSection(last - first);
+
+	// Lines kept
+	int row;
+	for (row = max(first, real_row_start); row < min(last, oldLast); row++) {
+		memcpy(new_world_section[row-first], oldSection[row-real_row_start], rowSize);
+	}
+
+	// Lines given to or taken from the process above and the one below
+	MPI_Request requests[2] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL};
+	if (first < real_row_start) {
+		MPI_Irecv(new_world_section[0], (real_row_start-first)*rowSize, MPI_BYTE, neighbours[TOP], BOTTOM, grid_comm, &requests[0]);
+	} else if (first > real_row_start) {
+		MPI_Isend(oldSection[0], (first-real_row_start)*rowSize, MPI_BYTE, neighbours[TOP], TOP, grid_comm, &requests[0]);
+	}
+	if (last > oldLast) {
+		MPI_Irecv(new_world_section[oldLast-first], (last-oldLast)*rowSize, MPI_BYTE, neighbours[BOTTOM], TOP, grid_comm, &requests[1]);
+	} else if (last < oldLast) {
+		MPI_Isend(oldSection[last-real_row_start], (oldLast-last)*rowSize, MPI_BYTE, neighbours[BOTTOM], BOTTOM, grid_comm, &requests[1]);
+	}
+	MPI_Waitall(2, requests, MPI_STATUSES_IGNORE);
+
+	free(*oldSection);
+	free(oldSection);
+	free(*oldSectionCopy);
+	free(oldSectionCopy);
+	free(line_starts);
+	line_starts = starts;
+	real_row_start = first;
+	section_lines = last - first;
+	allocBorder(LEFT);
+	allocBorder(RIGHT);
+	freePlan();
+	initPlan();
 }
 
 /* Function main, runs all the generations and prints the whole world. */
@@ -763,46 +1997,84 @@ int main(int argc, char **argv) {
 		exit(EXIT_FAILURE);
 	}
 
+#ifdef _OPENMP
+	// Only the main thread talks to the other processes, outside of the parallel loops
+	int provided;
+	MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+	if (provided < MPI_THREAD_FUNNELED) {
+		fprintf(stderr, "MPI doesn't support threads\n");
+		MPI_Finalize();
+		exit(EXIT_FAILURE);
+	}
+#else
 	MPI_Init (&argc, &argv);
+#endif
 
 	MPI_Comm_rank (MPI_COMM_WORLD, &processor_id);
 	MPI_Comm_size (MPI_COMM_WORLD, &num_processors);
 
-	FILE *input = fopen(argv[1], "r");
-	if (input == NULL) {
-		fprintf(stderr, "File %s not found...\n", argv[1]);
+	parseOptions(argc, argv);
+
+	phase_clock = MPI_Wtime();
+	MPI_File input;
+	if (MPI_File_open(MPI_COMM_WORLD, argv[1], MPI_MODE_RDONLY, MPI_INFO_NULL, &input) != MPI_SUCCESS) {
+		if (processor_id == MASTER) {
+			fprintf(stderr, "File %s not found...\n", argv[1]);
+		}
 		MPI_Finalize();
 		exit(EXIT_FAILURE);
 	}
 
-		
-	if (processor_id == MASTER){
-		master_init(input, argv);
-	} else {
-		proc_init(input, argv);
-	}
-	fclose(input);
+	init_proc_section(input, argv);
+	MPI_File_close(&input);
+	initPlan();
 
 	MPI_Barrier (MPI_COMM_WORLD);
+	lap(PHASE_PARSE);
 
-	double start = MPI_Wtime();
+	double start = phase_clock;
 	int gen;
 
+	if (print_digests) {
+		printDigest(0);
+		lap(PHASE_DIGEST);
+	}
 	for (gen = 0; gen < NUM_GENERATIONS; gen++) {
 		playGen();
+		if (print_digests) {
+			printDigest(gen+1);
+			lap(PHASE_DIGEST);
+		}
+
+		if ((rebalance_period > 0) && ((gen+1) % rebalance_period == 0) && (gen+1 < NUM_GENERATIONS)) {
+			rebalance();
+			lap(PHASE_EXCHANGE);
+		}
+		if ((halo_lines > 0) && ((gen+1) % (halo_lines/4) == 0) && (gen+1 < NUM_GENERATIONS)) {
+			exchangeHalo();
+			lap(PHASE_EXCHANGE);
+		}
 	}
 
-	double end = MPI_Wtime();
-	printf("process %2d took %f\n", processor_id, end - start);
+	// Printing digests isn't part of the simulation
+	double took = MPI_Wtime() - start - phase_times[PHASE_DIGEST];
+	printf("process %2d took %f\n", processor_id, took);
+	if (halo_stats) {
+		printHaloStats();
+	}
 
 	MPI_Barrier (MPI_COMM_WORLD);
-	if (processor_id != MASTER){
+	if (output_name != NULL) {
+		writeWorld();
+	} else if (processor_id != MASTER){
 		proc_final();
+	} else {
+		printWorld();
 	}
+	lap(PHASE_OUTPUT);
 
-	//MPI_Barrier (MPI_COMM_WORLD);
-	if (processor_id == MASTER)	{
-		printWorld();
+	if (timings_file != NULL) {
+		writeTimings(took, NUM_GENERATIONS);
 	}
 //	freeAll();
 	MPI_Finalize();
@@ -1,7 +1,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
 #include <omp.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #define FALSE 0
 #define TRUE 1
@@ -16,6 +30,21 @@
 #define ICE 4
 #define SQUIRREL_ON_TREE 5
 
+// Binary maps start with BINARY_MAGIC and the world's size as a 32 bit
+// integer, followed by the type of every cell of the world, a byte each,
+// row by row
+#define BINARY_MAGIC "WSQMAP01"
+#define BINARY_MAGIC_SIZE 8
+#define BINARY_HEADER_SIZE 12
+
+// The world is printed in blocks of rows formatted in OUTPUT_BUFFER
+// sized buffers, MAX_CELL_TEXT characters at most per cell
+#define OUTPUT_BUFFER (1 << 20)
+#define MAX_CELL_TEXT 26
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 // None must always be the last one
 typedef enum {
 	TOP = 0,
@@ -35,10 +64,190 @@ typedef struct {
 typedef world_pos **world_t;
 typedef world_pos *world_pos_t;
 
+// Snapshots hold the whole state of a run: this header and then every
+// cell of the world, row by row
+#define SNAPSHOT_MAGIC "WSQSNAP"
+#define SNAPSHOT_VERSION 1
+
+// Trajectories start with these 8 bytes, the world's size and the
+// keyframe interval as 32 bit integers, and then hold a frame per
+// generation. See encodeRows.
+#define TRAJECTORY_MAGIC "WSQTRJ01"
+#define KEYFRAME 0
+#define DELTA_FRAME 1
+#define MAX_VARINT 10
+
+// Digests are the sums of the cells' digests over the whole world and
+// over each of the DIGEST_REGIONS x DIGEST_REGIONS regions it's split in
+#define DIGEST_REGIONS 4
+
+// Memory traffic is taken as a CACHE_LINE per cache miss
+#define CACHE_LINE 64
+
+typedef struct {
+	char magic[8];
+	int32_t version;
+	int32_t cell_size;
+	int32_t world_size;
+	int32_t wolf_breeding;
+	int32_t squirrel_breeding;
+	int32_t wolf_starving;
+	int32_t generation;
+	int32_t padding;
+} snapshot_header_t;
+
+// A copy of the world waiting to be written as a snapshot
+typedef struct {
+	world_pos_t cells;
+	int generation;
+} snapshot_t;
+
+typedef enum {
+	ENGINE_DENSE = 0,
+	ENGINE_FUSED = 1,
+	ENGINE_GATHER = 2,
+	ENGINE_TILED = 3,
+	ENGINE_OCCUPANCY = 4
+} engine_e;
+
+// Phases the run's time is split in. Sweep is a whole call of the
+// tiled engine, which doesn't go through the other phases one by one.
+// Num phases must always be the last one
+typedef enum {
+	PHASE_PARSE = 0,
+	PHASE_CULL = 1,
+	PHASE_COPY = 2,
+	PHASE_RED = 3,
+	PHASE_BLACK = 4,
+	PHASE_BREED = 5,
+	PHASE_SWEEP = 6,
+	PHASE_EXCHANGE = 7,
+	PHASE_CHECKPOINT = 8,
+	PHASE_TRAJECTORY = 9,
+	PHASE_DIGEST = 10,
+	PHASE_OUTPUT = 11,
+	NUM_PHASES = 12
+} phase_e;
+
+// Hardware events counted by --counters, per thread and per phase.
+// Num events must always be the last one
+typedef enum {
+	EVENT_CYCLES = 0,
+	EVENT_INSTRUCTIONS = 1,
+	EVENT_CACHE_REFERENCES = 2,
+	EVENT_CACHE_MISSES = 3,
+	EVENT_BRANCH_MISSES = 4,
+	NUM_EVENTS = 5
+} event_e;
+
+// A hardware event, as perf_event_open takes it
+typedef struct {
+	const char *name;
+	uint32_t type;
+	uint64_t config;
+} event_t;
+
+// A thread's group of counters: the file descriptor of each event (-1
+// when it couldn't be opened), the one leading the group, where each
+// event's value is in what reading the group returns, the last read
+// and the error of the first event that couldn't be opened
+typedef struct {
+	int fds[NUM_EVENTS];
+	int leader;
+	int slots[NUM_EVENTS];
+	int size;
+	uint64_t last[NUM_EVENTS + 3];
+	int error;
+} event_group_t;
+
+// A region of the world advanced on its own by the tiled engine
+typedef struct {
+	world_pos_t cells;
+	unsigned char *moves;
+	int row0;
+	int col0;
+	int rows;
+	int cols;
+	int own_row;
+	int own_col;
+	int own_rows;
+	int own_cols;
+} tile_t;
+
+typedef void (*move_masks_f)(const unsigned char *, const unsigned char *, const unsigned char *, const unsigned char *, int,
+		unsigned char *);
+
+// The cells of one colour of a row for the move masks kernels, next to
+// each other: their types, the types of the cells above and below them,
+// of the cells between them (from the one left of the first to the one
+// right of the last) and their move masks
+typedef struct {
+	unsigned char *up;
+	unsigned char *cur;
+	unsigned char *sides;
+	unsigned char *down;
+	unsigned char *masks;
+} row_lanes_t;
+
+// Tiles of a thread for the occupancy engine, from next to end in
+// scheduled_tiles, with the time the thread spent working on tiles.
+// Padded to a cache line, other threads steal from next.
+typedef struct {
+	int next;
+	int end;
+	long tiles;
+	double busy;
+	char padding[40];
+} tile_queue_t;
+
+typedef void (*occupancy_work_f)(int, int);
+
 int numberOfPosition(int row, int col);
 unsigned char atot(char c);
 char ttoa(unsigned char type);
-void init(FILE *file, char **argv);
+const char *mapFile(const char *name, size_t *size);
+const char *skipSpaces(const char *p, const char *end);
+const char *parseInt(const char *p, const char *end, int *value);
+const char *parseCell(const char *p, const char *end, int *row, int *col, char *type);
+size_t readMapHeader(const char *map, size_t size, int *binary);
+void setCell(int row, int col, unsigned char type);
+void loadBinaryMap(const char *map, size_t size);
+size_t lineStart(const char *map, size_t size, size_t start, size_t position);
+void loadCell(int row, int col, unsigned char type, unsigned char chunk);
+void loadTextLines(const char *map, size_t size, size_t first, size_t last, unsigned char chunk);
+void loadMap(const char *map, size_t size, size_t start, int binary);
+void init(const char *map, size_t size, char **argv);
+void initWorlds();
+int restart(const char *name, char **argv);
+void writeAll(int fd, const char *data, size_t size, off_t offset);
+void writeSnapshot(const char *name, snapshot_t *snapshot);
+void *writeCheckpoints(void *arg);
+void startCheckpoints();
+void checkpoint(int generation);
+void finishCheckpoints();
+char *formatVarint(char *text, unsigned long value);
+unsigned char cellType(int row, int col);
+size_t encodeRows(char **buffer, size_t *capacity, int first, int last, int keyframe);
+void writeTrajectory(const void *data, size_t size);
+void openTrajectory();
+void writeFrame(int generation);
+void closeTrajectory();
+int openEvent(const event_t *event, int group);
+void openEventGroup(event_group_t *group);
+void startEvents();
+void readEvents(int thread, phase_e phase);
+void closeEvents();
+void writeEventValue(FILE *file, const char *name, const char *format, double value, int known);
+void writeEventCounts(FILE *file, const double *counts, double seconds, double updates);
+void writeEvents(FILE *file, double updates);
+void lap(phase_e phase);
+void writeTimings(double took, int generations);
+unsigned long mix64(unsigned long key);
+unsigned long cellDigest(int row, int col, world_pos_t pos);
+void printDigest(int generation);
+char *formatInt(char *text, int value);
+char *formatRow(char *text, int row);
+void writeBlocks(struct iovec *blocks, int count);
 void printWorld();
 int isRedGen(int row, int col);
 int isBlackGen(int row, int col);
@@ -57,6 +266,70 @@ int isBreeding(world_pos_t pos);
 int isStarving(world_pos_t pos);
 void breed(world_pos_t pos);
 void clean(world_pos_t pos);
+engine_e atoe(const char *name);
+const char *etoa(engine_e engine);
+void parseOptions(int argc, char **argv);
+unsigned char *planeRow(int row);
+unsigned char cellMoveMask(unsigned char cur, const unsigned char *neighbours);
+move_e chooseMove(int row, int col, unsigned char cur, const unsigned char *neighbours);
+move_e maskedMove(int row, int col, unsigned char moveMask);
+move_e getMoveFused(int row, int col);
+void moveMasksScalar(const unsigned char *up, const unsigned char *cur, const unsigned char *sides, const unsigned char *down, int n,
+		unsigned char *masks);
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse4.2")))
+void moveMasksSSE(const unsigned char *up, const unsigned char *cur, const unsigned char *sides, const unsigned char *down, int n,
+		unsigned char *masks);
+__attribute__((target("avx2")))
+void moveMasksAVX2(const unsigned char *up, const unsigned char *cur, const unsigned char *sides, const unsigned char *down, int n,
+		unsigned char *masks);
+__attribute__((target("avx512f,avx512bw")))
+void moveMasksAVX512(const unsigned char *up, const unsigned char *cur, const unsigned char *sides, const unsigned char *down, int n,
+		unsigned char *masks);
+#endif
+move_masks_f atok(const char *name);
+void gatherLane(unsigned char *lane, const unsigned char *row, int n);
+void allocLanes(row_lanes_t *lanes);
+int isAnimal(unsigned char type);
+void leavingAnimal(int row, int col, world_pos_t animal);
+unsigned char *moveRow(int row);
+void gatherMoves(int row, int start);
+void gatherLeave(int row, int col);
+void gatherArrive(int row, int col);
+void gatherRow(int row, int start);
+void playGenGather();
+void tileAlloc(tile_t *tile, int size);
+void tileLoad(tile_t *tile, int row0, int col0, int rows, int cols);
+move_e tileGetMove(tile_t *tile, int row, int col, int top, int bottom, int left, int right);
+void tileArrive(tile_t *tile, world_pos_t to, size_t from, move_e move);
+int tileFirstCol(int left, int start);
+void tileMoves(tile_t *tile, int row, int start, int top, int bottom, int left, int right);
+void tileArriveRow(tile_t *tile, int row, int start, int top, int bottom, int left, int right);
+void tileLeaveRow(tile_t *tile, int row, int start, int left, int right);
+void tileSubGen(tile_t *tile, int parity, int top, int bottom, int left, int right);
+long tileGen(tile_t *tile, int top, int bottom, int left, int right);
+long advanceTile(tile_t *tile, int row, int col, int generations);
+void playGensTiled(int generations);
+void occupancyBounds(int tile, int *row0, int *col0, int *row1, int *col1);
+void occupancyCopy(int tile, int parity);
+void occupancyCull(int tile, int parity);
+void occupancyMoves(int tile, int parity);
+void occupancyGather(int tile, int parity);
+void occupancyBreed(int tile, int parity);
+int occupancyActive(int tile);
+void occupancySchedule();
+void occupancyRequeue();
+int occupancyNext(int thread);
+void occupancyRun(occupancy_work_f work, int parity);
+void occupancySubGen(int parity);
+void playGenOccupancy();
+void printOccupancyBusy();
+void fusedCullRow(int row);
+move_e fusedApplyMove(int row, int col, move_e move);
+void fusedUpdatePos(int row, int col);
+void fusedUpdateRow(int row, int start);
+int fusedBreedRow(int row);
+void playGenFused();
 
 const int NUM_ARGUMENTS = 6;
 int WORLD_SIZE = 0;
@@ -67,6 +340,123 @@ int NUM_GENERATIONS = 0;
 world_t old_world = NULL;
 world_t new_world = NULL;
 omp_lock_t **lock_world = NULL;
+unsigned char *move_plane = NULL;
+
+// The tiled engine advances TILE_SIZE x TILE_SIZE tiles by up to
+// TILE_GENERATIONS generations at a time, with a tile per thread
+int TILE_SIZE = 256;
+int TILE_GENERATIONS = 4;
+tile_t *tiles = NULL;
+
+// The occupancy engine splits the world in OCCUPANCY_TILE x
+// OCCUPANCY_TILE tiles, occupancy_tiles per side, counting the animals
+// of each one as it's copied, and only works on the tiles that can
+// change. Threads take them from their own queue and then steal.
+int OCCUPANCY_TILE = 64;
+int occupancy_tiles = 0;
+int *tile_animals = NULL;
+char *tile_moves = NULL;
+int *scheduled_tiles = NULL;
+int num_scheduled = 0;
+tile_queue_t *tile_queues = NULL;
+
+engine_e ENGINE = ENGINE_DENSE;
+
+// A snapshot of the run is saved to checkpoint_file every
+// CHECKPOINT_EVERY generations (only at the end when 0), and the run
+// starts from the snapshot in restart_file instead of the map when given
+char *checkpoint_file = NULL;
+int CHECKPOINT_EVERY = 0;
+char *restart_file = NULL;
+
+// Snapshots are copied to one of CHECKPOINT_BUFFERS buffers and written
+// by checkpoint_writer while the run goes on, from checkpoint_head on,
+// checkpoint_queued of them at a time. The run waits for a buffer when
+// they are all queued.
+int CHECKPOINT_BUFFERS = 2;
+snapshot_t *checkpoint_buffers = NULL;
+int checkpoint_head = 0;
+int checkpoint_queued = 0;
+int checkpoints_done = FALSE;
+pthread_t checkpoint_writer;
+pthread_mutex_t checkpoint_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t checkpoint_ready = PTHREAD_COND_INITIALIZER;
+pthread_cond_t checkpoint_written = PTHREAD_COND_INITIALIZER;
+
+// Every generation's changes are appended to trajectory_file, and the
+// whole world every KEYFRAME_EVERY generations. trajectory_types holds
+// the types of the world in the last frame, and each thread encodes a
+// block of rows of a frame in its own buffer
+char *trajectory_file = NULL;
+int KEYFRAME_EVERY = 64;
+FILE *trajectory = NULL;
+unsigned char *trajectory_types = NULL;
+int trajectory_frames = 0;
+char **frame_buffers = NULL;
+size_t *frame_capacities = NULL;
+size_t *frame_lengths = NULL;
+
+// The digest of the world is printed on stderr after every generation
+int print_digests = FALSE;
+
+// The time of every phase is added up in phase_times, from phase_clock
+// to the end of the phase, and written to timings_file as JSON with
+// the cells updated and the moves of animals per second. A move is a
+// cell an animal moved into. Inside parallel regions only the master
+// thread takes the time, right after the barrier ending the phase.
+char *timings_file = NULL;
+const char *PHASE_NAMES[NUM_PHASES] = {
+	"parse", "cull", "copy", "red", "black", "breed", "sweep",
+	"exchange", "checkpoint", "trajectory", "digest", "output"
+};
+double phase_times[NUM_PHASES];
+double phase_clock = 0;
+long animal_moves = 0;
+
+// With count_events (--counters), every thread opens a group of
+// counters for the EVENTS, and each lap adds what they counted since
+// the last one to the phase, in event_counts by thread, phase and
+// event. events_error tells why there are no counters at all.
+// move_calls counts the moves each thread chose, to weigh branch
+// misses against.
+int count_events = FALSE;
+const event_t EVENTS[NUM_EVENTS] = {
+	{"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+	{"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+	{"cache_references", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES},
+	{"cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+	{"branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES}
+};
+event_group_t *event_groups = NULL;
+int num_event_groups = 0;
+double *event_counts = NULL;
+int events_open[NUM_EVENTS];
+const char *events_error = NULL;
+long move_calls = 0;
+#pragma omp threadprivate(move_calls)
+
+// Types seen by the fused engine's sweeps, with a border of ICE
+// around the world so neighbours never need bounds checks
+unsigned char *type_plane = NULL;
+
+// Kernel filling the move masks of the cells of a row for the fused
+// sweeps, with the row_lanes of each thread
+move_masks_f moveMasks = NULL;
+row_lanes_t *row_lanes = NULL;
+
+// Number of options and the options, in move order, of each mask
+// of directions. See maskedMove.
+const unsigned char MASK_OPTIONS[16] = {1, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4};
+const unsigned char MASK_MOVES[16][4] = {
+	{NONE, NONE, NONE, NONE}, {TOP, NONE, NONE, NONE},
+	{RIGHT, NONE, NONE, NONE}, {TOP, RIGHT, NONE, NONE},
+	{BOTTOM, NONE, NONE, NONE}, {TOP, BOTTOM, NONE, NONE},
+	{RIGHT, BOTTOM, NONE, NONE}, {TOP, RIGHT, BOTTOM, NONE},
+	{LEFT, NONE, NONE, NONE}, {TOP, LEFT, NONE, NONE},
+	{RIGHT, LEFT, NONE, NONE}, {TOP, RIGHT, LEFT, NONE},
+	{BOTTOM, LEFT, NONE, NONE}, {TOP, BOTTOM, LEFT, NONE},
+	{RIGHT, BOTTOM, LEFT, NONE}, {TOP, RIGHT, BOTTOM, LEFT}
+};
 
 int numberOfPosition(int row, int col) {
 	return row*WORLD_SIZE + col;
@@ -99,42 +489,275 @@ char ttoa(unsigned char type) {
 	exit(EXIT_FAILURE);
 }
 
-void init(FILE *file, char **argv) {
-	// read WORLD_SIZE
-	if (fscanf(file, "%d", &WORLD_SIZE) == 0) {
+// Maps a whole file in memory, read only
+const char *mapFile(const char *name, size_t *size) {
+	int fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "File %s not found...\n", name);
+		exit(EXIT_FAILURE);
+	}
+
+	struct stat info;
+	if ((fstat(fd, &info) != 0) || (info.st_size == 0)) {
+		fprintf(stderr, "Can't read the world's size\n");
+		exit(EXIT_FAILURE);
+	}
+	*size = info.st_size;
+
+	const char *map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Can't map %s in memory\n", name);
+		exit(EXIT_FAILURE);
+	}
+	madvise((void *) map, *size, MADV_SEQUENTIAL);
+	return map;
+}
+
+const char *skipSpaces(const char *p, const char *end) {
+	while ((p < end) && ((*p == ' ') || (*p == '\n') || (*p == '\t') || (*p == '\r'))) {
+		p++;
+	}
+	return p;
+}
+
+// Parses an integer after any white space, saturating at the limits of
+// an int, or returns NULL when there's none
+const char *parseInt(const char *p, const char *end, int *value) {
+	p = skipSpaces(p, end);
+	int negative = (p < end) && (*p == '-');
+	p += negative;
+	if ((p == end) || (*p < '0') || (*p > '9')) {
+		return NULL;
+	}
+
+	long long number = 0;
+	while ((p < end) && (*p >= '0') && (*p <= '9')) {
+		number = number*10 + (*p - '0');
+		if (number > INT_MAX) {
+			number = (long long) INT_MAX + 1;
+		}
+		p++;
+	}
+
+	if (negative) {
+		*value = -number;
+	} else {
+		*value = (number > INT_MAX) ? INT_MAX : number;
+	}
+	return p;
+}
+
+// Parses a "row col type" line, or returns NULL when it can't
+const char *parseCell(const char *p, const char *end, int *row, int *col, char *type) {
+	p = parseInt(p, end, row);
+	if (p != NULL) {
+		p = parseInt(p, end, col);
+	}
+	if (p != NULL) {
+		p = skipSpaces(p, end);
+		if (p == end) {
+			return NULL;
+		}
+		*type = *p++;
+	}
+	return p;
+}
+
+// Reads WORLD_SIZE, returning where the cells start
+size_t readMapHeader(const char *map, size_t size, int *binary) {
+	*binary = (size >= BINARY_HEADER_SIZE) && (memcmp(map, BINARY_MAGIC, BINARY_MAGIC_SIZE) == 0);
+	if (*binary) {
+		int32_t worldSize;
+		memcpy(&worldSize, map + BINARY_MAGIC_SIZE, sizeof(int32_t));
+		WORLD_SIZE = worldSize;
+		if (WORLD_SIZE < 1) {
+			fprintf(stderr, "Can't read the world's size\n");
+			exit(EXIT_FAILURE);
+		}
+		return BINARY_HEADER_SIZE;
+	}
+
+	const char *cells = parseInt(map, map + size, &WORLD_SIZE);
+	if ((cells == NULL) || (WORLD_SIZE < 1)) {
+		fprintf(stderr, "Can't read the world's size\n");
+		exit(EXIT_FAILURE);
+	}
+	return cells - map;
+}
+
+void loadBinaryMap(const char *map, size_t size) {
+	if (size < BINARY_HEADER_SIZE + (size_t) WORLD_SIZE * WORLD_SIZE) {
+		fprintf(stderr, "The map is shorter than a world of size %d\n", WORLD_SIZE);
 		exit(EXIT_FAILURE);
 	}
 
+	const unsigned char *types = (const unsigned char *) map + BINARY_HEADER_SIZE;
+	int row, col;
+	#pragma omp parallel for private(row,col)
+	for (row = 0; row < WORLD_SIZE; row++) {
+		for (col = 0; col < WORLD_SIZE; col++) {
+			unsigned char type = types[(size_t) row*WORLD_SIZE + col];
+			if (type > SQUIRREL_ON_TREE) {
+				fprintf(stderr, "Unknown type: %d\n", type);
+				exit(EXIT_FAILURE);
+			}
+			setCell(row, col, type);
+		}
+	}
+}
+
+// Sets a cell of the new world with the chunk of lines it was read from
+// in has_moved, unless a later chunk already set it. The whole cell is
+// swapped at once, and swapped back while it held a later chunk, so it
+// ends up with the latest chunk's line whichever thread gets there first.
+void loadCell(int row, int col, unsigned char type, unsigned char chunk) {
+	world_pos cell = {type, 0, 0, chunk};
+	uint32_t *word = (uint32_t *) &new_world[row][col];
+	uint32_t value, previous;
+	memcpy(&value, &cell, sizeof(value));
+	while (TRUE) {
+		#pragma omp atomic capture
+		{ previous = *word; *word = value; }
+
+		world_pos replaced;
+		memcpy(&replaced, &previous, sizeof(replaced));
+		if (replaced.has_moved <= cell.has_moved) {
+			return;
+		}
+		cell = replaced;
+		value = previous;
+	}
+}
+
+// Loads the lines whose first character is between first and last (not
+// included), numbered chunk. Positions outside of the world are ignored.
+void loadTextLines(const char *map, size_t size, size_t first, size_t last, unsigned char chunk) {
+	const char *p = map + first;
+	const char *end = map + size;
+	int row, col;
+	char type;
+	while (TRUE) {
+		p = skipSpaces(p, end);
+		if (p >= map + last) {
+			return;
+		}
+
+		const char *next = parseCell(p, end, &row, &col, &type);
+		if (next == NULL) {
+			fprintf(stderr, "Can't read the map at byte %ld\n", (long) (p - map));
+			exit(EXIT_FAILURE);
+		}
+		if ((row >= 0) && (row < WORLD_SIZE) && (col >= 0) && (col < WORLD_SIZE)) {
+			loadCell(row, col, atot(type), chunk);
+		}
+		p = next;
+	}
+}
+
+// Returns the first line starting at or after a given position
+size_t lineStart(const char *map, size_t size, size_t start, size_t position) {
+	if ((position == start) || (map[position-1] == '\n')) {
+		return position;
+	}
+	const char *line = memchr(map + position, '\n', size - position);
+	return (line == NULL) ? size : (size_t) (line - map) + 1;
+}
+
+// Splits the text lines in a chunk of bytes per thread, each starting
+// at the first line starting in it, and loads them all at once. When
+// several lines name the same cell the last one wins, as in the serial
+// build: chunks are numbered from 1 in the order of the file, and a
+// later chunk's cell is never overwritten by an earlier one.
+void loadMap(const char *map, size_t size, size_t start, int binary) {
+	if (binary) {
+		loadBinaryMap(map, size);
+		return;
+	}
+
+	int chunks = min(omp_get_max_threads(), UCHAR_MAX);
+	int chunk;
+	#pragma omp parallel for private(chunk)
+	for (chunk = 0; chunk < chunks; chunk++) {
+		size_t first = lineStart(map, size, start, start + (size - start) * chunk / chunks);
+		size_t last = lineStart(map, size, start, start + (size - start) * (chunk+1) / chunks);
+		loadTextLines(map, size, first, last, chunk+1);
+	}
+
+	// Clears the chunks left in has_moved, and copies the types to the
+	// old world when there is one
+	int row, col;
+	#pragma omp parallel for private(row,col)
+	for (row = 0; row < WORLD_SIZE; row++) {
+		for (col = 0; col < WORLD_SIZE; col++) {
+			new_world[row][col].has_moved = FALSE;
+			old_world[row][col].type = new_world[row][col].type;
+		}
+	}
+}
+
+void setCell(int row, int col, unsigned char type) {
+	old_world[row][col].type = type;
+	new_world[row][col].type = type;
+}
+
+void initWorlds() {
+	// The fused engine keeps its old world as a plane of types
+	// instead of a second copy of the cells
 	world_pos_t newWorld = malloc(sizeof(world_pos) * WORLD_SIZE * WORLD_SIZE);
-	world_pos_t oldWorld = malloc(sizeof(world_pos) * WORLD_SIZE * WORLD_SIZE);
-	omp_lock_t *lockWorld = malloc(sizeof(omp_lock_t) * WORLD_SIZE * WORLD_SIZE);
+	world_pos_t oldWorld = newWorld;
+	if (ENGINE != ENGINE_FUSED) {
+		oldWorld = malloc(sizeof(world_pos) * WORLD_SIZE * WORLD_SIZE);
+	} else {
+		size_t planeSize = (size_t) (WORLD_SIZE + 2) * (WORLD_SIZE + 2);
+		type_plane = malloc(planeSize);
+		memset(type_plane, ICE, planeSize);
+		row_lanes = malloc(sizeof(row_lanes_t) * omp_get_max_threads());
+		int t;
+		for (t = 0; t < omp_get_max_threads(); t++) {
+			allocLanes(&row_lanes[t]);
+		}
+	}
 	new_world = malloc(sizeof(world_pos_t) * WORLD_SIZE);
 	old_world = malloc(sizeof(world_pos_t) * WORLD_SIZE);
-	lock_world = malloc(sizeof(omp_lock_t *) * WORLD_SIZE);
 
 	int i;
 	for (i = 0; i < WORLD_SIZE; i++) {
 		new_world[i] = newWorld + i*WORLD_SIZE;
 		old_world[i] = oldWorld + i*WORLD_SIZE;
-		lock_world[i] = lockWorld + i*WORLD_SIZE;
 	}
 
 	// initialize both worlds with zeros
 	memset(oldWorld, 0, sizeof(world_pos) * WORLD_SIZE * WORLD_SIZE);
 	memset(newWorld, 0, sizeof(world_pos) * WORLD_SIZE * WORLD_SIZE);
-	for (i = 0; i < WORLD_SIZE*WORLD_SIZE; ++i) {
-		omp_init_lock(lockWorld + i);
+
+	// The gather engine never has two threads writing the same cell,
+	// it only needs to keep each sub-generation's moves. Neither do
+	// the occupancy and tiled engines.
+	if ((ENGINE == ENGINE_GATHER) || (ENGINE == ENGINE_OCCUPANCY)) {
+		move_plane = malloc((size_t) WORLD_SIZE * WORLD_SIZE);
+		memset(move_plane, NONE, (size_t) WORLD_SIZE * WORLD_SIZE);
+		occupancy_tiles = (WORLD_SIZE + OCCUPANCY_TILE - 1) / OCCUPANCY_TILE;
+	} else if (ENGINE != ENGINE_TILED) {
+		omp_lock_t *lockWorld = malloc(sizeof(omp_lock_t) * WORLD_SIZE * WORLD_SIZE);
+		lock_world = malloc(sizeof(omp_lock_t *) * WORLD_SIZE);
+		for (i = 0; i < WORLD_SIZE; i++) {
+			lock_world[i] = lockWorld + i*WORLD_SIZE;
+		}
+		for (i = 0; i < WORLD_SIZE*WORLD_SIZE; ++i) {
+			omp_init_lock(lockWorld + i);
+		}
 	}
-	
+}
+
+void init(const char *map, size_t size, char **argv) {
+	int binary;
+	size_t start = readMapHeader(map, size, &binary);
+
+	initWorlds();
 
 	// initialize both worlds with the map
-	int row;
-	int col;
-	char type;
-	while (fscanf(file, "%d %d %c", &row, &col, &type) == 3) {
-		old_world[row][col].type = atot(type);
-		new_world[row][col].type = atot(type);
-	}
+	loadMap(map, size, start, binary);
 
 	WOLF_BREEDING_LEVEL = atoi(argv[2]);
 	SQUIRREL_BREEDING_LEVEL = atoi(argv[3]);
@@ -142,404 +765,2255 @@ void init(FILE *file, char **argv) {
 	NUM_GENERATIONS = atoi(argv[5]);
 }
 
-void printWorld() {
-	int i, j;
-	for (i = 0; i < WORLD_SIZE; i++) {
-		for (j = 0; j < WORLD_SIZE; j++) {
-			if (new_world[i][j].type != EMPTY){
-				fprintf(stdout, "%d %d %c\n", i,j, ttoa(new_world[i][j].type));
+// Starts from a snapshot, with its rules, returning the generations it
+// was saved after
+int restart(const char *name, char **argv) {
+	size_t size;
+	const char *snapshot = mapFile(name, &size);
+	snapshot_header_t header;
+	memset(&header, 0, sizeof(header));
+	memcpy(&header, snapshot, min(size, sizeof(header)));
+	if ((size < sizeof(header)) || (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0)
+			|| (header.version != SNAPSHOT_VERSION) || (header.cell_size != sizeof(world_pos))
+			|| (header.world_size < 1)
+			|| (size != sizeof(header) + (size_t) header.world_size * header.world_size * sizeof(world_pos))) {
+		fprintf(stderr, "%s isn't a snapshot of version %d\n", name, SNAPSHOT_VERSION);
+		exit(EXIT_FAILURE);
+	}
+
+	WORLD_SIZE = header.world_size;
+	WOLF_BREEDING_LEVEL = header.wolf_breeding;
+	SQUIRREL_BREEDING_LEVEL = header.squirrel_breeding;
+	WOLF_STARVING_LEVEL = header.wolf_starving;
+	NUM_GENERATIONS = atoi(argv[5]);
+	initWorlds();
+
+	const world_pos *cells = (const world_pos *) (snapshot + sizeof(header));
+	int row, col;
+	#pragma omp parallel for private(row,col)
+	for (row = 0; row < WORLD_SIZE; row++) {
+		for (col = 0; col < WORLD_SIZE; col++) {
+			world_pos pos = cells[(size_t) row*WORLD_SIZE + col];
+			if (pos.type > SQUIRREL_ON_TREE) {
+				fprintf(stderr, "Unknown type: %d\n", pos.type);
+				exit(EXIT_FAILURE);
 			}
+			old_world[row][col] = pos;
+			new_world[row][col] = pos;
 		}
 	}
-}
 
-int isRedGen(int row, int col) {
-	return (row % 2) == (col % 2);
+	munmap((void *) snapshot, size);
+	return header.generation;
 }
 
-int isBlackGen(int row, int col) {
-	return !isRedGen(row, col);
+void writeAll(int fd, const char *data, size_t size, off_t offset) {
+	while (size > 0) {
+		ssize_t written = pwrite(fd, data, size, offset);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "Can't write the snapshot %s\n", checkpoint_file);
+			exit(EXIT_FAILURE);
+		}
+		data += written;
+		size -= written;
+		offset += written;
+	}
 }
 
+// Saves a snapshot through a temporary file, so a crash never leaves a
+// half written one behind
+void writeSnapshot(const char *name, snapshot_t *snapshot) {
+	char *temp = malloc(strlen(name) + 5);
+	sprintf(temp, "%s.tmp", name);
 
-void clean(world_pos_t pos) {
-	switch (pos->type) {
-		case TREE:
-		case SQUIRREL_ON_TREE:
-			pos->type = TREE;
-			break;
-
-		case ICE:
-			pos->type = ICE;
-			break;
-
-		default:
-			pos->type = EMPTY;
+	int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Can't write the snapshot %s\n", temp);
+		exit(EXIT_FAILURE);
 	}
 
-	pos->breeding_period = 0;
-	pos->starvation_period = 0;
-	pos->has_moved = 0;
+	snapshot_header_t header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.version = SNAPSHOT_VERSION;
+	header.cell_size = sizeof(world_pos);
+	header.world_size = WORLD_SIZE;
+	header.wolf_breeding = WOLF_BREEDING_LEVEL;
+	header.squirrel_breeding = SQUIRREL_BREEDING_LEVEL;
+	header.wolf_starving = WOLF_STARVING_LEVEL;
+	header.generation = snapshot->generation;
+	writeAll(fd, (const char *) &header, sizeof(header), 0);
+	writeAll(fd, (const char *) snapshot->cells, (size_t) WORLD_SIZE * WORLD_SIZE * sizeof(world_pos), sizeof(header));
+
+	if ((close(fd) != 0) || (rename(temp, name) != 0)) {
+		fprintf(stderr, "Can't write the snapshot %s\n", name);
+		exit(EXIT_FAILURE);
+	}
+	free(temp);
 }
 
-void cleanWorld() {
-	int i, j;
-	#pragma omp parallel for private(i,j)
-	for (i = 0; i < WORLD_SIZE; i++) {
-		for (j = 0; j < WORLD_SIZE; j++) {
-			clean(&new_world[i][j]);
+// Writes the queued snapshots in order until the run is done
+void *writeCheckpoints(void *arg) {
+	pthread_mutex_lock(&checkpoint_lock);
+	while (TRUE) {
+		while ((checkpoint_queued == 0) && !checkpoints_done) {
+			pthread_cond_wait(&checkpoint_ready, &checkpoint_lock);
+		}
+		if (checkpoint_queued == 0) {
+			break;
 		}
+
+		snapshot_t *snapshot = &checkpoint_buffers[checkpoint_head];
+		pthread_mutex_unlock(&checkpoint_lock);
+		writeSnapshot(checkpoint_file, snapshot);
+		pthread_mutex_lock(&checkpoint_lock);
+
+		checkpoint_head = (checkpoint_head + 1) % CHECKPOINT_BUFFERS;
+		checkpoint_queued--;
+		pthread_cond_signal(&checkpoint_written);
 	}
+	pthread_mutex_unlock(&checkpoint_lock);
+	return NULL;
 }
 
-int canMoveTo(world_pos_t from, world_pos_t to) {
-	// Can't move to ice
-	if (to->type == ICE) {
-		return FALSE;
+void startCheckpoints() {
+	checkpoint_buffers = malloc(sizeof(snapshot_t) * CHECKPOINT_BUFFERS);
+	int i;
+	for (i = 0; i < CHECKPOINT_BUFFERS; i++) {
+		checkpoint_buffers[i].cells = malloc(sizeof(world_pos) * WORLD_SIZE * WORLD_SIZE);
 	}
 
-	switch (from->type) {
-		case SQUIRREL:
-		case SQUIRREL_ON_TREE:
-			return (to->type == EMPTY) || (to->type == TREE);
+	if (pthread_create(&checkpoint_writer, NULL, writeCheckpoints, NULL) != 0) {
+		fprintf(stderr, "Can't start the snapshot writer\n");
+		exit(EXIT_FAILURE);
+	}
+}
 
-		case WOLF:
-			return (to->type == EMPTY) || (to->type == SQUIRREL);
+// Copies the world to a free buffer, waiting for one while the writer
+// is behind, and queues it to be written
+void checkpoint(int generation) {
+	pthread_mutex_lock(&checkpoint_lock);
+	while (checkpoint_queued == CHECKPOINT_BUFFERS) {
+		pthread_cond_wait(&checkpoint_written, &checkpoint_lock);
+	}
+	int slot = (checkpoint_head + checkpoint_queued) % CHECKPOINT_BUFFERS;
+	pthread_mutex_unlock(&checkpoint_lock);
 
-		default:
-			fprintf(stderr, "Can't move this type: %d\n", from->type);
-			exit(EXIT_FAILURE);
+	world_pos_t cells = checkpoint_buffers[slot].cells;
+	int row;
+	#pragma omp parallel for private(row)
+	for (row = 0; row < WORLD_SIZE; row++) {
+		memcpy(cells + (size_t) row*WORLD_SIZE, new_world[row], sizeof(world_pos) * WORLD_SIZE);
 	}
+	checkpoint_buffers[slot].generation = generation;
 
-	return FALSE;
+	pthread_mutex_lock(&checkpoint_lock);
+	checkpoint_queued++;
+	pthread_cond_signal(&checkpoint_ready);
+	pthread_mutex_unlock(&checkpoint_lock);
 }
 
-int isWolfToSquirrel(world_pos_t from, world_pos_t to) {
-	return (from->type == WOLF) && (to->type == SQUIRREL);
-}
+// Waits for the queued snapshots to be written
+void finishCheckpoints() {
+	pthread_mutex_lock(&checkpoint_lock);
+	checkpoints_done = TRUE;
+	pthread_cond_signal(&checkpoint_ready);
+	pthread_mutex_unlock(&checkpoint_lock);
+	pthread_join(checkpoint_writer, NULL);
 
-move_e getMove(int row, int col) {
-	const int NUM_OPTION = 4;
-	int available[NUM_OPTION];
-	memset( available, 0, NUM_OPTION*sizeof(int) );
-	int nAvailable = 0;
-    int nSquirrels = 0;
+	int i;
+	for (i = 0; i < CHECKPOINT_BUFFERS; i++) {
+		free(checkpoint_buffers[i].cells);
+	}
+	free(checkpoint_buffers);
+}
 
-    world_pos_t cur = &old_world[row][col];
+// Writes value as a varint, 7 bits per byte from the lowest ones, with
+// the top bit set on every byte but the last, returning where it ends
+char *formatVarint(char *text, unsigned long value) {
+	while (value >= 0x80) {
+		*text++ = (char) (value | 0x80);
+		value >>= 7;
+	}
+	*text++ = (char) value;
+	return text;
+}
 
-    // TOP
-    if ((row-1 >= 0) && canMoveTo(cur, &old_world[row-1][col])) {
-    	if (isWolfToSquirrel(cur, &old_world[row-1][col])) {
-			available[TOP] = 2;
-            nSquirrels++;
-		} else {
-            available[TOP] = 1;
-            nAvailable++;
-        }
-    }
-    
-    // RIGHT
-    if ((col+1 < WORLD_SIZE) && canMoveTo(cur, &old_world[row][col+1])) {
-    	if (isWolfToSquirrel(cur, &old_world[row][col+1])) {
-			available[RIGHT] = 2;
-            nSquirrels++;
-		} else {
-            available[RIGHT] = 1;
-            nAvailable++;
-        }
-    }
+unsigned char cellType(int row, int col) {
+	return new_world[row][col].type;
+}
 
-    // BOTTOM
-    if ((row+1 < WORLD_SIZE) && canMoveTo(cur, &old_world[row+1][col])) {
-    	if (isWolfToSquirrel(cur, &old_world[row+1][col])) {
-			available[BOTTOM] = 2;
-            nSquirrels++;
+// Encodes the rows from first to last of a frame at the end of buffer,
+// growing it as needed, and returns their length. A keyframe holds
+// every row as runs of a type, each a varint of the run's length minus
+// one shifted left by 3 bits plus the type. Other frames only hold the
+// rows that changed since the last frame: the row, the number of
+// changes and, for each one, a varint of the columns skipped since the
+// previous change shifted left by 3 bits plus the new type.
+size_t encodeRows(char **buffer, size_t *capacity, int first, int last, int keyframe) {
+	size_t length = 0;
+	int row, col;
+	for (row = first; row < last; row++) {
+		size_t needed = length + (size_t) (WORLD_SIZE + 2) * MAX_VARINT;
+		if (needed > *capacity) {
+			*capacity = max(needed, *capacity * 2);
+			*buffer = realloc(*buffer, *capacity);
+		}
+		unsigned char *types = trajectory_types + (size_t) row*WORLD_SIZE;
+		char *text = *buffer + length;
+
+		if (keyframe) {
+			col = 0;
+			while (col < WORLD_SIZE) {
+				unsigned char type = cellType(row, col);
+				int end = col + 1;
+				while ((end < WORLD_SIZE) && (cellType(row, end) == type)) {
+					end++;
+				}
+				memset(types + col, type, end - col);
+				text = formatVarint(text, ((unsigned long) (end - col - 1) << 3) | type);
+				col = end;
+			}
 		} else {
-            available[BOTTOM] = 1;
-            nAvailable++;
-        }
-    } 
+			int changes = 0;
+			for (col = 0; col < WORLD_SIZE; col++) {
+				changes += (cellType(row, col) != types[col]);
+			}
+			if (changes == 0) {
+				continue;
+			}
 
-    // LEFT
-    if ((col-1 >= 0) && canMoveTo(cur, &old_world[row][col-1])) {
-    	if (isWolfToSquirrel(cur, &old_world[row][col-1])) {
-			available[LEFT] = 2;
-            nSquirrels++;
-		} else {
-            available[LEFT] = 1;
-            nAvailable++;
-        }
-    }
-    
-    if (nAvailable == 0 && nSquirrels == 0)
-        return NONE;
-    
-    int n = 1;
-    if(nSquirrels != 0){
-        nAvailable = nSquirrels;
-        n = 2;
-    }
-    
-    int selected = numberOfPosition(row, col) % nAvailable;
-    int i;
-	for (i = 0; i < NUM_OPTION; i++) {
-		if (available[i] == n) {
-			if (selected == 0){
-				return i;
+			text = formatVarint(text, row);
+			text = formatVarint(text, changes);
+			int previous = -1;
+			for (col = 0; col < WORLD_SIZE; col++) {
+				unsigned char type = cellType(row, col);
+				if (type != types[col]) {
+					text = formatVarint(text, ((unsigned long) (col - previous - 1) << 3) | type);
+					types[col] = type;
+					previous = col;
+				}
 			}
-			selected--;
 		}
+		length = text - *buffer;
 	}
+	return length;
+}
 
-	return NONE;
+void writeTrajectory(const void *data, size_t size) {
+	if (fwrite(data, 1, size, trajectory) != size) {
+		fprintf(stderr, "Can't write the trajectory %s\n", trajectory_file);
+		exit(EXIT_FAILURE);
+	}
 }
 
-world_pos_t getDestination(int row, int col, move_e move, omp_lock_t **to_lock) {
-	switch (move) {
-		case TOP:
-			*to_lock = &lock_world[row-1][col]; 
-			return &new_world[row-1][col];
+void openTrajectory() {
+	trajectory = fopen(trajectory_file, "wb");
+	if (trajectory == NULL) {
+		fprintf(stderr, "Can't write the trajectory %s\n", trajectory_file);
+		exit(EXIT_FAILURE);
+	}
 
-		case RIGHT:
-			*to_lock = &lock_world[row][col+1]; 
-			return &new_world[row][col+1];
+	int32_t header[2] = {WORLD_SIZE, KEYFRAME_EVERY};
+	writeTrajectory(TRAJECTORY_MAGIC, BINARY_MAGIC_SIZE);
+	writeTrajectory(header, sizeof(header));
+	trajectory_types = malloc((size_t) WORLD_SIZE * WORLD_SIZE);
+	int threads = omp_get_max_threads();
+	frame_buffers = calloc(threads, sizeof(char *));
+	frame_capacities = calloc(threads, sizeof(size_t));
+	frame_lengths = malloc(sizeof(size_t) * threads);
+}
 
-		case BOTTOM:
-			*to_lock = &lock_world[row+1][col];
-			return &new_world[row+1][col];
+// Appends the frame of a generation to the trajectory: a varint of its
+// length, a byte telling a keyframe from a frame of changes, a varint
+// of the generation and its rows. The first frame is always a keyframe.
+void writeFrame(int generation) {
+	int keyframe = (trajectory_frames == 0) || (generation % KEYFRAME_EVERY == 0);
+	int threads = omp_get_max_threads();
+	int t;
+	#pragma omp parallel for
+	for (t = 0; t < threads; t++) {
+		int first = (long) WORLD_SIZE * t / threads;
+		int last = (long) WORLD_SIZE * (t+1) / threads;
+		frame_lengths[t] = encodeRows(&frame_buffers[t], &frame_capacities[t], first, last, keyframe);
+	}
 
-		case LEFT:
-			*to_lock = &lock_world[row][col-1]; 
-			return &new_world[row][col-1];
+	size_t length = 0;
+	for (t = 0; t < threads; t++) {
+		length += frame_lengths[t];
+	}
 
-		case NONE:
-			*to_lock = &lock_world[row][col]; 
-			return &new_world[row][col];
+	char header[2*MAX_VARINT + 1];
+	char tag[MAX_VARINT + 1];
+	tag[0] = keyframe ? KEYFRAME : DELTA_FRAME;
+	size_t tagLength = formatVarint(tag + 1, generation) - tag;
+	size_t headerLength = formatVarint(header, tagLength + length) - header;
+	memcpy(header + headerLength, tag, tagLength);
+
+	writeTrajectory(header, headerLength + tagLength);
+	for (t = 0; t < threads; t++) {
+		writeTrajectory(frame_buffers[t], frame_lengths[t]);
+	}
+	trajectory_frames++;
+}
+
+void closeTrajectory() {
+	if (fclose(trajectory) != 0) {
+		fprintf(stderr, "Can't write the trajectory %s\n", trajectory_file);
+		exit(EXIT_FAILURE);
+	}
+	free(trajectory_types);
+	int t;
+	for (t = 0; t < omp_get_max_threads(); t++) {
+		free(frame_buffers[t]);
+	}
+	free(frame_buffers);
+	free(frame_capacities);
+	free(frame_lengths);
+}
+
+// Opens a counter of the calling thread, only in user space, in the
+// given group (a new one when -1)
+int openEvent(const event_t *event, int group) {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = event->type;
+	attr.config = event->config;
+	attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+// Opens the counters of the calling thread. The first event that opens
+// leads the group, and the events that can't be opened are left out.
+void openEventGroup(event_group_t *group) {
+	group->leader = -1;
+	group->size = 0;
+	group->error = 0;
+	int e;
+	for (e = 0; e < NUM_EVENTS; e++) {
+		group->fds[e] = openEvent(&EVENTS[e], group->leader);
+		group->slots[e] = -1;
+		if (group->fds[e] < 0) {
+			if (group->error == 0) {
+				group->error = errno;
+			}
+			continue;
+		}
+		if (group->leader < 0) {
+			group->leader = group->fds[e];
+		}
+		group->slots[e] = group->size++;
+	}
+}
+
+// Opens the counters of every thread, which keep counting in every
+// parallel region as long as the number of threads doesn't change, or
+// carries on with the timers alone when none of them can be opened
+void startEvents() {
+	num_event_groups = omp_get_max_threads();
+	event_groups = calloc(num_event_groups, sizeof(event_group_t));
+	event_counts = calloc((size_t) num_event_groups * NUM_PHASES * NUM_EVENTS, sizeof(double));
+	#pragma omp parallel
+	openEventGroup(&event_groups[omp_get_thread_num()]);
+
+	int groups = 0;
+	int t, e;
+	for (t = 0; t < num_event_groups; t++) {
+		groups += (event_groups[t].leader >= 0);
+		for (e = 0; e < NUM_EVENTS; e++) {
+			events_open[e] |= (event_groups[t].slots[e] >= 0);
+		}
+	}
+
+	if (groups == 0) {
+		events_error = strerror(event_groups[0].error);
+		fprintf(stderr, "Hardware counters unavailable (%s), only timing the phases\n", events_error);
+		count_events = FALSE;
+	}
+}
+
+// Adds what the thread's counters counted since the last read to the
+// phase, scaled up when the kernel only ran them part of the time
+void readEvents(int thread, phase_e phase) {
+	event_group_t *group = &event_groups[thread];
+	uint64_t values[NUM_EVENTS + 3];
+	if ((group->leader < 0) || (read(group->leader, values, sizeof(values)) <= 0)) {
+		return;
+	}
+
+	uint64_t enabled = values[1] - group->last[1];
+	uint64_t running = values[2] - group->last[2];
+	if (running > 0) {
+		double scale = (double) enabled / running;
+		double *counts = event_counts + ((size_t) thread*NUM_PHASES + phase)*NUM_EVENTS;
+		int e;
+		for (e = 0; e < NUM_EVENTS; e++) {
+			int slot = group->slots[e];
+			if (slot >= 0) {
+				counts[e] += (values[slot+3] - group->last[slot+3]) * scale;
+			}
+		}
+	}
+	memcpy(group->last, values, sizeof(values));
+}
+
+void closeEvents() {
+	int t, e;
+	for (t = 0; t < num_event_groups; t++) {
+		for (e = 0; e < NUM_EVENTS; e++) {
+			if (event_groups[t].fds[e] >= 0) {
+				close(event_groups[t].fds[e]);
+			}
+		}
+	}
+	free(event_groups);
+	free(event_counts);
+}
+
+// Writes a member of an object of counters, null when it isn't known
+void writeEventValue(FILE *file, const char *name, const char *format, double value, int known) {
+	fprintf(file, "\"%s\": ", name);
+	if (known) {
+		fprintf(file, format, value);
+	} else {
+		fprintf(file, "null");
+	}
+}
+
+// Writes the counts of a phase, which took the given time, as an
+// object on a line, followed by the instructions per cycle and the
+// memory traffic in bytes, per second and per cell update of the run
+void writeEventCounts(FILE *file, const double *counts, double seconds, double updates) {
+	int e;
+	fprintf(file, "{");
+	for (e = 0; e < NUM_EVENTS; e++) {
+		writeEventValue(file, EVENTS[e].name, "%.0f", counts[e], events_open[e]);
+		fprintf(file, ", ");
+	}
+
+	double bytes = counts[EVENT_CACHE_MISSES] * CACHE_LINE;
+	int known = events_open[EVENT_CACHE_MISSES];
+	writeEventValue(file, "ipc", "%f", counts[EVENT_INSTRUCTIONS] / counts[EVENT_CYCLES],
+			events_open[EVENT_CYCLES] && events_open[EVENT_INSTRUCTIONS] && (counts[EVENT_CYCLES] > 0));
+	fprintf(file, ", ");
+	writeEventValue(file, "bytes", "%.0f", bytes, known);
+	fprintf(file, ", ");
+	writeEventValue(file, "bytes_per_second", "%.0f", bytes / seconds, known && (seconds > 0));
+	fprintf(file, ", ");
+	writeEventValue(file, "bytes_per_cell_update", "%f", bytes / updates, known && (updates > 0));
+	fprintf(file, "}");
+}
+
+// Writes the counters member of the timings: the counts of every
+// phase over all threads, then of each thread on its own, the memory
+// traffic of the generations per cell update and the branch misses of
+// the sweeps per move chosen
+void writeEvents(FILE *file, double updates) {
+	fprintf(file, ",\n\t\"counters\": {\n");
+	if (!count_events) {
+		fprintf(file, "\t\t\"available\": false,\n");
+		fprintf(file, "\t\t\"error\": \"%s\"\n", events_error);
+		fprintf(file, "\t}");
+		return;
+	}
+
+	double totals[NUM_PHASES][NUM_EVENTS];
+	memset(totals, 0, sizeof(totals));
+	int t, p, e;
+	for (t = 0; t < num_event_groups; t++) {
+		for (p = 0; p < NUM_PHASES; p++) {
+			for (e = 0; e < NUM_EVENTS; e++) {
+				totals[p][e] += event_counts[((size_t) t*NUM_PHASES + p)*NUM_EVENTS + e];
+			}
+		}
+	}
+
+	fprintf(file, "\t\t\"available\": true,\n");
+	fprintf(file, "\t\t\"phases\": {\n");
+	for (p = 0; p < NUM_PHASES; p++) {
+		fprintf(file, "\t\t\t\"%s\": ", PHASE_NAMES[p]);
+		writeEventCounts(file, totals[p], phase_times[p], updates);
+		fprintf(file, "%s\n", (p+1 < NUM_PHASES) ? "," : "");
+	}
+	fprintf(file, "\t\t},\n");
+
+	// threads only list the phases they counted something in
+	fprintf(file, "\t\t\"threads\": [\n");
+	for (t = 0; t < num_event_groups; t++) {
+		fprintf(file, "\t\t\t{");
+		int listed = 0;
+		for (p = 0; p < NUM_PHASES; p++) {
+			const double *counts = event_counts + ((size_t) t*NUM_PHASES + p)*NUM_EVENTS;
+			double sum = 0;
+			for (e = 0; e < NUM_EVENTS; e++) {
+				sum += counts[e];
+			}
+			if (sum > 0) {
+				fprintf(file, "%s\"%s\": ", (listed++ > 0) ? ", " : "", PHASE_NAMES[p]);
+				writeEventCounts(file, counts, phase_times[p], updates);
+			}
+		}
+		fprintf(file, "}%s\n", (t+1 < num_event_groups) ? "," : "");
+	}
+	fprintf(file, "\t\t],\n");
+
+	long calls = 0;
+	#pragma omp parallel reduction(+:calls)
+	calls += move_calls;
+
+	double misses = 0;
+	double mispredicts = 0;
+	for (p = PHASE_CULL; p <= PHASE_EXCHANGE; p++) {
+		misses += totals[p][EVENT_CACHE_MISSES];
+	}
+	for (p = PHASE_RED; p <= PHASE_SWEEP; p++) {
+		if (p != PHASE_BREED) {
+			mispredicts += totals[p][EVENT_BRANCH_MISSES];
+		}
+	}
+	fprintf(file, "\t\t\"move_calls\": %ld,\n", calls);
+	fprintf(file, "\t\t");
+	writeEventValue(file, "bytes_per_cell_update", "%f", misses * CACHE_LINE / updates,
+			events_open[EVENT_CACHE_MISSES] && (updates > 0));
+	fprintf(file, ",\n\t\t");
+	writeEventValue(file, "mispredicts_per_move_call", "%f", mispredicts / calls,
+			events_open[EVENT_BRANCH_MISSES] && (calls > 0));
+	fprintf(file, "\n\t}");
+}
+
+// Adds the time since the last lap to the phase, and what every
+// thread's counters counted when there are any
+void lap(phase_e phase) {
+	double now = omp_get_wtime();
+	phase_times[phase] += now - phase_clock;
+	phase_clock = now;
+
+	if (count_events) {
+		int t;
+		for (t = 0; t < num_event_groups; t++) {
+			readEvents(t, phase);
+		}
+	}
+}
+
+
+// Writes the time of every phase and the throughput of the generations
+// run, which took the given time, to timings_file
+void writeTimings(double took, int generations) {
+	FILE *file = fopen(timings_file, "w");
+	if (file == NULL) {
+		fprintf(stderr, "Can't create the timings %s\n", timings_file);
+		exit(EXIT_FAILURE);
+	}
+
+	double updates = (double) WORLD_SIZE * WORLD_SIZE * generations;
+	double seconds = (took > 0) ? took : 1;
+	fprintf(file, "{\n");
+	fprintf(file, "\t\"binary\": \"omp\",\n");
+	fprintf(file, "\t\"engine\": \"%s\",\n", etoa(ENGINE));
+	fprintf(file, "\t\"threads\": %d,\n", omp_get_max_threads());
+	fprintf(file, "\t\"processes\": 1,\n");
+	fprintf(file, "\t\"world_size\": %d,\n", WORLD_SIZE);
+	fprintf(file, "\t\"generations\": %d,\n", generations);
+	fprintf(file, "\t\"took\": %f,\n", took);
+	fprintf(file, "\t\"phases\": {\n");
+	int i;
+	for (i = 0; i < NUM_PHASES; i++) {
+		fprintf(file, "\t\t\"%s\": %f%s\n", PHASE_NAMES[i], phase_times[i], (i+1 < NUM_PHASES) ? "," : "");
+	}
+	fprintf(file, "\t},\n");
+	fprintf(file, "\t\"cell_updates\": %.0f,\n", updates);
+	fprintf(file, "\t\"cell_updates_per_second\": %.0f,\n", updates / seconds);
+	fprintf(file, "\t\"animal_moves\": %ld,\n", animal_moves);
+	fprintf(file, "\t\"animal_moves_per_second\": %.0f", animal_moves / seconds);
+	if (count_events || (events_error != NULL)) {
+		writeEvents(file, updates);
+	}
+	fprintf(file, "\n}\n");
+
+	if (fclose(file) != 0) {
+		fprintf(stderr, "Can't write the timings %s\n", timings_file);
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Mixes the bits of a key, as the last step of splitmix64
+unsigned long mix64(unsigned long key) {
+	key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9UL;
+	key = (key ^ (key >> 27)) * 0x94d049bb133111ebUL;
+	return key ^ (key >> 31);
+}
+
+// Digest of a cell, its position and type and the counters that matter
+// to it, which is 0 for empty cells. Digests are added up, so the cells
+// can be visited in any order.
+unsigned long cellDigest(int row, int col, world_pos_t pos) {
+	if (pos->type == EMPTY) {
+		return 0;
+	}
+
+	unsigned long key = (unsigned long) row * WORLD_SIZE + col;
+	key = (key << 8) | pos->type;
+	key = (key << 8) | (isAnimal(pos->type) ? pos->breeding_period : 0);
+	key = (key << 8) | ((pos->type == WOLF) ? pos->starvation_period : 0);
+	return mix64(key);
+}
+
+// Prints the digests of the world on a line: the generation, the digest
+// of the whole world and then the one of each region, row by row
+void printDigest(int generation) {
+	unsigned long total = 0;
+	unsigned long regions[DIGEST_REGIONS * DIGEST_REGIONS];
+	memset(regions, 0, sizeof(regions));
+
+	int row, col;
+	#pragma omp parallel for private(row,col) reduction(+:total,regions[:DIGEST_REGIONS*DIGEST_REGIONS])
+	for (row = 0; row < WORLD_SIZE; row++) {
+		unsigned long *rowRegions = regions + (long) row * DIGEST_REGIONS / WORLD_SIZE * DIGEST_REGIONS;
+		for (col = 0; col < WORLD_SIZE; col++) {
+			if (new_world[row][col].type != EMPTY) {
+				unsigned long digest = cellDigest(row, col, &new_world[row][col]);
+				total += digest;
+				rowRegions[(long) col * DIGEST_REGIONS / WORLD_SIZE] += digest;
+			}
+		}
+	}
+
+	fprintf(stderr, "Digest %d %016lx", generation, total);
+	int i;
+	for (i = 0; i < DIGEST_REGIONS * DIGEST_REGIONS; i++) {
+		fprintf(stderr, " %016lx", regions[i]);
+	}
+	fprintf(stderr, "\n");
+}
+
+// Writes the digits of a non negative integer, returning where they end
+char *formatInt(char *text, int value) {
+	char digits[10];
+	int n = 0;
+	do {
+		digits[n++] = '0' + value % 10;
+		value /= 10;
+	} while (value > 0);
+
+	while (n > 0) {
+		*text++ = digits[--n];
+	}
+	return text;
+}
+
+// Writes the "row col type" lines of a row of the world, returning where
+// they end
+char *formatRow(char *text, int row) {
+	char rowText[12];
+	int rowLength = formatInt(rowText, row) - rowText;
+	rowText[rowLength++] = ' ';
+
+	int col;
+	for (col = 0; col < WORLD_SIZE; col++) {
+		unsigned char type = new_world[row][col].type;
+		if (type != EMPTY) {
+			memcpy(text, rowText, rowLength);
+			text = formatInt(text + rowLength, col);
+			*text++ = ' ';
+			*text++ = ttoa(type);
+			*text++ = '\n';
+		}
+	}
+	return text;
+}
+
+// Writes blocks of text to stdout, as many at a time as the system takes
+void writeBlocks(struct iovec *blocks, int count) {
+	while (count > 0) {
+		ssize_t written = writev(STDOUT_FILENO, blocks, min(count, IOV_MAX));
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "Can't print the world\n");
+			exit(EXIT_FAILURE);
+		}
+
+		while ((count > 0) && ((size_t) written >= blocks->iov_len)) {
+			written -= blocks->iov_len;
+			blocks++;
+			count--;
+		}
+		if (count > 0) {
+			blocks->iov_base = (char *) blocks->iov_base + written;
+			blocks->iov_len -= written;
+		}
+	}
+}
+
+// Threads format a block of rows each, in order, and the blocks are
+// printed with a single writev
+void printWorld() {
+	// Whatever is buffered goes first
+	fflush(stdout);
+
+	int threads = omp_get_max_threads();
+	int blockRows = max(OUTPUT_BUFFER / (WORLD_SIZE * MAX_CELL_TEXT), 1);
+	size_t bufferSize = (size_t) blockRows * WORLD_SIZE * MAX_CELL_TEXT;
+	char *buffers = malloc(bufferSize * threads);
+	struct iovec *blocks = malloc(sizeof(struct iovec) * threads);
+
+	int row, t;
+	for (row = 0; row < WORLD_SIZE; row += blockRows * threads) {
+		#pragma omp parallel for private(t)
+		for (t = 0; t < threads; t++) {
+			char *buffer = buffers + bufferSize * t;
+			char *text = buffer;
+			int i;
+			for (i = row + t*blockRows; i < min(row + (t+1)*blockRows, WORLD_SIZE); i++) {
+				text = formatRow(text, i);
+			}
+			blocks[t].iov_base = buffer;
+			blocks[t].iov_len = text - buffer;
+		}
+		writeBlocks(blocks, threads);
+	}
+
+	free(buffers);
+	free(blocks);
+}
+
+int isRedGen(int row, int col) {
+	return (row % 2) == (col % 2);
+}
+
+int isBlackGen(int row, int col) {
+	return !isRedGen(row, col);
+}
+
+
+void clean(world_pos_t pos) {
+	switch (pos->type) {
+		case TREE:
+		case SQUIRREL_ON_TREE:
+			pos->type = TREE;
+			break;
+
+		case ICE:
+			pos->type = ICE;
+			break;
 
 		default:
-			fprintf(stderr, "Unknown move: %d\n", move);
+			pos->type = EMPTY;
+	}
+
+	pos->breeding_period = 0;
+	pos->starvation_period = 0;
+	pos->has_moved = 0;
+}
+
+void cleanWorld() {
+	int i, j;
+	#pragma omp parallel for private(i,j)
+	for (i = 0; i < WORLD_SIZE; i++) {
+		for (j = 0; j < WORLD_SIZE; j++) {
+			clean(&new_world[i][j]);
+		}
+	}
+}
+
+int canMoveTo(world_pos_t from, world_pos_t to) {
+	// Can't move to ice
+	if (to->type == ICE) {
+		return FALSE;
+	}
+
+	switch (from->type) {
+		case SQUIRREL:
+		case SQUIRREL_ON_TREE:
+			return (to->type == EMPTY) || (to->type == TREE);
+
+		case WOLF:
+			return (to->type == EMPTY) || (to->type == SQUIRREL);
+
+		default:
+			fprintf(stderr, "Can't move this type: %d\n", from->type);
 			exit(EXIT_FAILURE);
-			return NULL;
 	}
+
+	return FALSE;
+}
+
+int isWolfToSquirrel(world_pos_t from, world_pos_t to) {
+	return (from->type == WOLF) && (to->type == SQUIRREL);
+}
+
+move_e getMove(int row, int col) {
+	move_calls++;
+	const int NUM_OPTION = 4;
+	int available[NUM_OPTION];
+	memset( available, 0, NUM_OPTION*sizeof(int) );
+	int nAvailable = 0;
+    int nSquirrels = 0;
+
+    world_pos_t cur = &old_world[row][col];
+
+    // TOP
+    if ((row-1 >= 0) && canMoveTo(cur, &old_world[row-1][col])) {
+    	if (isWolfToSquirrel(cur, &old_world[row-1][col])) {
+			available[TOP] = 2;
+            nSquirrels++;
+		} else {
+            available[TOP] = 1;
+            nAvailable++;
+        }
+    }
+    
+    // RIGHT
+    if ((col+1 < WORLD_SIZE) && canMoveTo(cur, &old_world[row][col+1])) {
+    	if (isWolfToSquirrel(cur, &old_world[row][col+1])) {
+			available[RIGHT] = 2;
+            nSquirrels++;
+		} else {
+            available[RIGHT] = 1;
+            nAvailable++;
+        }
+    }
+
+    // BOTTOM
+    if ((row+1 < WORLD_SIZE) && canMoveTo(cur, &old_world[row+1][col])) {
+    	if (isWolfToSquirrel(cur, &old_world[row+1][col])) {
+			available[BOTTOM] = 2;
+            nSquirrels++;
+		} else {
+            available[BOTTOM] = 1;
+            nAvailable++;
+        }
+    } 
+
+    // LEFT
+    if ((col-1 >= 0) && canMoveTo(cur, &old_world[row][col-1])) {
+    	if (isWolfToSquirrel(cur, &old_world[row][col-1])) {
+			available[LEFT] = 2;
+            nSquirrels++;
+		} else {
+            available[LEFT] = 1;
+            nAvailable++;
+        }
+    }
+    
+    if (nAvailable == 0 && nSquirrels == 0)
+        return NONE;
+    
+    int n = 1;
+    if(nSquirrels != 0){
+        nAvailable = nSquirrels;
+        n = 2;
+    }
+    
+    int selected = numberOfPosition(row, col) % nAvailable;
+    int i;
+	for (i = 0; i < NUM_OPTION; i++) {
+		if (available[i] == n) {
+			if (selected == 0){
+				return i;
+			}
+			selected--;
+		}
+	}
+
+	return NONE;
+}
+
+world_pos_t getDestination(int row, int col, move_e move, omp_lock_t **to_lock) {
+	switch (move) {
+		case TOP:
+			*to_lock = &lock_world[row-1][col]; 
+			return &new_world[row-1][col];
+
+		case RIGHT:
+			*to_lock = &lock_world[row][col+1]; 
+			return &new_world[row][col+1];
+
+		case BOTTOM:
+			*to_lock = &lock_world[row+1][col];
+			return &new_world[row+1][col];
+
+		case LEFT:
+			*to_lock = &lock_world[row][col-1]; 
+			return &new_world[row][col-1];
+
+		case NONE:
+			*to_lock = &lock_world[row][col]; 
+			return &new_world[row][col];
+
+		default:
+			fprintf(stderr, "Unknown move: %d\n", move);
+			exit(EXIT_FAILURE);
+			return NULL;
+	}
+}
+
+void chooseBestSquirrel(world_pos_t from, world_pos_t to) {
+	to->breeding_period = max(from->breeding_period, to->breeding_period);
+}
+
+void chooseBestWolf(world_pos_t from, world_pos_t to) {
+	if (from->starvation_period == to->starvation_period) {
+		to->breeding_period = max(from->breeding_period, to->breeding_period);
+	} else if (from->starvation_period < to->starvation_period) {
+		to->breeding_period = from->breeding_period;
+		to->starvation_period = from->starvation_period;
+	}
+}
+
+
+/* 	Since animals avoid collisions by default,
+	if they encounter another animal, both have moved.
+
+	If an animal goes to an 'empty' position, it moves.
+
+	Since squirrels avoid wolfs, if a squirrel goes to
+	a position with a wolf, both have moved.
+
+	Since wolfs run after squirrels, he has moved.
+
+	Conclusion, in all cases, the animal in the end
+	always moves.
+*/
+void movePos(world_pos_t from, world_pos_t to) {
+	switch (from->type) {
+	   	case SQUIRREL:
+	   	case SQUIRREL_ON_TREE: {
+	   		switch (to->type) {
+	   		case WOLF:
+	   			to->starvation_period = 0;
+	   			break;
+
+	   		case SQUIRREL:
+	   		case SQUIRREL_ON_TREE:
+	   			chooseBestSquirrel(from, to);
+				break;
+
+			default:
+				copyPos(from, to);
+	   		}
+
+	   		break;
+	   	}
+
+		case WOLF: {
+			switch (to->type) {
+			case SQUIRREL:
+				copyPos(from, to);
+	    		to->starvation_period = 0;
+	    		break;
+
+			case WOLF:
+				chooseBestWolf(from, to);
+	    	 	break;
+
+	    	default:
+	    		copyPos(from, to);
+	    	}
+
+	    	break;
+	    }
+
+	    default:
+	    	fprintf(stderr, "Can't move %d!", from->type);
+	    	exit(EXIT_FAILURE);
+	}
+
+	to->has_moved = TRUE;
+}
+
+void updatePos(int row, int col) {
+	if ((old_world[row][col].type == EMPTY) || (old_world[row][col].type == TREE) || (old_world[row][col].type == ICE)) {
+		return;
+	}
+
+	move_e move = getMove(row, col);
+	world_pos_t from = &new_world[row][col];
+	omp_lock_t *to_lock = NULL;
+	world_pos_t to = getDestination(row, col, move, &to_lock);
+
+	if (from == to) {
+		return;
+	}
+
+	if (isBreeding(from)) {
+		from->breeding_period = 0;
+
+		omp_set_lock(to_lock);
+		movePos(from, to);
+		omp_unset_lock(to_lock);
+
+		breed(from); // This is the inverse of what we had
+	} else {
+		omp_set_lock(to_lock);
+		movePos(from, to);
+		omp_unset_lock(to_lock);
+		
+		clean(from);
+	}
+}
+
+void copyPos(world_pos_t from, world_pos_t to) {
+	switch (from->type) {
+		case SQUIRREL:
+		case SQUIRREL_ON_TREE: {
+			switch (to->type) {
+				case SQUIRREL_ON_TREE:
+				case TREE:
+					to->type = SQUIRREL_ON_TREE;
+					break;
+
+				default:
+					to->type = SQUIRREL;
+			}
+			break;
+		}
+
+		default:
+			to->type = from->type;
+	}
+
+	to->breeding_period = from->breeding_period;
+	to->starvation_period = from->starvation_period;
+	to->has_moved = from->has_moved;
+}
+
+// Copies the new world to the old world
+// It's independent of init
+void copyWorld() {
+	int i;
+	#pragma omp parallel for private(i)
+	for (i = 0; i < WORLD_SIZE; i++) {
+		memcpy(old_world[i], new_world[i], sizeof(world_pos)*WORLD_SIZE);
+	}
+}
+
+int isBreeding(world_pos_t pos) {
+	switch (pos->type) {
+		case WOLF:
+			return pos->breeding_period == WOLF_BREEDING_LEVEL;
+
+		case SQUIRREL:
+		case SQUIRREL_ON_TREE:
+			return pos->breeding_period == SQUIRREL_BREEDING_LEVEL;
+
+		default:
+			return FALSE;
+	}
+}
+
+int isStarving(world_pos_t pos) {
+	switch (pos->type) {
+		case WOLF:
+			return pos->starvation_period == WOLF_STARVING_LEVEL;
+
+		default:
+			return FALSE;
+	}
+}
+
+// Same as clean but the type remains
+void breed(world_pos_t pos) {
+	pos->breeding_period = 0;
+	pos->starvation_period = 0;
+	pos->has_moved = 0;
+}
+
+// Can be improved
+void playGen() {
+	// Before generation, cleans starving animals
+	int i, j;
+	#pragma omp parallel for schedule(dynamic) private(i,j)
+	for (i = 0; i < WORLD_SIZE; i++) {
+		for (j = 0; j < WORLD_SIZE; j++) {
+			if (isStarving(&new_world[i][j])) {
+				clean(&new_world[i][j]);
+			}
+		}
+	}
+	lap(PHASE_CULL);
+
+	// Must keep consistency between worlds
+	copyWorld();
+	lap(PHASE_COPY);
+
+	// Red sub-generation
+	#pragma omp parallel for private(i,j)
+	for (i = 0; i < WORLD_SIZE; i++) {
+		for (j = (i % 2); j < WORLD_SIZE; j+=2) {
+			updatePos(i, j);
+		}
+	}
+	lap(PHASE_RED);
+
+	// Must keep consistency between worlds
+	copyWorld();
+	lap(PHASE_COPY);
+
+	// Black sub-generation
+	#pragma omp parallel for private(i,j)
+	for (i = 0; i < WORLD_SIZE; i++) {
+		for (j = !(i % 2); j < WORLD_SIZE; j+=2) {
+			updatePos(i, j);
+		}
+	}
+	lap(PHASE_BLACK);
+
+	// After generation, increase breeding_period to the animals
+	// that moved
+	#pragma omp parallel for private(i,j) reduction(+:animal_moves)
+	for (i = 0; i < WORLD_SIZE; i++) {
+		for (j = 0; j < WORLD_SIZE; j++) {
+			if (new_world[i][j].has_moved) {
+				new_world[i][j].breeding_period++;
+				new_world[i][j].has_moved = FALSE;
+				animal_moves++;
+			}
+		}
+	}
+	lap(PHASE_BREED);
+}
+
+engine_e atoe(const char *name) {
+	if (strcmp(name, "dense") == 0) {
+		return ENGINE_DENSE;
+	}
+	if (strcmp(name, "fused") == 0) {
+		return ENGINE_FUSED;
+	}
+	if (strcmp(name, "gather") == 0) {
+		return ENGINE_GATHER;
+	}
+	if (strcmp(name, "tiled") == 0) {
+		return ENGINE_TILED;
+	}
+	if (strcmp(name, "occupancy") == 0) {
+		return ENGINE_OCCUPANCY;
+	}
+
+	fprintf(stderr, "Unknown engine: %s\n", name);
+	exit(EXIT_FAILURE);
+}
+
+const char *etoa(engine_e engine) {
+	switch (engine) {
+		case ENGINE_DENSE:     return "dense";
+		case ENGINE_FUSED:     return "fused";
+		case ENGINE_GATHER:    return "gather";
+		case ENGINE_TILED:     return "tiled";
+		case ENGINE_OCCUPANCY: return "occupancy";
+	}
+
+	return "unknown";
+}
+
+// Options come after the positional arguments
+void parseOptions(int argc, char **argv) {
+	const char *simd = "auto";
+	int i;
+	for (i = NUM_ARGUMENTS; i < argc; i++) {
+		if ((strcmp(argv[i], "--engine") == 0) && (i+1 < argc)) {
+			ENGINE = atoe(argv[++i]);
+		} else if ((strcmp(argv[i], "--simd") == 0) && (i+1 < argc)) {
+			simd = argv[++i];
+		} else if ((strcmp(argv[i], "--tile") == 0) && (i+1 < argc)) {
+			TILE_SIZE = atoi(argv[++i]);
+		} else if ((strcmp(argv[i], "--tile-generations") == 0) && (i+1 < argc)) {
+			TILE_GENERATIONS = atoi(argv[++i]);
+		} else if ((strcmp(argv[i], "--checkpoint") == 0) && (i+1 < argc)) {
+			checkpoint_file = argv[++i];
+		} else if ((strcmp(argv[i], "--checkpoint-every") == 0) && (i+1 < argc)) {
+			CHECKPOINT_EVERY = atoi(argv[++i]);
+		} else if ((strcmp(argv[i], "--checkpoint-buffers") == 0) && (i+1 < argc)) {
+			CHECKPOINT_BUFFERS = atoi(argv[++i]);
+		} else if ((strcmp(argv[i], "--restart") == 0) && (i+1 < argc)) {
+			restart_file = argv[++i];
+		} else if ((strcmp(argv[i], "--trajectory") == 0) && (i+1 < argc)) {
+			trajectory_file = argv[++i];
+		} else if ((strcmp(argv[i], "--keyframe-every") == 0) && (i+1 < argc)) {
+			KEYFRAME_EVERY = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--digest") == 0) {
+			print_digests = TRUE;
+		} else if ((strcmp(argv[i], "--timings") == 0) && (i+1 < argc)) {
+			timings_file = argv[++i];
+		} else if (strcmp(argv[i], "--counters") == 0) {
+			count_events = TRUE;
+		} else if ((strcmp(argv[i], "--occupancy-tile") == 0) && (i+1 < argc)) {
+			OCCUPANCY_TILE = atoi(argv[++i]);
+		} else {
+			fprintf(stderr, "Unknown option: %s\n", argv[i]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if ((TILE_SIZE < 1) || (TILE_GENERATIONS < 1) || (OCCUPANCY_TILE < 1)) {
+		fprintf(stderr, "Tiles must have at least a cell and a generation\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if ((CHECKPOINT_EVERY < 0) || ((CHECKPOINT_EVERY > 0) && (checkpoint_file == NULL))) {
+		fprintf(stderr, "Checkpoints need a --checkpoint file and a number of generations\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (CHECKPOINT_BUFFERS < 1) {
+		fprintf(stderr, "Checkpoints need at least a buffer\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (KEYFRAME_EVERY < 1) {
+		fprintf(stderr, "Keyframes need a number of generations\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (count_events && (timings_file == NULL)) {
+		fprintf(stderr, "Counters need a --timings file\n");
+		exit(EXIT_FAILURE);
+	}
+
+	moveMasks = atok(simd);
+}
+
+unsigned char *planeRow(int row) {
+	return type_plane + (size_t) (row+1)*(WORLD_SIZE+2) + 1;
+}
+
+// Bit per direction an animal can move to, in the low nibble, and
+// per direction with a squirrel for a wolf, in the high nibble.
+// Neighbours outside of the world must be ICE, which never matches
+// any type an animal can move to.
+unsigned char cellMoveMask(unsigned char cur, const unsigned char *neighbours) {
+	int freeMask = 0;
+	int preyMask = 0;
+	int i;
+	for (i = 0; i < 4; i++) {
+		unsigned char to = neighbours[i];
+		if (cur == WOLF) {
+			preyMask |= (to == SQUIRREL) << i;
+			freeMask |= (to == EMPTY) << i;
+		} else if ((cur == SQUIRREL) || (cur == SQUIRREL_ON_TREE)) {
+			freeMask |= ((to == EMPTY) || (to == TREE)) << i;
+		}
+	}
+
+	return freeMask | (preyMask << 4);
+}
+
+// Same as the end of getMove, given the types of the animal and of
+// its neighbours in move order
+move_e chooseMove(int row, int col, unsigned char cur, const unsigned char *neighbours) {
+	move_calls++;
+	unsigned char moveMask = cellMoveMask(cur, neighbours);
+
+	// squirrels are always preferred by wolves
+	int mask = (moveMask >> 4) ? (moveMask >> 4) : (moveMask & 0x0f);
+	if (mask == 0) {
+		return NONE;
+	}
+
+	int selected = numberOfPosition(row, col) % __builtin_popcount(mask);
+	int i;
+	for (i = 0; i < 4; i++) {
+		if (mask & (1 << i)) {
+			if (selected == 0) {
+				return i;
+			}
+			selected--;
+		}
+	}
+
+	return NONE;
+}
+
+// Same as chooseMove, from a mask and without branches. An empty
+// mask has a single option, NONE, to avoid dividing by zero.
+move_e maskedMove(int row, int col, unsigned char moveMask) {
+	move_calls++;
+	unsigned char prey = moveMask >> 4;
+	unsigned char mask = prey ? prey : (moveMask & 0x0f);
+	int selected = numberOfPosition(row, col) % MASK_OPTIONS[mask];
+	return (selected < 0) ? NONE : MASK_MOVES[mask][selected];
+}
+
+// Same as getMove, but the neighbours come from the type plane
+// and the animal from new_world, so there are no bounds checks
+move_e getMoveFused(int row, int col) {
+	unsigned char neighbours[4];
+	neighbours[TOP] = planeRow(row-1)[col];
+	neighbours[RIGHT] = planeRow(row)[col+1];
+	neighbours[BOTTOM] = planeRow(row+1)[col];
+	neighbours[LEFT] = planeRow(row)[col-1];
+
+	return chooseMove(row, col, new_world[row][col].type, neighbours);
+}
+
+// Move masks of n cells, given their types, the types above and below
+// them and the n+1 types between them, the one left of each cell and
+// then the one right of the last
+void moveMasksScalar(const unsigned char *up, const unsigned char *cur, const unsigned char *sides, const unsigned char *down, int n,
+		unsigned char *masks) {
+	int j;
+	for (j = 0; j < n; j++) {
+		unsigned char neighbours[4];
+		neighbours[TOP] = up[j];
+		neighbours[RIGHT] = sides[j+1];
+		neighbours[BOTTOM] = down[j];
+		neighbours[LEFT] = sides[j];
+		masks[j] = cellMoveMask(cur[j], neighbours);
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse4.2")))
+void moveMasksSSE(const unsigned char *up, const unsigned char *cur, const unsigned char *sides, const unsigned char *down, int n,
+		unsigned char *masks) {
+	const __m128i empty = _mm_setzero_si128();
+	const __m128i wolf = _mm_set1_epi8(WOLF);
+	const __m128i squirrel = _mm_set1_epi8(SQUIRREL);
+	const __m128i tree = _mm_set1_epi8(TREE);
+	const __m128i onTree = _mm_set1_epi8(SQUIRREL_ON_TREE);
+
+	int j, i;
+	for (j = 0; j + 16 <= n; j += 16) {
+		__m128i animals = _mm_loadu_si128((const __m128i *) (cur + j));
+		__m128i isWolf = _mm_cmpeq_epi8(animals, wolf);
+		__m128i isSquirrel = _mm_or_si128(_mm_cmpeq_epi8(animals, squirrel), _mm_cmpeq_epi8(animals, onTree));
+
+		__m128i neighbours[4];
+		neighbours[TOP] = _mm_loadu_si128((const __m128i *) (up + j));
+		neighbours[RIGHT] = _mm_loadu_si128((const __m128i *) (sides + j + 1));
+		neighbours[BOTTOM] = _mm_loadu_si128((const __m128i *) (down + j));
+		neighbours[LEFT] = _mm_loadu_si128((const __m128i *) (sides + j));
+
+		__m128i mask = empty;
+		for (i = 0; i < 4; i++) {
+			__m128i toEmpty = _mm_cmpeq_epi8(neighbours[i], empty);
+			__m128i toTree = _mm_cmpeq_epi8(neighbours[i], tree);
+			__m128i toSquirrel = _mm_cmpeq_epi8(neighbours[i], squirrel);
+			__m128i canMove = _mm_or_si128(_mm_and_si128(isWolf, toEmpty),
+					_mm_and_si128(isSquirrel, _mm_or_si128(toEmpty, toTree)));
+			__m128i prey = _mm_and_si128(isWolf, toSquirrel);
+			mask = _mm_or_si128(mask, _mm_and_si128(canMove, _mm_set1_epi8(1 << i)));
+			mask = _mm_or_si128(mask, _mm_and_si128(prey, _mm_set1_epi8(16 << i)));
+		}
+		_mm_storeu_si128((__m128i *) (masks + j), mask);
+	}
+
+	moveMasksScalar(up + j, cur + j, sides + j, down + j, n - j, masks + j);
+}
+
+__attribute__((target("avx2")))
+void moveMasksAVX2(const unsigned char *up, const unsigned char *cur, const unsigned char *sides, const unsigned char *down, int n,
+		unsigned char *masks) {
+	const __m256i empty = _mm256_setzero_si256();
+	const __m256i wolf = _mm256_set1_epi8(WOLF);
+	const __m256i squirrel = _mm256_set1_epi8(SQUIRREL);
+	const __m256i tree = _mm256_set1_epi8(TREE);
+	const __m256i onTree = _mm256_set1_epi8(SQUIRREL_ON_TREE);
+
+	int j, i;
+	for (j = 0; j + 32 <= n; j += 32) {
+		__m256i animals = _mm256_loadu_si256((const __m256i *) (cur + j));
+		__m256i isWolf = _mm256_cmpeq_epi8(animals, wolf);
+		__m256i isSquirrel = _mm256_or_si256(_mm256_cmpeq_epi8(animals, squirrel), _mm256_cmpeq_epi8(animals, onTree));
+
+		__m256i neighbours[4];
+		neighbours[TOP] = _mm256_loadu_si256((const __m256i *) (up + j));
+		neighbours[RIGHT] = _mm256_loadu_si256((const __m256i *) (sides + j + 1));
+		neighbours[BOTTOM] = _mm256_loadu_si256((const __m256i *) (down + j));
+		neighbours[LEFT] = _mm256_loadu_si256((const __m256i *) (sides + j));
+
+		__m256i mask = empty;
+		for (i = 0; i < 4; i++) {
+			__m256i toEmpty = _mm256_cmpeq_epi8(neighbours[i], empty);
+			__m256i toTree = _mm256_cmpeq_epi8(neighbours[i], tree);
+			__m256i toSquirrel = _mm256_cmpeq_epi8(neighbours[i], squirrel);
+			__m256i canMove = _mm256_or_si256(_mm256_and_si256(isWolf, toEmpty),
+					_mm256_and_si256(isSquirrel, _mm256_or_si256(toEmpty, toTree)));
+			__m256i prey = _mm256_and_si256(isWolf, toSquirrel);
+			mask = _mm256_or_si256(mask, _mm256_and_si256(canMove, _mm256_set1_epi8(1 << i)));
+			mask = _mm256_or_si256(mask, _mm256_and_si256(prey, _mm256_set1_epi8(16 << i)));
+		}
+		_mm256_storeu_si256((__m256i *) (masks + j), mask);
+	}
+
+	moveMasksScalar(up + j, cur + j, sides + j, down + j, n - j, masks + j);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+void moveMasksAVX512(const unsigned char *up, const unsigned char *cur, const unsigned char *sides, const unsigned char *down, int n,
+		unsigned char *masks) {
+	const __m512i empty = _mm512_setzero_si512();
+	const __m512i wolf = _mm512_set1_epi8(WOLF);
+	const __m512i squirrel = _mm512_set1_epi8(SQUIRREL);
+	const __m512i tree = _mm512_set1_epi8(TREE);
+	const __m512i onTree = _mm512_set1_epi8(SQUIRREL_ON_TREE);
+
+	int j, i;
+	for (j = 0; j + 64 <= n; j += 64) {
+		__m512i animals = _mm512_loadu_si512(cur + j);
+		__mmask64 isWolf = _mm512_cmpeq_epi8_mask(animals, wolf);
+		__mmask64 isSquirrel = _mm512_cmpeq_epi8_mask(animals, squirrel) | _mm512_cmpeq_epi8_mask(animals, onTree);
+
+		__m512i neighbours[4];
+		neighbours[TOP] = _mm512_loadu_si512(up + j);
+		neighbours[RIGHT] = _mm512_loadu_si512(sides + j + 1);
+		neighbours[BOTTOM] = _mm512_loadu_si512(down + j);
+		neighbours[LEFT] = _mm512_loadu_si512(sides + j);
+
+		__m512i mask = empty;
+		for (i = 0; i < 4; i++) {
+			__mmask64 toEmpty = _mm512_cmpeq_epi8_mask(neighbours[i], empty);
+			__mmask64 toTree = _mm512_cmpeq_epi8_mask(neighbours[i], tree);
+			__mmask64 toSquirrel = _mm512_cmpeq_epi8_mask(neighbours[i], squirrel);
+			__mmask64 canMove = (isWolf & toEmpty) | (isSquirrel & (toEmpty | toTree));
+			__mmask64 prey = isWolf & toSquirrel;
+			mask = _mm512_or_si512(mask, _mm512_maskz_set1_epi8(canMove, 1 << i));
+			mask = _mm512_or_si512(mask, _mm512_maskz_set1_epi8(prey, 16 << i));
+		}
+		_mm512_storeu_si512(masks + j, mask);
+	}
+
+	moveMasksScalar(up + j, cur + j, sides + j, down + j, n - j, masks + j);
+}
+#endif
+
+// Returns the move masks kernel with the given name, or NULL for
+// none, which makes the fused sweeps call getMoveFused cell by cell
+move_masks_f atok(const char *name) {
+	if (strcmp(name, "none") == 0) {
+		return NULL;
+	}
+	if (strcmp(name, "scalar") == 0) {
+		return moveMasksScalar;
+	}
+
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	int isAuto = (strcmp(name, "auto") == 0);
+	if ((isAuto || (strcmp(name, "avx512") == 0)) && __builtin_cpu_supports("avx512bw")) {
+		return moveMasksAVX512;
+	}
+	if ((isAuto || (strcmp(name, "avx2") == 0)) && __builtin_cpu_supports("avx2")) {
+		return moveMasksAVX2;
+	}
+	if ((isAuto || (strcmp(name, "sse4.2") == 0)) && __builtin_cpu_supports("sse4.2")) {
+		return moveMasksSSE;
+	}
+	if (isAuto) {
+		return moveMasksScalar;
+	}
+#else
+	if (strcmp(name, "auto") == 0) {
+		return moveMasksScalar;
+	}
+#endif
+
+	fprintf(stderr, "Unsupported SIMD kernel: %s\n", name);
+	exit(EXIT_FAILURE);
+}
+
+// Starvation cleanup of a row, which also publishes the row's
+// types for the red sub-generation
+void fusedCullRow(int row) {
+	unsigned char *types = planeRow(row);
+	int j;
+	for (j = 0; j < WORLD_SIZE; j++) {
+		if (isStarving(&new_world[row][j])) {
+			clean(&new_world[row][j]);
+		}
+		types[j] = new_world[row][j].type;
+	}
+}
+
+// Same as the end of updatePos, returning the move made. Only this
+// cell writes its own position during a sub-generation, so its type
+// in the plane is refreshed right away for the next sub-generation.
+move_e fusedApplyMove(int row, int col, move_e move) {
+	world_pos_t from = &new_world[row][col];
+	omp_lock_t *to_lock = NULL;
+	world_pos_t to = getDestination(row, col, move, &to_lock);
+
+	if (from == to) {
+		return NONE;
+	}
+
+	if (isBreeding(from)) {
+		from->breeding_period = 0;
+
+		omp_set_lock(to_lock);
+		movePos(from, to);
+		omp_unset_lock(to_lock);
+
+		breed(from);
+	} else {
+		omp_set_lock(to_lock);
+		movePos(from, to);
+		omp_unset_lock(to_lock);
+
+		clean(from);
+	}
+
+	planeRow(row)[col] = from->type;
+	return move;
+}
+
+void fusedUpdatePos(int row, int col) {
+	unsigned char type = new_world[row][col].type;
+	if ((type == EMPTY) || (type == TREE) || (type == ICE)) {
+		return;
+	}
+
+	fusedApplyMove(row, col, getMoveFused(row, col));
+}
+
+int isAnimal(unsigned char type) {
+	return (type == WOLF) || (type == SQUIRREL) || (type == SQUIRREL_ON_TREE);
+}
+
+// Copies every other byte of a row, n of them, next to each other
+void gatherLane(unsigned char *lane, const unsigned char *row, int n) {
+	int k;
+	for (k = 0; k < n; k++) {
+		lane[k] = row[2*k];
+	}
+}
+
+// Allocates the lanes of the cells of one colour of a row
+void allocLanes(row_lanes_t *lanes) {
+	int half = WORLD_SIZE/2 + 2;
+	lanes->up = malloc((size_t) 5 * half);
+	lanes->cur = lanes->up + half;
+	lanes->sides = lanes->cur + half;
+	lanes->down = lanes->sides + half;
+	lanes->masks = lanes->down + half;
+}
+
+void fusedUpdateRow(int row, int start) {
+	int j;
+	if (moveMasks == NULL) {
+		for (j = start; j < WORLD_SIZE; j += 2) {
+			fusedUpdatePos(row, j);
+		}
+		return;
+	}
+
+	// Cells only ever write their own types to the plane, so the
+	// ones being updated may be behind and are brought up to date.
+	// Only their columns are gathered, and the rows above and below
+	// never write theirs during this sub-generation.
+	row_lanes_t *lanes = &row_lanes[omp_get_thread_num()];
+	unsigned char *types = planeRow(row);
+	const unsigned char *up = planeRow(row-1);
+	const unsigned char *down = planeRow(row+1);
+	for (j = start; j < WORLD_SIZE; j += 2) {
+		types[j] = new_world[row][j].type;
+	}
+
+	int n = (WORLD_SIZE - start + 1) / 2;
+	int k;
+	gatherLane(lanes->up, up + start, n);
+	gatherLane(lanes->cur, types + start, n);
+	gatherLane(lanes->sides, types + start - 1, n+1);
+	gatherLane(lanes->down, down + start, n);
+
+	moveMasks(lanes->up, lanes->cur, lanes->sides, lanes->down, n, lanes->masks);
+	for (k = 0, j = start; k < n; k++, j += 2) {
+		if (isAnimal(lanes->cur[k])) {
+			fusedApplyMove(row, j, maskedMove(row, j, lanes->masks[k]));
+		}
+	}
+}
+
+// Returns the number of animals that moved into the row
+int fusedBreedRow(int row) {
+	int j;
+	int moves = 0;
+	for (j = 0; j < WORLD_SIZE; j++) {
+		if (new_world[row][j].has_moved) {
+			new_world[row][j].breeding_period++;
+			new_world[row][j].has_moved = FALSE;
+			moves++;
+		}
+	}
+	return moves;
+}
+
+// Same as playGen, but the starvation cleanup publishes the types the
+// red sub-generation reads and the sweeps keep them up to date, so
+// the world is never copied and all passes share one thread team
+void playGenFused() {
+	int i;
+	#pragma omp parallel private(i)
+	{
+		#pragma omp for schedule(dynamic)
+		for (i = 0; i < WORLD_SIZE; i++) {
+			fusedCullRow(i);
+		}
+		#pragma omp master
+		lap(PHASE_CULL);
+
+		// Red sub-generation
+		#pragma omp for
+		for (i = 0; i < WORLD_SIZE; i++) {
+			fusedUpdateRow(i, i % 2);
+		}
+		#pragma omp master
+		lap(PHASE_RED);
+
+		// Black sub-generation
+		#pragma omp for
+		for (i = 0; i < WORLD_SIZE; i++) {
+			fusedUpdateRow(i, !(i % 2));
+		}
+		#pragma omp master
+		lap(PHASE_BLACK);
+
+		#pragma omp for reduction(+:animal_moves)
+		for (i = 0; i < WORLD_SIZE; i++) {
+			animal_moves += fusedBreedRow(i);
+		}
+		#pragma omp master
+		lap(PHASE_BREED);
+	}
+}
+
+// The animal at a position of old_world as updatePos would hand it
+// to movePos when it leaves
+void leavingAnimal(int row, int col, world_pos_t animal) {
+	*animal = old_world[row][col];
+	if (isBreeding(animal)) {
+		animal->breeding_period = 0;
+	}
+}
+
+// Row of the gather engine's moves
+unsigned char *moveRow(int row) {
+	return move_plane + (size_t) row*WORLD_SIZE;
+}
+
+void gatherMoves(int row, int start) {
+	unsigned char *moves = moveRow(row);
+	int j;
+	for (j = start; j < WORLD_SIZE; j += 2) {
+		moves[j] = isAnimal(old_world[row][j].type) ? getMove(row, j) : NONE;
+	}
+}
+
+/*	Same result as updatePos, computed by the cell receiving the
+	animals instead of by the animals themselves, once the moves of
+	the sub-generation are known.
+
+	An animal of the colour being moved leaves behind its child or
+	an empty cell. A cell of the other colour takes the animals of
+	its neighbours whose move points at it, in the same row-major
+	order updatePos would have moved them. Every cell is only written
+	by its own iteration, so no locks are needed.
+*/
+void gatherLeave(int row, int col) {
+	world_pos_t cell = &new_world[row][col];
+	if (moveRow(row)[col] != NONE) {
+		if (isBreeding(cell)) {
+			breed(cell);
+		} else {
+			clean(cell);
+		}
+	}
+}
+
+void gatherArrive(int row, int col) {
+	world_pos_t cell = &new_world[row][col];
+
+	// nothing can move to ice, wolves or squirrels on trees
+	unsigned char type = cell->type;
+	if ((type == ICE) || (type == WOLF) || (type == SQUIRREL_ON_TREE)) {
+		return;
+	}
+
+	world_pos animal;
+	if ((row-1 >= 0) && (moveRow(row-1)[col] == BOTTOM)) {
+		leavingAnimal(row-1, col, &animal);
+		movePos(&animal, cell);
+	}
+	if ((col-1 >= 0) && (moveRow(row)[col-1] == RIGHT)) {
+		leavingAnimal(row, col-1, &animal);
+		movePos(&animal, cell);
+	}
+	if ((col+1 < WORLD_SIZE) && (moveRow(row)[col+1] == LEFT)) {
+		leavingAnimal(row, col+1, &animal);
+		movePos(&animal, cell);
+	}
+	if ((row+1 < WORLD_SIZE) && (moveRow(row+1)[col] == TOP)) {
+		leavingAnimal(row+1, col, &animal);
+		movePos(&animal, cell);
+	}
+}
+
+// The cells moving start at column start, the ones receiving
+// animals at the other column
+void gatherRow(int row, int start) {
+	int j;
+	for (j = start; j < WORLD_SIZE; j += 2) {
+		gatherLeave(row, j);
+	}
+	for (j = !start; j < WORLD_SIZE; j += 2) {
+		gatherArrive(row, j);
+	}
+}
+
+// Same as playGen with both sub-generations gathered
+void playGenGather() {
+	// Before generation, cleans starving animals
+	int i, j;
+	#pragma omp parallel for schedule(dynamic) private(i,j)
+	for (i = 0; i < WORLD_SIZE; i++) {
+		for (j = 0; j < WORLD_SIZE; j++) {
+			if (isStarving(&new_world[i][j])) {
+				clean(&new_world[i][j]);
+			}
+		}
+	}
+	lap(PHASE_CULL);
+
+	// Must keep consistency between worlds
+	copyWorld();
+	lap(PHASE_COPY);
+
+	// Red sub-generation
+	#pragma omp parallel private(i)
+	{
+		#pragma omp for
+		for (i = 0; i < WORLD_SIZE; i++) {
+			gatherMoves(i, i % 2);
+		}
+
+		#pragma omp for
+		for (i = 0; i < WORLD_SIZE; i++) {
+			gatherRow(i, i % 2);
+		}
+	}
+	lap(PHASE_RED);
+
+	// Must keep consistency between worlds
+	copyWorld();
+	lap(PHASE_COPY);
+
+	// Black sub-generation
+	#pragma omp parallel private(i)
+	{
+		#pragma omp for
+		for (i = 0; i < WORLD_SIZE; i++) {
+			gatherMoves(i, !(i % 2));
+		}
+
+		#pragma omp for
+		for (i = 0; i < WORLD_SIZE; i++) {
+			gatherRow(i, !(i % 2));
+		}
+	}
+	lap(PHASE_BLACK);
+
+	// After generation, increase breeding_period to the animals
+	// that moved
+	#pragma omp parallel for private(i,j) reduction(+:animal_moves)
+	for (i = 0; i < WORLD_SIZE; i++) {
+		for (j = 0; j < WORLD_SIZE; j++) {
+			if (new_world[i][j].has_moved) {
+				new_world[i][j].breeding_period++;
+				new_world[i][j].has_moved = FALSE;
+				animal_moves++;
+			}
+		}
+	}
+	lap(PHASE_BREED);
+}
+
+// Rows and columns of the world in an occupancy tile
+void occupancyBounds(int tile, int *row0, int *col0, int *row1, int *col1) {
+	*row0 = (tile / occupancy_tiles) * OCCUPANCY_TILE;
+	*col0 = (tile % occupancy_tiles) * OCCUPANCY_TILE;
+	*row1 = min(*row0 + OCCUPANCY_TILE, WORLD_SIZE);
+	*col1 = min(*col0 + OCCUPANCY_TILE, WORLD_SIZE);
+}
+
+// Copies a tile of new_world to old_world, counting its animals
+void occupancyCopy(int tile, int parity) {
+	int row0, col0, row1, col1;
+	occupancyBounds(tile, &row0, &col0, &row1, &col1);
+
+	int animals = 0;
+	int i, j;
+	for (i = row0; i < row1; i++) {
+		memcpy(&old_world[i][col0], &new_world[i][col0], sizeof(world_pos)*(col1 - col0));
+		for (j = col0; j < col1; j++) {
+			animals += isAnimal(new_world[i][j].type);
+		}
+	}
+	tile_animals[tile] = animals;
+}
+
+// Cleans the starving animals of a tile before the generation
+void occupancyCull(int tile, int parity) {
+	int row0, col0, row1, col1;
+	occupancyBounds(tile, &row0, &col0, &row1, &col1);
+
+	int i, j;
+	for (i = row0; i < row1; i++) {
+		for (j = col0; j < col1; j++) {
+			if (isStarving(&new_world[i][j])) {
+				clean(&new_world[i][j]);
+			}
+		}
+	}
+	occupancyCopy(tile, parity);
 }
 
-void chooseBestSquirrel(world_pos_t from, world_pos_t to) {
-	to->breeding_period = max(from->breeding_period, to->breeding_period);
+// Same as gatherMoves for the cells of the tile that move
+void occupancyMoves(int tile, int parity) {
+	int row0, col0, row1, col1;
+	occupancyBounds(tile, &row0, &col0, &row1, &col1);
+
+	int i, j;
+	for (i = row0; i < row1; i++) {
+		unsigned char *moves = moveRow(i);
+		for (j = col0 + (i + col0 + parity) % 2; j < col1; j += 2) {
+			moves[j] = isAnimal(old_world[i][j].type) ? getMove(i, j) : NONE;
+		}
+	}
+	tile_moves[tile] = TRUE;
 }
 
-void chooseBestWolf(world_pos_t from, world_pos_t to) {
-	if (from->starvation_period == to->starvation_period) {
-		to->breeding_period = max(from->breeding_period, to->breeding_period);
-	} else if (from->starvation_period < to->starvation_period) {
-		to->breeding_period = from->breeding_period;
-		to->starvation_period = from->starvation_period;
+// Same as gatherRow for the cells of the tile
+void occupancyGather(int tile, int parity) {
+	int row0, col0, row1, col1;
+	occupancyBounds(tile, &row0, &col0, &row1, &col1);
+
+	int i, j;
+	for (i = row0; i < row1; i++) {
+		int start = col0 + (i + col0 + parity) % 2;
+		for (j = start; j < col1; j += 2) {
+			gatherLeave(i, j);
+		}
+		for (j = col0 + (start == col0); j < col1; j += 2) {
+			gatherArrive(i, j);
+		}
 	}
 }
 
+// After the black sub-generation, increases breeding_period to the
+// animals of the tile that moved. The tile is copied by the next
+// generation's cleanup.
+void occupancyBreed(int tile, int parity) {
+	int row0, col0, row1, col1;
+	occupancyBounds(tile, &row0, &col0, &row1, &col1);
 
-/* 	Since animals avoid collisions by default,
-	if they encounter another animal, both have moved.
+	long moves = 0;
+	int i, j;
+	for (i = row0; i < row1; i++) {
+		for (j = col0; j < col1; j++) {
+			if (new_world[i][j].has_moved) {
+				new_world[i][j].breeding_period++;
+				new_world[i][j].has_moved = FALSE;
+				moves++;
+			}
+		}
+	}
 
-	If an animal goes to an 'empty' position, it moves.
+	#pragma omp atomic
+	animal_moves += moves;
+}
 
-	Since squirrels avoid wolfs, if a squirrel goes to
-	a position with a wolf, both have moved.
+// Whether a tile or any of the 8 around it holds animals. No other
+// tile can change in a sub-generation, animals only move one cell.
+int occupancyActive(int tile) {
+	int row = tile / occupancy_tiles;
+	int col = tile % occupancy_tiles;
+	int i, j;
+	for (i = max(row-1, 0); i <= min(row+1, occupancy_tiles-1); i++) {
+		for (j = max(col-1, 0); j <= min(col+1, occupancy_tiles-1); j++) {
+			if (tile_animals[i*occupancy_tiles + j] > 0) {
+				return TRUE;
+			}
+		}
+	}
+	return FALSE;
+}
 
-	Since wolfs run after squirrels, he has moved.
+/*	Lists the tiles that can change and splits the list in a queue
+	per thread.
 
-	Conclusion, in all cases, the animal in the end
-	always moves.
+	Tiles left out keep the moves of the last sub-generation they took
+	part in, which gatherArrive would read from the tiles next to them,
+	so those moves are cleared first.
 */
-void movePos(world_pos_t from, world_pos_t to) {
-	switch (from->type) {
-	   	case SQUIRREL:
-	   	case SQUIRREL_ON_TREE: {
-	   		switch (to->type) {
-	   		case WOLF:
-	   			to->starvation_period = 0;
-	   			break;
+void occupancySchedule() {
+	int numTiles = occupancy_tiles * occupancy_tiles;
+	int tile;
+	num_scheduled = 0;
+	for (tile = 0; tile < numTiles; tile++) {
+		if (occupancyActive(tile)) {
+			scheduled_tiles[num_scheduled++] = tile;
+		} else if (tile_moves[tile]) {
+			int row0, col0, row1, col1;
+			occupancyBounds(tile, &row0, &col0, &row1, &col1);
+
+			int i;
+			for (i = row0; i < row1; i++) {
+				memset(moveRow(i) + col0, NONE, col1 - col0);
+			}
+			tile_moves[tile] = FALSE;
+		}
+	}
 
-	   		case SQUIRREL:
-	   		case SQUIRREL_ON_TREE:
-	   			chooseBestSquirrel(from, to);
-				break;
+	occupancyRequeue();
+}
 
-			default:
-				copyPos(from, to);
-	   		}
+// Gives each thread back its share of the scheduled tiles
+void occupancyRequeue() {
+	int threads = omp_get_num_threads();
+	int t;
+	for (t = 0; t < threads; t++) {
+		tile_queues[t].next = (int) ((long) num_scheduled * t / threads);
+		tile_queues[t].end = (int) ((long) num_scheduled * (t+1) / threads);
+	}
+}
 
-	   		break;
-	   	}
+// Next tile of the thread's queue, or stolen from the other threads'
+// queues once it's empty. -1 when all queues are empty.
+int occupancyNext(int thread) {
+	int threads = omp_get_num_threads();
+	int t;
+	for (t = 0; t < threads; t++) {
+		tile_queue_t *queue = &tile_queues[(thread + t) % threads];
+		int next;
+		#pragma omp atomic read
+		next = queue->next;
+		if (next >= queue->end) {
+			continue;
+		}
 
-		case WOLF: {
-			switch (to->type) {
-			case SQUIRREL:
-				copyPos(from, to);
-	    		to->starvation_period = 0;
-	    		break;
+		#pragma omp atomic capture
+		next = queue->next++;
 
-			case WOLF:
-				chooseBestWolf(from, to);
-	    	 	break;
+		if (next < queue->end) {
+			return scheduled_tiles[next];
+		}
+	}
+	return -1;
+}
 
-	    	default:
-	    		copyPos(from, to);
-	    	}
+// Runs the work on the scheduled tiles, from within a parallel
+// region, timing how long each thread spends on it
+void occupancyRun(occupancy_work_f work, int parity) {
+	int thread = omp_get_thread_num();
+	double start = omp_get_wtime();
+	int tile;
+	while ((tile = occupancyNext(thread)) >= 0) {
+		work(tile, parity);
+		tile_queues[thread].tiles++;
+	}
+	tile_queues[thread].busy += omp_get_wtime() - start;
 
-	    	break;
-	    }
+	#pragma omp barrier
+}
 
-	    default:
-	    	fprintf(stderr, "Can't move %d!", from->type);
-	    	exit(EXIT_FAILURE);
-	}
+void occupancySubGen(int parity) {
+	#pragma omp single
+	occupancySchedule();
+	occupancyRun(occupancyMoves, parity);
 
-	to->has_moved = TRUE;
+	#pragma omp single
+	occupancyRequeue();
+	occupancyRun(occupancyGather, parity);
+	#pragma omp master
+	lap(parity ? PHASE_BLACK : PHASE_RED);
+
+	// Must keep consistency between worlds
+	#pragma omp single
+	occupancyRequeue();
+	occupancyRun(parity ? occupancyBreed : occupancyCopy, parity);
+	#pragma omp master
+	lap(parity ? PHASE_BREED : PHASE_COPY);
 }
 
-void updatePos(int row, int col) {
-	if ((old_world[row][col].type == EMPTY) || (old_world[row][col].type == TREE) || (old_world[row][col].type == ICE)) {
-		return;
+// Same as playGenGather, only on the tiles that can change
+void playGenOccupancy() {
+	int numTiles = occupancy_tiles * occupancy_tiles;
+	if (tile_animals == NULL) {
+		tile_animals = calloc(numTiles, sizeof(int));
+		tile_moves = calloc(numTiles, sizeof(char));
+		scheduled_tiles = malloc(sizeof(int) * numTiles);
+		tile_queues = calloc(omp_get_max_threads(), sizeof(tile_queue_t));
+
+		// The first cleanup copies and counts the whole world
+		for (num_scheduled = 0; num_scheduled < numTiles; num_scheduled++) {
+			scheduled_tiles[num_scheduled] = num_scheduled;
+		}
 	}
 
-	move_e move = getMove(row, col);
-	world_pos_t from = &new_world[row][col];
-	omp_lock_t *to_lock = NULL;
-	world_pos_t to = getDestination(row, col, move, &to_lock);
+	#pragma omp parallel
+	{
+		// Before generation, cleans starving animals. Only the tiles
+		// of the last black sub-generation can hold animals or still
+		// have to be copied.
+		#pragma omp single
+		occupancyRequeue();
+		occupancyRun(occupancyCull, 0);
+		#pragma omp master
+		lap(PHASE_CULL);
+
+		// Red sub-generation
+		occupancySubGen(0);
+
+		// Black sub-generation
+		occupancySubGen(1);
+	}
+}
 
-	if (from == to) {
-		return;
+// Reports how long each thread worked on tiles, to check the balance
+void printOccupancyBusy() {
+	int t;
+	for (t = 0; t < omp_get_max_threads(); t++) {
+		fprintf(stderr, "Thread %d busy %f s on %ld tiles\n", t, tile_queues[t].busy, tile_queues[t].tiles);
 	}
+}
 
-	if (isBreeding(from)) {
-		from->breeding_period = 0;
+// Allocates a tile's buffers for a region of at most size x size cells
+void tileAlloc(tile_t *tile, int size) {
+	size_t cells = (size_t) size * size;
+	tile->cells = malloc(sizeof(world_pos) * cells);
+	tile->moves = malloc(cells);
+}
 
-		omp_set_lock(to_lock);
-		movePos(from, to);
-		omp_unset_lock(to_lock);
+// Copies a region of old_world to the tile
+void tileLoad(tile_t *tile, int row0, int col0, int rows, int cols) {
+	tile->row0 = row0;
+	tile->col0 = col0;
+	tile->rows = rows;
+	tile->cols = cols;
 
-		breed(from); // This is the inverse of what we had
-	} else {
-		omp_set_lock(to_lock);
-		movePos(from, to);
-		omp_unset_lock(to_lock);
-		
-		clean(from);
+	int i;
+	for (i = 0; i < rows; i++) {
+		memcpy(tile->cells + (size_t) i*cols, &old_world[row0+i][col0], sizeof(world_pos)*cols);
 	}
 }
 
-void copyPos(world_pos_t from, world_pos_t to) {
-	switch (from->type) {
-		case SQUIRREL:
-		case SQUIRREL_ON_TREE: {
-			switch (to->type) {
-				case SQUIRREL_ON_TREE:
-				case TREE:
-					to->type = SQUIRREL_ON_TREE;
-					break;
+// Same as getMove inside the rows top to bottom and the columns left to
+// right (not included) of the tile. Cells beyond them are taken as ICE,
+// which is only right at the world's edges; the halo around a tile
+// absorbs the wrong moves everywhere else.
+move_e tileGetMove(tile_t *tile, int row, int col, int top, int bottom, int left, int right) {
+	world_pos_t cell = tile->cells + (size_t) row*tile->cols + col;
+	unsigned char neighbours[4];
+	neighbours[TOP] = (row > top) ? (cell - tile->cols)->type : ICE;
+	neighbours[RIGHT] = (col+1 < right) ? (cell + 1)->type : ICE;
+	neighbours[BOTTOM] = (row+1 < bottom) ? (cell + tile->cols)->type : ICE;
+	neighbours[LEFT] = (col > left) ? (cell - 1)->type : ICE;
+
+	return chooseMove(tile->row0 + row, tile->col0 + col, cell->type, neighbours);
+}
 
-				default:
-					to->type = SQUIRREL;
-			}
-			break;
-		}
+// Moves into a receiving cell of the tile from the neighbour at
+// the given offset if that neighbour's move points at it
+void tileArrive(tile_t *tile, world_pos_t to, size_t from, move_e move) {
+	if (tile->moves[from] != move) {
+		return;
+	}
 
-		default:
-			to->type = from->type;
+	world_pos animal = tile->cells[from];
+	if (isBreeding(&animal)) {
+		animal.breeding_period = 0;
 	}
+	movePos(&animal, to);
+}
 
-	to->breeding_period = from->breeding_period;
-	to->starvation_period = from->starvation_period;
-	to->has_moved = from->has_moved;
+// The first column from left whose parity is the one of start
+int tileFirstCol(int left, int start) {
+	return left + (left + start) % 2;
 }
 
-// Copies the new world to the old world
-// It's independent of init
-void copyWorld() {
-	int i;
-	#pragma omp parallel for private(i)
-	for (i = 0; i < WORLD_SIZE; i++) {
-		memcpy(old_world[i], new_world[i], sizeof(world_pos)*WORLD_SIZE);
+void tileMoves(tile_t *tile, int row, int start, int top, int bottom, int left, int right) {
+	size_t base = (size_t) row*tile->cols;
+	int j;
+	for (j = tileFirstCol(left, start); j < right; j += 2) {
+		tile->moves[base + j] = isAnimal(tile->cells[base + j].type)
+			? tileGetMove(tile, row, j, top, bottom, left, right) : NONE;
 	}
 }
 
-int isBreeding(world_pos_t pos) {
-	switch (pos->type) {
-		case WOLF:
-			return pos->breeding_period == WOLF_BREEDING_LEVEL;
-
-		case SQUIRREL:
-		case SQUIRREL_ON_TREE:
-			return pos->breeding_period == SQUIRREL_BREEDING_LEVEL;
-
-		default:
-			return FALSE;
+void tileArriveRow(tile_t *tile, int row, int start, int top, int bottom, int left, int right) {
+	int cols = tile->cols;
+	size_t base = (size_t) row*cols;
+	int j;
+	for (j = tileFirstCol(left, start); j < right; j += 2) {
+		world_pos_t cell = &tile->cells[base + j];
+		if (row > top) {
+			tileArrive(tile, cell, base + j - cols, BOTTOM);
+		}
+		if (j > left) {
+			tileArrive(tile, cell, base + j - 1, RIGHT);
+		}
+		if (j+1 < right) {
+			tileArrive(tile, cell, base + j + 1, LEFT);
+		}
+		if (row+1 < bottom) {
+			tileArrive(tile, cell, base + j + cols, TOP);
+		}
 	}
 }
 
-int isStarving(world_pos_t pos) {
-	switch (pos->type) {
-		case WOLF:
-			return pos->starvation_period == WOLF_STARVING_LEVEL;
-
-		default:
-			return FALSE;
+void tileLeaveRow(tile_t *tile, int row, int start, int left, int right) {
+	size_t base = (size_t) row*tile->cols;
+	int j;
+	for (j = tileFirstCol(left, start); j < right; j += 2) {
+		world_pos_t cell = &tile->cells[base + j];
+		if (tile->moves[base + j] != NONE) {
+			if (isBreeding(cell)) {
+				breed(cell);
+			} else {
+				clean(cell);
+			}
+		}
 	}
 }
 
-// Same as clean but the type remains
-void breed(world_pos_t pos) {
-	pos->breeding_period = 0;
-	pos->starvation_period = 0;
-	pos->has_moved = 0;
+/*	One sub-generation of the rows top to bottom and the columns left
+	to right (not included) of the tile, moving the cells whose column
+	in the tile starts at (row + parity) % 2. Gathered like gatherRow,
+	but in place: the moves of a row are computed before the row above
+	takes its animals, and the animals of a row only leave once the row
+	below has taken them.
+*/
+void tileSubGen(tile_t *tile, int parity, int top, int bottom, int left, int right) {
+	int i;
+	tileMoves(tile, top, (top + parity) % 2, top, bottom, left, right);
+	for (i = top; i <= bottom; i++) {
+		if (i+1 < bottom) {
+			tileMoves(tile, i+1, (i+1 + parity) % 2, top, bottom, left, right);
+		}
+		if (i < bottom) {
+			tileArriveRow(tile, i, (i + parity + 1) % 2, top, bottom, left, right);
+		}
+		if (i > top) {
+			tileLeaveRow(tile, i-1, (i-1 + parity) % 2, left, right);
+		}
+	}
 }
 
-// Can be improved
-void playGen() {
-	// Before generation, cleans starving animals
+// Same as playGen on the rows top to bottom and the columns left to
+// right (not included) of the tile, returning the moves into the tile's
+// own cells, the ones the halo doesn't make wrong
+long tileGen(tile_t *tile, int top, int bottom, int left, int right) {
 	int i, j;
-	#pragma omp parallel for schedule(dynamic) private(i,j)
-	for (i = 0; i < WORLD_SIZE; i++) {
-		for (j = 0; j < WORLD_SIZE; j++) {
-			if (isStarving(&new_world[i][j])) {
-				clean(&new_world[i][j]);
+	for (i = top; i < bottom; i++) {
+		world_pos_t cells = tile->cells + (size_t) i*tile->cols;
+		for (j = left; j < right; j++) {
+			if (isStarving(&cells[j])) {
+				clean(&cells[j]);
 			}
 		}
 	}
 
-	// Must keep consistency between worlds
-	copyWorld();
+	// red cells have the same row and column parity in the world
+	int red = (tile->row0 + tile->col0) % 2;
+	tileSubGen(tile, red, top, bottom, left, right);
+	tileSubGen(tile, !red, top, bottom, left, right);
 
-	// Red sub-generation
-	#pragma omp parallel for private(i,j)
-	for (i = 0; i < WORLD_SIZE; i++) {
-		for (j = (i % 2); j < WORLD_SIZE; j+=2) {
-			updatePos(i, j);
+	long moves = 0;
+	for (i = tile->own_row; i < tile->own_row + tile->own_rows; i++) {
+		world_pos_t cells = tile->cells + (size_t) i*tile->cols;
+		for (j = tile->own_col; j < tile->own_col + tile->own_cols; j++) {
+			moves += cells[j].has_moved;
 		}
 	}
 
-	// Must keep consistency between worlds
-	copyWorld();
-
-	// Black sub-generation
-	#pragma omp parallel for private(i,j)
-	for (i = 0; i < WORLD_SIZE; i++) {
-		for (j = !(i % 2); j < WORLD_SIZE; j+=2) {
-			updatePos(i, j);
+	for (i = top; i < bottom; i++) {
+		world_pos_t cells = tile->cells + (size_t) i*tile->cols;
+		for (j = left; j < right; j++) {
+			if (cells[j].has_moved) {
+				cells[j].breeding_period++;
+				cells[j].has_moved = FALSE;
+			}
 		}
 	}
+	return moves;
+}
+
+// Advances the tile of new_world at (row, col) by the given number of
+// generations, working on a copy of old_world that reaches far enough
+// around it: each sub-generation can only move an animal one cell
+// based on what's one cell further, so 4 cells per generation. The
+// cells within 4 of a side that isn't the world's edge are wrong after
+// a generation, so each generation computes 4 cells less on that side.
+// Returns the moves into the tile.
+long advanceTile(tile_t *tile, int row, int col, int generations) {
+	int halo = 4 * generations;
+	int row0 = max(row - halo, 0);
+	int col0 = max(col - halo, 0);
+	int row1 = min(row + TILE_SIZE + halo, WORLD_SIZE);
+	int col1 = min(col + TILE_SIZE + halo, WORLD_SIZE);
+	tileLoad(tile, row0, col0, row1 - row0, col1 - col0);
+
+	int rows = min(TILE_SIZE, WORLD_SIZE - row);
+	int cols = min(TILE_SIZE, WORLD_SIZE - col);
+	tile->own_row = row - row0;
+	tile->own_col = col - col0;
+	tile->own_rows = rows;
+	tile->own_cols = cols;
+
+	int top = 0;
+	int bottom = tile->rows;
+	int left = 0;
+	int right = tile->cols;
+	long moves = 0;
+	int gen;
+	for (gen = 0; gen < generations; gen++) {
+		moves += tileGen(tile, top, bottom, left, right);
+		top += (row0 > 0) ? 4 : 0;
+		bottom -= (row1 < WORLD_SIZE) ? 4 : 0;
+		left += (col0 > 0) ? 4 : 0;
+		right -= (col1 < WORLD_SIZE) ? 4 : 0;
+	}
 
-	// After generation, increase breeding_period to the animals
-	// that moved
-	#pragma omp parallel for private(i,j)
-	for (i = 0; i < WORLD_SIZE; i++) {
-		for (j = 0; j < WORLD_SIZE; j++) {
-			if (new_world[i][j].has_moved) {
-				new_world[i][j].breeding_period++;
-				new_world[i][j].has_moved = FALSE;
-			}
+	int i;
+	for (i = 0; i < rows; i++) {
+		world_pos_t src = tile->cells + (size_t) (row - row0 + i)*tile->cols + (col - col0);
+		memcpy(&new_world[row+i][col], src, sizeof(world_pos)*cols);
+	}
+	return moves;
+}
+
+// Same as calling playGen the given number of times, a tile at a
+// time. Tiles only read old_world and write their own part of
+// new_world, so they need no locks.
+void playGensTiled(int generations) {
+	world_t swap = old_world;
+	old_world = new_world;
+	new_world = swap;
+
+	int numTiles = (WORLD_SIZE + TILE_SIZE - 1) / TILE_SIZE;
+	int t;
+	if (tiles == NULL) {
+		tiles = malloc(sizeof(tile_t) * omp_get_max_threads());
+		for (t = 0; t < omp_get_max_threads(); t++) {
+			tileAlloc(&tiles[t], TILE_SIZE + 8*TILE_GENERATIONS);
 		}
 	}
+
+	#pragma omp parallel for schedule(dynamic) private(t) reduction(+:animal_moves)
+	for (t = 0; t < numTiles*numTiles; t++) {
+		animal_moves += advanceTile(&tiles[omp_get_thread_num()], (t / numTiles) * TILE_SIZE,
+				(t % numTiles) * TILE_SIZE, generations);
+	}
+	lap(PHASE_SWEEP);
 }
 
 int main(int argc, char **argv) {
@@ -548,24 +3022,116 @@ int main(int argc, char **argv) {
 		exit(EXIT_FAILURE);
 	}
 
-	FILE *input = fopen(argv[1], "r");
-	if (input == NULL) {
-		fprintf(stderr, "File %s not found...\n", argv[1]);
-		exit(EXIT_FAILURE);
+	parseOptions(argc, argv);
+
+	if (count_events) {
+		startEvents();
 	}
+	phase_clock = omp_get_wtime();
+	int first = 0;
+	if (restart_file != NULL) {
+		first = restart(restart_file, argv);
+	} else {
+		size_t size;
+		const char *map = mapFile(argv[1], &size);
+		init(map, size, argv);
+		munmap((void *) map, size);
+	}
+	lap(PHASE_PARSE);
+	fprintf(stderr, "Init took %f\n", phase_times[PHASE_PARSE]);
 
-	init(input, argv);
-	fclose(input);
+	double start = phase_clock;
+	if (checkpoint_file != NULL) {
+		startCheckpoints();
+		lap(PHASE_CHECKPOINT);
+	}
 
-	double start = omp_get_wtime();
+	if (trajectory_file != NULL) {
+		openTrajectory();
+		writeFrame(first);
+		lap(PHASE_TRAJECTORY);
+	}
+	if (print_digests) {
+		printDigest(first);
+		lap(PHASE_DIGEST);
+	}
+
+	int saved = -1;
 	int gen;
-	for (gen = 0; gen < NUM_GENERATIONS; gen++) {
-		playGen();
+	for (gen = first; gen < NUM_GENERATIONS; gen++) {
+		if (ENGINE == ENGINE_TILED) {
+			// Stops at every checkpoint, and at every generation for
+			// the trajectory and the digests
+			int generations = min(TILE_GENERATIONS, NUM_GENERATIONS - gen);
+			if (CHECKPOINT_EVERY > 0) {
+				generations = min(generations, CHECKPOINT_EVERY - gen % CHECKPOINT_EVERY);
+			}
+			if ((trajectory_file != NULL) || print_digests) {
+				generations = 1;
+			}
+			playGensTiled(generations);
+			gen += generations - 1;
+		} else if (ENGINE == ENGINE_FUSED) {
+			playGenFused();
+		} else if (ENGINE == ENGINE_GATHER) {
+			playGenGather();
+		} else if (ENGINE == ENGINE_OCCUPANCY) {
+			playGenOccupancy();
+		} else {
+			playGen();
+		}
+
+		if ((CHECKPOINT_EVERY > 0) && ((gen+1) % CHECKPOINT_EVERY == 0)) {
+			checkpoint(gen+1);
+			lap(PHASE_CHECKPOINT);
+			saved = gen+1;
+		}
+
+		if (trajectory_file != NULL) {
+			writeFrame(gen+1);
+			lap(PHASE_TRAJECTORY);
+		}
+		if (print_digests) {
+			printDigest(gen+1);
+			lap(PHASE_DIGEST);
+		}
+	}
+
+	if (trajectory_file != NULL) {
+		closeTrajectory();
+		lap(PHASE_TRAJECTORY);
+	}
+
+	if (checkpoint_file != NULL) {
+		if (saved != gen) {
+			checkpoint(gen);
+		}
+		finishCheckpoints();
+		lap(PHASE_CHECKPOINT);
+	}
+
+	double took = phase_clock - start - phase_times[PHASE_CHECKPOINT] - phase_times[PHASE_TRAJECTORY]
+		- phase_times[PHASE_DIGEST];
+	printf("Took %f\n", took);
+	if (checkpoint_file != NULL) {
+		fprintf(stderr, "Checkpoints took %f\n", phase_times[PHASE_CHECKPOINT]);
+	}
+	if (trajectory_file != NULL) {
+		fprintf(stderr, "Trajectory took %f\n", phase_times[PHASE_TRAJECTORY]);
 	}
 
-	double end = omp_get_wtime();
-	printf("Took %f\n", end - start);
+	if ((ENGINE == ENGINE_OCCUPANCY) && (tile_queues != NULL)) {
+		printOccupancyBusy();
+	}
 
 	printWorld();
+	lap(PHASE_OUTPUT);
+
+	if (timings_file != NULL) {
+		writeTimings(took, max(NUM_GENERATIONS - first, 0));
+	}
+	if (count_events) {
+		closeEvents();
+	}
 	return 0;
 }
@@ -1,7 +1,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
 #include <omp.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #define FALSE 0
 #define TRUE 1
@@ -16,6 +30,21 @@
 #define ICE 4
 #define SQUIRREL_ON_TREE 5
 
+// Binary maps start with BINARY_MAGIC and the world's size as a 32 bit
+// integer, followed by the type of every cell of the world, a byte each,
+// row by row
+#define BINARY_MAGIC "WSQMAP01"
+#define BINARY_MAGIC_SIZE 8
+#define BINARY_HEADER_SIZE 12
+
+// The world is printed in blocks of rows formatted in OUTPUT_BUFFER
+// sized buffers, MAX_CELL_TEXT characters at most per cell
+#define OUTPUT_BUFFER (1 << 20)
+#define MAX_CELL_TEXT 26
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 // None must always be the last one
 typedef enum {
 	TOP = 0,
@@ -35,10 +64,185 @@ typedef struct {
 typedef world_pos **world_t;
 typedef world_pos *world_pos_t;
 
+// Snapshots hold the whole state of a run: this header and then every
+// cell of the world, row by row
+#define SNAPSHOT_MAGIC "WSQSNAP"
+#define SNAPSHOT_VERSION 1
+
+// Trajectories start with these 8 bytes, the world's size and the
+// keyframe interval as 32 bit integers, and then hold a frame per
+// generation. See encodeRows.
+#define TRAJECTORY_MAGIC "WSQTRJ01"
+#define KEYFRAME 0
+#define DELTA_FRAME 1
+#define MAX_VARINT 10
+
+// Digests are the sums of the cells' digests over the whole world and
+// over each of the DIGEST_REGIONS x DIGEST_REGIONS regions it's split in
+#define DIGEST_REGIONS 4
+
+// Memory traffic is taken as a CACHE_LINE per cache miss
+#define CACHE_LINE 64
+
+typedef struct {
+	char magic[8];
+	int32_t version;
+	int32_t cell_size;
+	int32_t world_size;
+	int32_t wolf_breeding;
+	int32_t squirrel_breeding;
+	int32_t wolf_starving;
+	int32_t generation;
+	int32_t padding;
+} snapshot_header_t;
+
+// A copy of the world waiting to be written as a snapshot
+typedef struct {
+	world_pos_t cells;
+	int generation;
+} snapshot_t;
+
+typedef enum {
+	ENGINE_DENSE = 0,
+	ENGINE_FUSED = 1,
+	ENGINE_SPARSE = 2,
+	ENGINE_COMPACT = 3,
+	ENGINE_TILED = 4
+} engine_e;
+
+// Phases the run's time is split in. Sweep is a whole call of the
+// tiled engine, which doesn't go through the other phases one by one.
+// Num phases must always be the last one
+typedef enum {
+	PHASE_PARSE = 0,
+	PHASE_CULL = 1,
+	PHASE_COPY = 2,
+	PHASE_RED = 3,
+	PHASE_BLACK = 4,
+	PHASE_BREED = 5,
+	PHASE_SWEEP = 6,
+	PHASE_EXCHANGE = 7,
+	PHASE_CHECKPOINT = 8,
+	PHASE_TRAJECTORY = 9,
+	PHASE_DIGEST = 10,
+	PHASE_OUTPUT = 11,
+	NUM_PHASES = 12
+} phase_e;
+
+// Hardware events counted by --counters, per thread and per phase.
+// Num events must always be the last one
+typedef enum {
+	EVENT_CYCLES = 0,
+	EVENT_INSTRUCTIONS = 1,
+	EVENT_CACHE_REFERENCES = 2,
+	EVENT_CACHE_MISSES = 3,
+	EVENT_BRANCH_MISSES = 4,
+	NUM_EVENTS = 5
+} event_e;
+
+// A hardware event, as perf_event_open takes it
+typedef struct {
+	const char *name;
+	uint32_t type;
+	uint64_t config;
+} event_t;
+
+// A thread's group of counters: the file descriptor of each event (-1
+// when it couldn't be opened), the one leading the group, where each
+// event's value is in what reading the group returns, the last read
+// and the error of the first event that couldn't be opened
+typedef struct {
+	int fds[NUM_EVENTS];
+	int leader;
+	int slots[NUM_EVENTS];
+	int size;
+	uint64_t last[NUM_EVENTS + 3];
+	int error;
+} event_group_t;
+
+// A region of the world advanced on its own by the tiled engine
+typedef struct {
+	world_pos_t cells;
+	unsigned char *moves;
+	int row0;
+	int col0;
+	int rows;
+	int cols;
+	int own_row;
+	int own_col;
+	int own_rows;
+	int own_cols;
+} tile_t;
+
+typedef void (*move_masks_f)(const unsigned char *, const unsigned char *, const unsigned char *, const unsigned char *, int,
+		unsigned char *);
+
+// The cells of one colour of a row for the move masks kernels, next to
+// each other: their types, the types of the cells above and below them,
+// of the cells between them (from the one left of the first to the one
+// right of the last) and their move masks
+typedef struct {
+	unsigned char *up;
+	unsigned char *cur;
+	unsigned char *sides;
+	unsigned char *down;
+	unsigned char *masks;
+} row_lanes_t;
+
+// Compact storage keeps one byte per cell with the type, the has_moved
+// flag and the type the cell had when the sub-generation started
+#define CELL_TYPE(c) ((c) & 0x07)
+#define CELL_MOVED 0x08
+#define CELL_OLD_TYPE(c) (((c) >> 4) & 0x07)
+#define NO_COUNTERS (~0UL)
+
 int numberOfPosition(int row, int col);
 unsigned char atot(char c);
 char ttoa(unsigned char type);
-void init(FILE *file, char **argv);
+const char *mapFile(const char *name, size_t *size);
+const char *skipSpaces(const char *p, const char *end);
+const char *parseInt(const char *p, const char *end, int *value);
+const char *parseCell(const char *p, const char *end, int *row, int *col, char *type);
+size_t readMapHeader(const char *map, size_t size, int *binary);
+void setCell(int row, int col, unsigned char type);
+void loadBinaryMap(const char *map, size_t size);
+void loadTextLines(const char *map, size_t size, size_t first, size_t last);
+void loadMap(const char *map, size_t size, size_t start, int binary);
+void init(const char *map, size_t size, char **argv);
+void allocWorld();
+void initWorlds();
+void getCellState(int row, int col, world_pos_t pos);
+void setCellState(int row, int col, world_pos_t pos);
+int restart(const char *name, char **argv);
+void writeAll(int fd, const char *data, size_t size, off_t offset);
+void writeSnapshot(const char *name, snapshot_t *snapshot);
+void *writeCheckpoints(void *arg);
+void startCheckpoints();
+void checkpoint(int generation);
+void finishCheckpoints();
+char *formatVarint(char *text, unsigned long value);
+unsigned char cellType(int row, int col);
+size_t encodeRows(char **buffer, size_t *capacity, int first, int last, int keyframe);
+void writeTrajectory(const void *data, size_t size);
+void openTrajectory();
+void writeFrame(int generation);
+void closeTrajectory();
+int openEvent(const event_t *event, int group);
+void openEventGroup(event_group_t *group);
+void startEvents();
+void readEvents(int thread, phase_e phase);
+void closeEvents();
+void writeEventValue(FILE *file, const char *name, const char *format, double value, int known);
+void writeEventCounts(FILE *file, const double *counts, double seconds, double updates);
+void writeEvents(FILE *file, double updates);
+void lap(phase_e phase);
+void writeTimings(double took, int generations);
+unsigned long mix64(unsigned long key);
+unsigned long cellDigest(int row, int col, world_pos_t pos);
+void printDigest(int generation);
+char *formatInt(char *text, int value);
+char *formatRow(char *text, int row);
+void writeBlocks(struct iovec *blocks, int count);
 void printWorld();
 int isRedGen(int row, int col);
 int isBlackGen(int row, int col);
@@ -56,6 +260,65 @@ int isBreeding(world_pos_t pos);
 int isStarving(world_pos_t pos);
 void breed(world_pos_t pos);
 void clean(world_pos_t pos);
+engine_e atoe(const char *name);
+const char *etoa(engine_e engine);
+void parseOptions(int argc, char **argv);
+unsigned char *planeRow(int row);
+unsigned char cellMoveMask(unsigned char cur, const unsigned char *neighbours);
+move_e chooseMove(int row, int col, unsigned char cur, const unsigned char *neighbours);
+move_e maskedMove(int row, int col, unsigned char moveMask);
+move_e getMoveFused(int row, int col);
+void moveMasksScalar(const unsigned char *up, const unsigned char *cur, const unsigned char *sides, const unsigned char *down, int n,
+		unsigned char *masks);
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse4.2")))
+void moveMasksSSE(const unsigned char *up, const unsigned char *cur, const unsigned char *sides, const unsigned char *down, int n,
+		unsigned char *masks);
+__attribute__((target("avx2")))
+void moveMasksAVX2(const unsigned char *up, const unsigned char *cur, const unsigned char *sides, const unsigned char *down, int n,
+		unsigned char *masks);
+__attribute__((target("avx512f,avx512bw")))
+void moveMasksAVX512(const unsigned char *up, const unsigned char *cur, const unsigned char *sides, const unsigned char *down, int n,
+		unsigned char *masks);
+#endif
+move_masks_f atok(const char *name);
+void gatherLane(unsigned char *lane, const unsigned char *row, int n);
+void allocLanes(row_lanes_t *lanes);
+void fusedCullRow(int row);
+move_e fusedApplyMove(int row, int col, move_e move);
+move_e fusedUpdatePos(int row, int col);
+void fusedUpdateRow(int row, int start);
+int fusedBreedRow(int row);
+void playGenFused();
+int isAnimal(unsigned char type);
+void sparseReserve(long size);
+void collectAnimals();
+void sparseCull();
+void sparseSweep(int parity);
+void sparseBreed();
+void playGenSparse();
+unsigned char *compactRow(int row);
+unsigned long counterSlot(unsigned long position);
+void growCounters();
+void compactLoad(int row, int col, world_pos_t pos);
+void compactStore(int row, int col, world_pos_t pos);
+void compactCullRow(int row);
+void compactUpdatePos(int row, int col);
+void compactUpdateRow(int row, int start);
+void compactBreedRow(int row);
+void playGenCompact();
+void tileAlloc(tile_t *tile, int size);
+void tileLoad(tile_t *tile, int row0, int col0, int rows, int cols);
+move_e tileGetMove(tile_t *tile, int row, int col, int top, int bottom, int left, int right);
+void tileArrive(tile_t *tile, world_pos_t to, size_t from, move_e move);
+int tileFirstCol(int left, int start);
+void tileMoves(tile_t *tile, int row, int start, int top, int bottom, int left, int right);
+void tileArriveRow(tile_t *tile, int row, int start, int top, int bottom, int left, int right);
+void tileLeaveRow(tile_t *tile, int row, int start, int left, int right);
+void tileSubGen(tile_t *tile, int parity, int top, int bottom, int left, int right);
+long tileGen(tile_t *tile, int top, int bottom, int left, int right);
+long advanceTile(tile_t *tile, int row, int col, int generations);
+void playGensTiled(int generations);
 
 const int NUM_ARGUMENTS = 6;
 int WORLD_SIZE;
@@ -65,6 +328,127 @@ int WOLF_STARVING_LEVEL;
 int NUM_GENERATIONS;
 world_t old_world;
 world_t new_world;
+engine_e ENGINE = ENGINE_DENSE;
+
+// A snapshot of the run is saved to checkpoint_file every
+// CHECKPOINT_EVERY generations (only at the end when 0), and the run
+// starts from the snapshot in restart_file instead of the map when given
+char *checkpoint_file = NULL;
+int CHECKPOINT_EVERY = 0;
+char *restart_file = NULL;
+
+// Snapshots are copied to one of CHECKPOINT_BUFFERS buffers and written
+// by checkpoint_writer while the run goes on, from checkpoint_head on,
+// checkpoint_queued of them at a time. The run waits for a buffer when
+// they are all queued.
+int CHECKPOINT_BUFFERS = 2;
+snapshot_t *checkpoint_buffers = NULL;
+int checkpoint_head = 0;
+int checkpoint_queued = 0;
+int checkpoints_done = FALSE;
+pthread_t checkpoint_writer;
+pthread_mutex_t checkpoint_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t checkpoint_ready = PTHREAD_COND_INITIALIZER;
+pthread_cond_t checkpoint_written = PTHREAD_COND_INITIALIZER;
+
+// Every generation's changes are appended to trajectory_file, and the
+// whole world every KEYFRAME_EVERY generations. trajectory_types holds
+// the types of the world in the last frame
+char *trajectory_file = NULL;
+int KEYFRAME_EVERY = 64;
+FILE *trajectory = NULL;
+unsigned char *trajectory_types = NULL;
+int trajectory_frames = 0;
+char *frame_buffer = NULL;
+size_t frame_capacity = 0;
+
+// The digest of the world is printed on stderr after every generation
+int print_digests = FALSE;
+
+// The time of every phase is added up in phase_times, from phase_clock
+// to the end of the phase, and written to timings_file as JSON with
+// the cells updated and the moves of animals per second. A move is a
+// cell an animal moved into.
+char *timings_file = NULL;
+const char *PHASE_NAMES[NUM_PHASES] = {
+	"parse", "cull", "copy", "red", "black", "breed", "sweep",
+	"exchange", "checkpoint", "trajectory", "digest", "output"
+};
+double phase_times[NUM_PHASES];
+double phase_clock = 0;
+long animal_moves = 0;
+
+// With count_events (--counters), every thread opens a group of
+// counters for the EVENTS, and each lap adds what they counted since
+// the last one to the phase, in event_counts by thread, phase and
+// event. events_error tells why there are no counters at all.
+// move_calls counts the moves chosen, to weigh branch misses against.
+int count_events = FALSE;
+const event_t EVENTS[NUM_EVENTS] = {
+	{"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+	{"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+	{"cache_references", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES},
+	{"cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+	{"branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES}
+};
+event_group_t *event_groups = NULL;
+int num_event_groups = 0;
+double *event_counts = NULL;
+int events_open[NUM_EVENTS];
+const char *events_error = NULL;
+long move_calls = 0;
+
+// Types seen by the fused engine's sweeps, with a border of ICE
+// around the world so neighbours never need bounds checks
+unsigned char *type_plane = NULL;
+
+// Kernel filling the move masks of the cells of a row for the fused
+// sweeps, with row_lanes
+move_masks_f moveMasks = NULL;
+row_lanes_t row_lanes;
+
+// Number of options and the options, in move order, of each mask
+// of directions. See maskedMove.
+const unsigned char MASK_OPTIONS[16] = {1, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4};
+const unsigned char MASK_MOVES[16][4] = {
+	{NONE, NONE, NONE, NONE}, {TOP, NONE, NONE, NONE},
+	{RIGHT, NONE, NONE, NONE}, {TOP, RIGHT, NONE, NONE},
+	{BOTTOM, NONE, NONE, NONE}, {TOP, BOTTOM, NONE, NONE},
+	{RIGHT, BOTTOM, NONE, NONE}, {TOP, RIGHT, BOTTOM, NONE},
+	{LEFT, NONE, NONE, NONE}, {TOP, LEFT, NONE, NONE},
+	{RIGHT, LEFT, NONE, NONE}, {TOP, RIGHT, LEFT, NONE},
+	{BOTTOM, LEFT, NONE, NONE}, {TOP, BOTTOM, LEFT, NONE},
+	{RIGHT, BOTTOM, LEFT, NONE}, {TOP, RIGHT, BOTTOM, LEFT}
+};
+
+// Animals counted by the last fused generation
+long animal_count = 0;
+
+// The sparse engine walks a row-major sorted list of the positions
+// holding animals (-1 animals when there's no list) and falls back to
+// the fused sweep while more than SPARSE_THRESHOLD of the world is animals
+double SPARSE_THRESHOLD = 0.1;
+long *animals = NULL;
+long num_animals = -1;
+long animals_capacity = 0;
+long *next_animals = NULL;
+long *moved_top = NULL;
+long *moved_bottom = NULL;
+
+// The compact engine's cells, with the same border of ICE as the
+// type plane, and an open addressing table holding the non-zero
+// breeding and starvation periods. Entries pack the position in the
+// low 48 bits, the breeding period and then the starvation period.
+unsigned char *compact_world = NULL;
+unsigned long *counters = NULL;
+unsigned long counters_capacity = 0;
+unsigned long counters_size = 0;
+
+// The tiled engine advances TILE_SIZE x TILE_SIZE tiles by up to
+// TILE_GENERATIONS generations at a time
+int TILE_SIZE = 256;
+int TILE_GENERATIONS = 4;
+tile_t *tiles = NULL;
 
 int numberOfPosition(int row, int col) {
 	return row*WORLD_SIZE + col;
@@ -97,433 +481,2400 @@ char ttoa(unsigned char type) {
 	exit(EXIT_FAILURE);
 }
 
-void init(FILE *file, char **argv) {
-	// read WORLD_SIZE
-	if (fscanf(file, "%d", &WORLD_SIZE) == 0) {
+// Maps a whole file in memory, read only
+const char *mapFile(const char *name, size_t *size) {
+	int fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "File %s not found...\n", name);
 		exit(EXIT_FAILURE);
 	}
 
-	world_pos_t newWorld = malloc(sizeof(world_pos) * WORLD_SIZE * WORLD_SIZE);
-	world_pos_t oldWorld = malloc(sizeof(world_pos) * WORLD_SIZE * WORLD_SIZE);
-	new_world = malloc(sizeof(world_pos_t) * WORLD_SIZE);
-	old_world = malloc(sizeof(world_pos_t) * WORLD_SIZE);
+	struct stat info;
+	if ((fstat(fd, &info) != 0) || (info.st_size == 0)) {
+		fprintf(stderr, "Can't read the world's size\n");
+		exit(EXIT_FAILURE);
+	}
+	*size = info.st_size;
 
-	int i;
-	for (i = 0; i < WORLD_SIZE; i++) {
-		new_world[i] = newWorld + i*WORLD_SIZE;
-		old_world[i] = oldWorld + i*WORLD_SIZE;
+	const char *map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Can't map %s in memory\n", name);
+		exit(EXIT_FAILURE);
 	}
+	madvise((void *) map, *size, MADV_SEQUENTIAL);
+	return map;
+}
 
-	// initialize both worlds with zeros
-	memset(oldWorld, 0, sizeof(world_pos) * WORLD_SIZE * WORLD_SIZE);
-	memset(newWorld, 0, sizeof(world_pos) * WORLD_SIZE * WORLD_SIZE);
+const char *skipSpaces(const char *p, const char *end) {
+	while ((p < end) && ((*p == ' ') || (*p == '\n') || (*p == '\t') || (*p == '\r'))) {
+		p++;
+	}
+	return p;
+}
 
-	// initialize both worlds with the map
-	int row;
-	int col;
-	char type;
-	while (fscanf(file, "%d %d %c", &row, &col, &type) == 3) {
-		old_world[row][col].type = atot(type);
-		new_world[row][col].type = atot(type);
+// Parses an integer after any white space, saturating at the limits of
+// an int, or returns NULL when there's none
+const char *parseInt(const char *p, const char *end, int *value) {
+	p = skipSpaces(p, end);
+	int negative = (p < end) && (*p == '-');
+	p += negative;
+	if ((p == end) || (*p < '0') || (*p > '9')) {
+		return NULL;
 	}
 
-	WOLF_BREEDING_LEVEL = atoi(argv[2]);
-	SQUIRREL_BREEDING_LEVEL = atoi(argv[3]);
-	WOLF_STARVING_LEVEL = atoi(argv[4]);
-	NUM_GENERATIONS = atoi(argv[5]);
+	long long number = 0;
+	while ((p < end) && (*p >= '0') && (*p <= '9')) {
+		number = number*10 + (*p - '0');
+		if (number > INT_MAX) {
+			number = (long long) INT_MAX + 1;
+		}
+		p++;
+	}
+
+	if (negative) {
+		*value = -number;
+	} else {
+		*value = (number > INT_MAX) ? INT_MAX : number;
+	}
+	return p;
 }
 
-void printWorld() {
-	int i, j;
-	for (i = 0; i < WORLD_SIZE; i++) {
-		for (j = 0; j < WORLD_SIZE; j++) {
-			if (new_world[i][j].type != EMPTY){
-				fprintf(stdout, "%d %d %c\n", i,j, ttoa(new_world[i][j].type));
-			}
+// Parses a "row col type" line, or returns NULL when it can't
+const char *parseCell(const char *p, const char *end, int *row, int *col, char *type) {
+	p = parseInt(p, end, row);
+	if (p != NULL) {
+		p = parseInt(p, end, col);
+	}
+	if (p != NULL) {
+		p = skipSpaces(p, end);
+		if (p == end) {
+			return NULL;
 		}
+		*type = *p++;
 	}
+	return p;
 }
 
-int isRedGen(int row, int col) {
-	return (row % 2) == (col % 2);
-}
+// Reads WORLD_SIZE, returning where the cells start
+size_t readMapHeader(const char *map, size_t size, int *binary) {
+	*binary = (size >= BINARY_HEADER_SIZE) && (memcmp(map, BINARY_MAGIC, BINARY_MAGIC_SIZE) == 0);
+	if (*binary) {
+		int32_t worldSize;
+		memcpy(&worldSize, map + BINARY_MAGIC_SIZE, sizeof(int32_t));
+		WORLD_SIZE = worldSize;
+		if (WORLD_SIZE < 1) {
+			fprintf(stderr, "Can't read the world's size\n");
+			exit(EXIT_FAILURE);
+		}
+		return BINARY_HEADER_SIZE;
+	}
 
-int isBlackGen(int row, int col) {
-	return !isRedGen(row, col);
+	const char *cells = parseInt(map, map + size, &WORLD_SIZE);
+	if ((cells == NULL) || (WORLD_SIZE < 1)) {
+		fprintf(stderr, "Can't read the world's size\n");
+		exit(EXIT_FAILURE);
+	}
+	return cells - map;
 }
 
+void loadBinaryMap(const char *map, size_t size) {
+	if (size < BINARY_HEADER_SIZE + (size_t) WORLD_SIZE * WORLD_SIZE) {
+		fprintf(stderr, "The map is shorter than a world of size %d\n", WORLD_SIZE);
+		exit(EXIT_FAILURE);
+	}
 
-void clean(world_pos_t pos) {
-	switch (pos->type) {
-		case TREE:
-		case SQUIRREL_ON_TREE:
-			pos->type = TREE;
-			break;
+	const unsigned char *types = (const unsigned char *) map + BINARY_HEADER_SIZE;
+	int row, col;
+	for (row = 0; row < WORLD_SIZE; row++) {
+		for (col = 0; col < WORLD_SIZE; col++) {
+			unsigned char type = types[(size_t) row*WORLD_SIZE + col];
+			if (type > SQUIRREL_ON_TREE) {
+				fprintf(stderr, "Unknown type: %d\n", type);
+				exit(EXIT_FAILURE);
+			}
+			setCell(row, col, type);
+		}
+	}
+}
 
-		case ICE:
-			pos->type = ICE;
-			break;
+// Loads the lines whose first character is between first and last (not
+// included). Positions outside of the world are ignored.
+void loadTextLines(const char *map, size_t size, size_t first, size_t last) {
+	const char *p = map + first;
+	const char *end = map + size;
+	int row, col;
+	char type;
+	while (TRUE) {
+		p = skipSpaces(p, end);
+		if (p >= map + last) {
+			return;
+		}
 
-		default:
-			pos->type = EMPTY;
+		const char *next = parseCell(p, end, &row, &col, &type);
+		if (next == NULL) {
+			fprintf(stderr, "Can't read the map at byte %ld\n", (long) (p - map));
+			exit(EXIT_FAILURE);
+		}
+		if ((row >= 0) && (row < WORLD_SIZE) && (col >= 0) && (col < WORLD_SIZE)) {
+			setCell(row, col, atot(type));
+		}
+		p = next;
 	}
+}
 
-	pos->breeding_period = 0;
-	pos->starvation_period = 0;
-	pos->has_moved = 0;
+void loadMap(const char *map, size_t size, size_t start, int binary) {
+	if (binary) {
+		loadBinaryMap(map, size);
+	} else {
+		loadTextLines(map, size, start, size);
+	}
 }
 
-void cleanWorld() {
-	int i, j;
-	for (i = 0; i < WORLD_SIZE; i++) {
-		for (j = 0; j < WORLD_SIZE; j++) {
-			clean(&new_world[i][j]);
-		}
+void setCell(int row, int col, unsigned char type) {
+	if (ENGINE == ENGINE_COMPACT) {
+		compactRow(row)[col] = type;
+	} else {
+		old_world[row][col].type = type;
+		new_world[row][col].type = type;
 	}
 }
 
-int canMoveTo(world_pos_t from, world_pos_t to) {
-	// Can't move to ice
-	if (to->type == ICE) {
-		return FALSE;
+void allocWorld() {
+	int row;
+	if (ENGINE == ENGINE_COMPACT) {
+		size_t worldSize = (size_t) (WORLD_SIZE + 2) * (WORLD_SIZE + 2);
+		compact_world = malloc(worldSize);
+		memset(compact_world, ICE | (ICE << 4), worldSize);
+		for (row = 0; row < WORLD_SIZE; row++) {
+			memset(compactRow(row), EMPTY, WORLD_SIZE);
+		}
+
+		counters_capacity = 1024;
+		counters = malloc(sizeof(unsigned long) * counters_capacity);
+		memset(counters, 0xff, sizeof(unsigned long) * counters_capacity);
+	} else {
+		initWorlds();
 	}
+}
 
-	switch (from->type) {
-		case SQUIRREL:
-		case SQUIRREL_ON_TREE:
-			return (to->type == EMPTY) || (to->type == TREE);
+void init(const char *map, size_t size, char **argv) {
+	int binary;
+	size_t start = readMapHeader(map, size, &binary);
 
-		case WOLF:
-			return (to->type == EMPTY) || (to->type == SQUIRREL);
+	allocWorld();
 
-		default:
-			fprintf(stderr, "Can't move this type: %d\n", from->type);
-			exit(EXIT_FAILURE);
-	}
+	// initialize the world with the map
+	loadMap(map, size, start, binary);
 
-	return FALSE;
+	WOLF_BREEDING_LEVEL = atoi(argv[2]);
+	SQUIRREL_BREEDING_LEVEL = atoi(argv[3]);
+	WOLF_STARVING_LEVEL = atoi(argv[4]);
+	NUM_GENERATIONS = atoi(argv[5]);
 }
 
-int isWolfToSquirrel(world_pos_t from, world_pos_t to) {
-	return (from->type == WOLF) && (to->type == SQUIRREL);
-}
+void initWorlds() {
+	// The fused engine keeps its old world as a plane of types
+	// instead of a second copy of the cells
+	world_pos_t newWorld = malloc(sizeof(world_pos) * WORLD_SIZE * WORLD_SIZE);
+	world_pos_t oldWorld = newWorld;
+	if ((ENGINE == ENGINE_DENSE) || (ENGINE == ENGINE_TILED)) {
+		oldWorld = malloc(sizeof(world_pos) * WORLD_SIZE * WORLD_SIZE);
+	} else {
+		size_t planeSize = (size_t) (WORLD_SIZE + 2) * (WORLD_SIZE + 2);
+		type_plane = malloc(planeSize);
+		memset(type_plane, ICE, planeSize);
+		allocLanes(&row_lanes);
+	}
+	new_world = malloc(sizeof(world_pos_t) * WORLD_SIZE);
+	old_world = malloc(sizeof(world_pos_t) * WORLD_SIZE);
 
-move_e getMove(int row, int col) {
-	const int NUM_OPTION = 4;
-	int available[NUM_OPTION];
-	memset( available, 0, NUM_OPTION*sizeof(int) );
-	int nAvailable = 0;
-    int nSquirrels = 0;
+	int i;
+	for (i = 0; i < WORLD_SIZE; i++) {
+		new_world[i] = newWorld + i*WORLD_SIZE;
+		old_world[i] = oldWorld + i*WORLD_SIZE;
+	}
 
-    world_pos_t cur = &old_world[row][col];
+	// initialize both worlds with zeros
+	memset(oldWorld, 0, sizeof(world_pos) * WORLD_SIZE * WORLD_SIZE);
+	memset(newWorld, 0, sizeof(world_pos) * WORLD_SIZE * WORLD_SIZE);
 
-    // TOP
-    if ((row-1 >= 0) && canMoveTo(cur, &old_world[row-1][col])) {
-    	if (isWolfToSquirrel(cur, &old_world[row-1][col])) {
-			available[TOP] = 2;
-            nSquirrels++;
-		} else {
-            available[TOP] = 1;
-            nAvailable++;
-        }
-    }
-    
-    // RIGHT
-    if ((col+1 < WORLD_SIZE) && canMoveTo(cur, &old_world[row][col+1])) {
-    	if (isWolfToSquirrel(cur, &old_world[row][col+1])) {
-			available[RIGHT] = 2;
-            nSquirrels++;
-		} else {
-            available[RIGHT] = 1;
-            nAvailable++;
-        }
-    }
+}
 
-    // BOTTOM
-    if ((row+1 < WORLD_SIZE) && canMoveTo(cur, &old_world[row+1][col])) {
-    	if (isWolfToSquirrel(cur, &old_world[row+1][col])) {
-			available[BOTTOM] = 2;
-            nSquirrels++;
-		} else {
-            available[BOTTOM] = 1;
-            nAvailable++;
-        }
-    } 
+void getCellState(int row, int col, world_pos_t pos) {
+	if (ENGINE == ENGINE_COMPACT) {
+		compactLoad(row, col, pos);
+	} else {
+		*pos = new_world[row][col];
+	}
+}
 
-    // LEFT
-    if ((col-1 >= 0) && canMoveTo(cur, &old_world[row][col-1])) {
-    	if (isWolfToSquirrel(cur, &old_world[row][col-1])) {
-			available[LEFT] = 2;
-            nSquirrels++;
-		} else {
-            available[LEFT] = 1;
-            nAvailable++;
-        }
-    }
-    
-    if (nAvailable == 0 && nSquirrels == 0)
-        return NONE;
-    
-    int n = 1;
-    if(nSquirrels != 0){
-        nAvailable = nSquirrels;
-        n = 2;
-    }
-    
-    int selected = numberOfPosition(row, col) % nAvailable;
-    int i;
-	for (i = 0; i < NUM_OPTION; i++) {
-		if (available[i] == n) {
-			if (selected == 0){
-				return i;
+void setCellState(int row, int col, world_pos_t pos) {
+	if (ENGINE == ENGINE_COMPACT) {
+		compactStore(row, col, pos);
+	} else {
+		old_world[row][col] = *pos;
+		new_world[row][col] = *pos;
+	}
+}
+
+// Starts from a snapshot, with its rules, returning the generations it
+// was saved after
+int restart(const char *name, char **argv) {
+	size_t size;
+	const char *snapshot = mapFile(name, &size);
+	snapshot_header_t header;
+	memset(&header, 0, sizeof(header));
+	memcpy(&header, snapshot, min(size, sizeof(header)));
+	if ((size < sizeof(header)) || (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0)
+			|| (header.version != SNAPSHOT_VERSION) || (header.cell_size != sizeof(world_pos))
+			|| (header.world_size < 1)
+			|| (size != sizeof(header) + (size_t) header.world_size * header.world_size * sizeof(world_pos))) {
+		fprintf(stderr, "%s isn't a snapshot of version %d\n", name, SNAPSHOT_VERSION);
+		exit(EXIT_FAILURE);
+	}
+
+	WORLD_SIZE = header.world_size;
+	WOLF_BREEDING_LEVEL = header.wolf_breeding;
+	SQUIRREL_BREEDING_LEVEL = header.squirrel_breeding;
+	WOLF_STARVING_LEVEL = header.wolf_starving;
+	NUM_GENERATIONS = atoi(argv[5]);
+	allocWorld();
+
+	const world_pos *cells = (const world_pos *) (snapshot + sizeof(header));
+	int row, col;
+	for (row = 0; row < WORLD_SIZE; row++) {
+		for (col = 0; col < WORLD_SIZE; col++) {
+			world_pos pos = cells[(size_t) row*WORLD_SIZE + col];
+			if (pos.type > SQUIRREL_ON_TREE) {
+				fprintf(stderr, "Unknown type: %d\n", pos.type);
+				exit(EXIT_FAILURE);
 			}
-			selected--;
+			setCellState(row, col, &pos);
 		}
 	}
 
-	return NONE;
+	munmap((void *) snapshot, size);
+	return header.generation;
 }
 
-world_pos_t getDestination(int row, int col, move_e move) {
-	switch (move) {
-		case TOP:
-			return &new_world[row-1][col];
+void writeAll(int fd, const char *data, size_t size, off_t offset) {
+	while (size > 0) {
+		ssize_t written = pwrite(fd, data, size, offset);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "Can't write the snapshot %s\n", checkpoint_file);
+			exit(EXIT_FAILURE);
+		}
+		data += written;
+		size -= written;
+		offset += written;
+	}
+}
 
-		case RIGHT:
-			return &new_world[row][col+1];
+// Saves a snapshot through a temporary file, so a crash never leaves a
+// half written one behind
+void writeSnapshot(const char *name, snapshot_t *snapshot) {
+	char *temp = malloc(strlen(name) + 5);
+	sprintf(temp, "%s.tmp", name);
 
-		case BOTTOM:
-			return &new_world[row+1][col];
+	int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Can't write the snapshot %s\n", temp);
+		exit(EXIT_FAILURE);
+	}
 
-		case LEFT:
-			return &new_world[row][col-1];
+	snapshot_header_t header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.version = SNAPSHOT_VERSION;
+	header.cell_size = sizeof(world_pos);
+	header.world_size = WORLD_SIZE;
+	header.wolf_breeding = WOLF_BREEDING_LEVEL;
+	header.squirrel_breeding = SQUIRREL_BREEDING_LEVEL;
+	header.wolf_starving = WOLF_STARVING_LEVEL;
+	header.generation = snapshot->generation;
+	writeAll(fd, (const char *) &header, sizeof(header), 0);
+	writeAll(fd, (const char *) snapshot->cells, (size_t) WORLD_SIZE * WORLD_SIZE * sizeof(world_pos), sizeof(header));
+
+	if ((close(fd) != 0) || (rename(temp, name) != 0)) {
+		fprintf(stderr, "Can't write the snapshot %s\n", name);
+		exit(EXIT_FAILURE);
+	}
+	free(temp);
+}
 
-		case NONE:
-			return &new_world[row][col];
+// Writes the queued snapshots in order until the run is done
+void *writeCheckpoints(void *arg) {
+	pthread_mutex_lock(&checkpoint_lock);
+	while (TRUE) {
+		while ((checkpoint_queued == 0) && !checkpoints_done) {
+			pthread_cond_wait(&checkpoint_ready, &checkpoint_lock);
+		}
+		if (checkpoint_queued == 0) {
+			break;
+		}
 
-		default:
-			fprintf(stderr, "Unknown move: %d\n", move);
-			exit(EXIT_FAILURE);
+		snapshot_t *snapshot = &checkpoint_buffers[checkpoint_head];
+		pthread_mutex_unlock(&checkpoint_lock);
+		writeSnapshot(checkpoint_file, snapshot);
+		pthread_mutex_lock(&checkpoint_lock);
 
-			// doesn't do anything
-			return &new_world[row][col];
+		checkpoint_head = (checkpoint_head + 1) % CHECKPOINT_BUFFERS;
+		checkpoint_queued--;
+		pthread_cond_signal(&checkpoint_written);
 	}
+	pthread_mutex_unlock(&checkpoint_lock);
+	return NULL;
 }
 
-void chooseBestSquirrel(world_pos_t from, world_pos_t to) {
-	to->breeding_period = max(from->breeding_period, to->breeding_period);
-}
+void startCheckpoints() {
+	checkpoint_buffers = malloc(sizeof(snapshot_t) * CHECKPOINT_BUFFERS);
+	int i;
+	for (i = 0; i < CHECKPOINT_BUFFERS; i++) {
+		checkpoint_buffers[i].cells = malloc(sizeof(world_pos) * WORLD_SIZE * WORLD_SIZE);
+	}
 
-void chooseBestWolf(world_pos_t from, world_pos_t to) {
-	if (from->starvation_period == to->starvation_period) {
-		to->breeding_period = max(from->breeding_period, to->breeding_period);
-	} else if (from->starvation_period < to->starvation_period) {
-		to->breeding_period = from->breeding_period;
-		to->starvation_period = from->starvation_period;
+	if (pthread_create(&checkpoint_writer, NULL, writeCheckpoints, NULL) != 0) {
+		fprintf(stderr, "Can't start the snapshot writer\n");
+		exit(EXIT_FAILURE);
 	}
 }
 
-
+// Copies the world to a free buffer, waiting for one while the writer
+// is behind, and queues it to be written
+void checkpoint(int generation) {
+	pthread_mutex_lock(&checkpoint_lock);
+	while (checkpoint_queued == CHECKPOINT_BUFFERS) {
+		pthread_cond_wait(&checkpoint_written, &checkpoint_lock);
+	}
+	int slot = (checkpoint_head + checkpoint_queued) % CHECKPOINT_BUFFERS;
+	pthread_mutex_unlock(&checkpoint_lock);
+
+	world_pos_t cells = checkpoint_buffers[slot].cells;
+	int row, col;
+	if (ENGINE == ENGINE_COMPACT) {
+		for (row = 0; row < WORLD_SIZE; row++) {
+			for (col = 0; col < WORLD_SIZE; col++) {
+				getCellState(row, col, &cells[(size_t) row*WORLD_SIZE + col]);
+			}
+		}
+	} else {
+		for (row = 0; row < WORLD_SIZE; row++) {
+			memcpy(cells + (size_t) row*WORLD_SIZE, new_world[row], sizeof(world_pos) * WORLD_SIZE);
+		}
+	}
+	checkpoint_buffers[slot].generation = generation;
+
+	pthread_mutex_lock(&checkpoint_lock);
+	checkpoint_queued++;
+	pthread_cond_signal(&checkpoint_ready);
+	pthread_mutex_unlock(&checkpoint_lock);
+}
+
+// Waits for the queued snapshots to be written
+void finishCheckpoints() {
+	pthread_mutex_lock(&checkpoint_lock);
+	checkpoints_done = TRUE;
+	pthread_cond_signal(&checkpoint_ready);
+	pthread_mutex_unlock(&checkpoint_lock);
+	pthread_join(checkpoint_writer, NULL);
+
+	int i;
+	for (i = 0; i < CHECKPOINT_BUFFERS; i++) {
+		free(checkpoint_buffers[i].cells);
+	}
+	free(checkpoint_buffers);
+}
+
+// Writes value as a varint, 7 bits per byte from the lowest ones, with
+// the top bit set on every byte but the last, returning where it ends
+char *formatVarint(char *text, unsigned long value) {
+	while (value >= 0x80) {
+		*text++ = (char) (value | 0x80);
+		value >>= 7;
+	}
+	*text++ = (char) value;
+	return text;
+}
+
+unsigned char cellType(int row, int col) {
+	return (ENGINE == ENGINE_COMPACT) ? CELL_TYPE(compactRow(row)[col]) : new_world[row][col].type;
+}
+
+// Encodes the rows from first to last of a frame at the end of buffer,
+// growing it as needed, and returns their length. A keyframe holds
+// every row as runs of a type, each a varint of the run's length minus
+// one shifted left by 3 bits plus the type. Other frames only hold the
+// rows that changed since the last frame: the row, the number of
+// changes and, for each one, a varint of the columns skipped since the
+// previous change shifted left by 3 bits plus the new type.
+size_t encodeRows(char **buffer, size_t *capacity, int first, int last, int keyframe) {
+	size_t length = 0;
+	int row, col;
+	for (row = first; row < last; row++) {
+		size_t needed = length + (size_t) (WORLD_SIZE + 2) * MAX_VARINT;
+		if (needed > *capacity) {
+			*capacity = max(needed, *capacity * 2);
+			*buffer = realloc(*buffer, *capacity);
+		}
+		unsigned char *types = trajectory_types + (size_t) row*WORLD_SIZE;
+		char *text = *buffer + length;
+
+		if (keyframe) {
+			col = 0;
+			while (col < WORLD_SIZE) {
+				unsigned char type = cellType(row, col);
+				int end = col + 1;
+				while ((end < WORLD_SIZE) && (cellType(row, end) == type)) {
+					end++;
+				}
+				memset(types + col, type, end - col);
+				text = formatVarint(text, ((unsigned long) (end - col - 1) << 3) | type);
+				col = end;
+			}
+		} else {
+			int changes = 0;
+			for (col = 0; col < WORLD_SIZE; col++) {
+				changes += (cellType(row, col) != types[col]);
+			}
+			if (changes == 0) {
+				continue;
+			}
+
+			text = formatVarint(text, row);
+			text = formatVarint(text, changes);
+			int previous = -1;
+			for (col = 0; col < WORLD_SIZE; col++) {
+				unsigned char type = cellType(row, col);
+				if (type != types[col]) {
+					text = formatVarint(text, ((unsigned long) (col - previous - 1) << 3) | type);
+					types[col] = type;
+					previous = col;
+				}
+			}
+		}
+		length = text - *buffer;
+	}
+	return length;
+}
+
+void writeTrajectory(const void *data, size_t size) {
+	if (fwrite(data, 1, size, trajectory) != size) {
+		fprintf(stderr, "Can't write the trajectory %s\n", trajectory_file);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void openTrajectory() {
+	trajectory = fopen(trajectory_file, "wb");
+	if (trajectory == NULL) {
+		fprintf(stderr, "Can't write the trajectory %s\n", trajectory_file);
+		exit(EXIT_FAILURE);
+	}
+
+	int32_t header[2] = {WORLD_SIZE, KEYFRAME_EVERY};
+	writeTrajectory(TRAJECTORY_MAGIC, BINARY_MAGIC_SIZE);
+	writeTrajectory(header, sizeof(header));
+	trajectory_types = malloc((size_t) WORLD_SIZE * WORLD_SIZE);
+}
+
+// Appends the frame of a generation to the trajectory: a varint of its
+// length, a byte telling a keyframe from a frame of changes, a varint
+// of the generation and its rows. The first frame is always a keyframe.
+void writeFrame(int generation) {
+	int keyframe = (trajectory_frames == 0) || (generation % KEYFRAME_EVERY == 0);
+	size_t length = encodeRows(&frame_buffer, &frame_capacity, 0, WORLD_SIZE, keyframe);
+
+	char header[2*MAX_VARINT + 1];
+	char tag[MAX_VARINT + 1];
+	tag[0] = keyframe ? KEYFRAME : DELTA_FRAME;
+	size_t tagLength = formatVarint(tag + 1, generation) - tag;
+	size_t headerLength = formatVarint(header, tagLength + length) - header;
+	memcpy(header + headerLength, tag, tagLength);
+
+	writeTrajectory(header, headerLength + tagLength);
+	writeTrajectory(frame_buffer, length);
+	trajectory_frames++;
+}
+
+void closeTrajectory() {
+	if (fclose(trajectory) != 0) {
+		fprintf(stderr, "Can't write the trajectory %s\n", trajectory_file);
+		exit(EXIT_FAILURE);
+	}
+	free(trajectory_types);
+	free(frame_buffer);
+}
+
+// Opens a counter of the calling thread, only in user space, in the
+// given group (a new one when -1)
+int openEvent(const event_t *event, int group) {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = event->type;
+	attr.config = event->config;
+	attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+// Opens the counters of the calling thread. The first event that opens
+// leads the group, and the events that can't be opened are left out.
+void openEventGroup(event_group_t *group) {
+	group->leader = -1;
+	group->size = 0;
+	group->error = 0;
+	int e;
+	for (e = 0; e < NUM_EVENTS; e++) {
+		group->fds[e] = openEvent(&EVENTS[e], group->leader);
+		group->slots[e] = -1;
+		if (group->fds[e] < 0) {
+			if (group->error == 0) {
+				group->error = errno;
+			}
+			continue;
+		}
+		if (group->leader < 0) {
+			group->leader = group->fds[e];
+		}
+		group->slots[e] = group->size++;
+	}
+}
+
+// Opens the counters, or carries on with the timers alone when none of
+// them can be opened
+void startEvents() {
+	num_event_groups = 1;
+	event_groups = calloc(num_event_groups, sizeof(event_group_t));
+	event_counts = calloc((size_t) num_event_groups * NUM_PHASES * NUM_EVENTS, sizeof(double));
+	openEventGroup(&event_groups[0]);
+
+	int e;
+	for (e = 0; e < NUM_EVENTS; e++) {
+		events_open[e] = (event_groups[0].slots[e] >= 0);
+	}
+
+	if (event_groups[0].leader < 0) {
+		events_error = strerror(event_groups[0].error);
+		fprintf(stderr, "Hardware counters unavailable (%s), only timing the phases\n", events_error);
+		count_events = FALSE;
+	}
+}
+
+// Adds what the thread's counters counted since the last read to the
+// phase, scaled up when the kernel only ran them part of the time
+void readEvents(int thread, phase_e phase) {
+	event_group_t *group = &event_groups[thread];
+	uint64_t values[NUM_EVENTS + 3];
+	if ((group->leader < 0) || (read(group->leader, values, sizeof(values)) <= 0)) {
+		return;
+	}
+
+	uint64_t enabled = values[1] - group->last[1];
+	uint64_t running = values[2] - group->last[2];
+	if (running > 0) {
+		double scale = (double) enabled / running;
+		double *counts = event_counts + ((size_t) thread*NUM_PHASES + phase)*NUM_EVENTS;
+		int e;
+		for (e = 0; e < NUM_EVENTS; e++) {
+			int slot = group->slots[e];
+			if (slot >= 0) {
+				counts[e] += (values[slot+3] - group->last[slot+3]) * scale;
+			}
+		}
+	}
+	memcpy(group->last, values, sizeof(values));
+}
+
+void closeEvents() {
+	int t, e;
+	for (t = 0; t < num_event_groups; t++) {
+		for (e = 0; e < NUM_EVENTS; e++) {
+			if (event_groups[t].fds[e] >= 0) {
+				close(event_groups[t].fds[e]);
+			}
+		}
+	}
+	free(event_groups);
+	free(event_counts);
+}
+
+// Writes a member of an object of counters, null when it isn't known
+void writeEventValue(FILE *file, const char *name, const char *format, double value, int known) {
+	fprintf(file, "\"%s\": ", name);
+	if (known) {
+		fprintf(file, format, value);
+	} else {
+		fprintf(file, "null");
+	}
+}
+
+// Writes the counts of a phase, which took the given time, as an
+// object on a line, followed by the instructions per cycle and the
+// memory traffic in bytes, per second and per cell update of the run
+void writeEventCounts(FILE *file, const double *counts, double seconds, double updates) {
+	int e;
+	fprintf(file, "{");
+	for (e = 0; e < NUM_EVENTS; e++) {
+		writeEventValue(file, EVENTS[e].name, "%.0f", counts[e], events_open[e]);
+		fprintf(file, ", ");
+	}
+
+	double bytes = counts[EVENT_CACHE_MISSES] * CACHE_LINE;
+	int known = events_open[EVENT_CACHE_MISSES];
+	writeEventValue(file, "ipc", "%f", counts[EVENT_INSTRUCTIONS] / counts[EVENT_CYCLES],
+			events_open[EVENT_CYCLES] && events_open[EVENT_INSTRUCTIONS] && (counts[EVENT_CYCLES] > 0));
+	fprintf(file, ", ");
+	writeEventValue(file, "bytes", "%.0f", bytes, known);
+	fprintf(file, ", ");
+	writeEventValue(file, "bytes_per_second", "%.0f", bytes / seconds, known && (seconds > 0));
+	fprintf(file, ", ");
+	writeEventValue(file, "bytes_per_cell_update", "%f", bytes / updates, known && (updates > 0));
+	fprintf(file, "}");
+}
+
+// Writes the counters member of the timings: the counts of every
+// phase over all threads, then of each thread on its own, the memory
+// traffic of the generations per cell update and the branch misses of
+// the sweeps per move chosen
+void writeEvents(FILE *file, double updates) {
+	fprintf(file, ",\n\t\"counters\": {\n");
+	if (!count_events) {
+		fprintf(file, "\t\t\"available\": false,\n");
+		fprintf(file, "\t\t\"error\": \"%s\"\n", events_error);
+		fprintf(file, "\t}");
+		return;
+	}
+
+	double totals[NUM_PHASES][NUM_EVENTS];
+	memset(totals, 0, sizeof(totals));
+	int t, p, e;
+	for (t = 0; t < num_event_groups; t++) {
+		for (p = 0; p < NUM_PHASES; p++) {
+			for (e = 0; e < NUM_EVENTS; e++) {
+				totals[p][e] += event_counts[((size_t) t*NUM_PHASES + p)*NUM_EVENTS + e];
+			}
+		}
+	}
+
+	fprintf(file, "\t\t\"available\": true,\n");
+	fprintf(file, "\t\t\"phases\": {\n");
+	for (p = 0; p < NUM_PHASES; p++) {
+		fprintf(file, "\t\t\t\"%s\": ", PHASE_NAMES[p]);
+		writeEventCounts(file, totals[p], phase_times[p], updates);
+		fprintf(file, "%s\n", (p+1 < NUM_PHASES) ? "," : "");
+	}
+	fprintf(file, "\t\t},\n");
+
+	// threads only list the phases they counted something in
+	fprintf(file, "\t\t\"threads\": [\n");
+	for (t = 0; t < num_event_groups; t++) {
+		fprintf(file, "\t\t\t{");
+		int listed = 0;
+		for (p = 0; p < NUM_PHASES; p++) {
+			const double *counts = event_counts + ((size_t) t*NUM_PHASES + p)*NUM_EVENTS;
+			double sum = 0;
+			for (e = 0; e < NUM_EVENTS; e++) {
+				sum += counts[e];
+			}
+			if (sum > 0) {
+				fprintf(file, "%s\"%s\": ", (listed++ > 0) ? ", " : "", PHASE_NAMES[p]);
+				writeEventCounts(file, counts, phase_times[p], updates);
+			}
+		}
+		fprintf(file, "}%s\n", (t+1 < num_event_groups) ? "," : "");
+	}
+	fprintf(file, "\t\t],\n");
+
+	double misses = 0;
+	double mispredicts = 0;
+	for (p = PHASE_CULL; p <= PHASE_EXCHANGE; p++) {
+		misses += totals[p][EVENT_CACHE_MISSES];
+	}
+	for (p = PHASE_RED; p <= PHASE_SWEEP; p++) {
+		if (p != PHASE_BREED) {
+			mispredicts += totals[p][EVENT_BRANCH_MISSES];
+		}
+	}
+	fprintf(file, "\t\t\"move_calls\": %ld,\n", move_calls);
+	fprintf(file, "\t\t");
+	writeEventValue(file, "bytes_per_cell_update", "%f", misses * CACHE_LINE / updates,
+			events_open[EVENT_CACHE_MISSES] && (updates > 0));
+	fprintf(file, ",\n\t\t");
+	writeEventValue(file, "mispredicts_per_move_call", "%f", mispredicts / move_calls,
+			events_open[EVENT_BRANCH_MISSES] && (move_calls > 0));
+	fprintf(file, "\n\t}");
+}
+
+// Adds the time since the last lap to the phase, and what the
+// counters counted when there are any
+void lap(phase_e phase) {
+	double now = omp_get_wtime();
+	phase_times[phase] += now - phase_clock;
+	phase_clock = now;
+
+	if (count_events) {
+		int t;
+		for (t = 0; t < num_event_groups; t++) {
+			readEvents(t, phase);
+		}
+	}
+}
+
+// Writes the time of every phase and the throughput of the generations
+// run, which took the given time, to timings_file
+void writeTimings(double took, int generations) {
+	FILE *file = fopen(timings_file, "w");
+	if (file == NULL) {
+		fprintf(stderr, "Can't create the timings %s\n", timings_file);
+		exit(EXIT_FAILURE);
+	}
+
+	double updates = (double) WORLD_SIZE * WORLD_SIZE * generations;
+	double seconds = (took > 0) ? took : 1;
+	fprintf(file, "{\n");
+	fprintf(file, "\t\"binary\": \"serial\",\n");
+	fprintf(file, "\t\"engine\": \"%s\",\n", etoa(ENGINE));
+	fprintf(file, "\t\"threads\": 1,\n");
+	fprintf(file, "\t\"processes\": 1,\n");
+	fprintf(file, "\t\"world_size\": %d,\n", WORLD_SIZE);
+	fprintf(file, "\t\"generations\": %d,\n", generations);
+	fprintf(file, "\t\"took\": %f,\n", took);
+	fprintf(file, "\t\"phases\": {\n");
+	int i;
+	for (i = 0; i < NUM_PHASES; i++) {
+		fprintf(file, "\t\t\"%s\": %f%s\n", PHASE_NAMES[i], phase_times[i], (i+1 < NUM_PHASES) ? "," : "");
+	}
+	fprintf(file, "\t},\n");
+	fprintf(file, "\t\"cell_updates\": %.0f,\n", updates);
+	fprintf(file, "\t\"cell_updates_per_second\": %.0f,\n", updates / seconds);
+	fprintf(file, "\t\"animal_moves\": %ld,\n", animal_moves);
+	fprintf(file, "\t\"animal_moves_per_second\": %.0f", animal_moves / seconds);
+	if (count_events || (events_error != NULL)) {
+		writeEvents(file, updates);
+	}
+	fprintf(file, "\n}\n");
+
+	if (fclose(file) != 0) {
+		fprintf(stderr, "Can't write the timings %s\n", timings_file);
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Mixes the bits of a key, as the last step of splitmix64
+unsigned long mix64(unsigned long key) {
+	key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9UL;
+	key = (key ^ (key >> 27)) * 0x94d049bb133111ebUL;
+	return key ^ (key >> 31);
+}
+
+// Digest of a cell, its position and type and the counters that matter
+// to it, which is 0 for empty cells. Digests are added up, so the cells
+// can be visited in any order.
+unsigned long cellDigest(int row, int col, world_pos_t pos) {
+	if (pos->type == EMPTY) {
+		return 0;
+	}
+
+	unsigned long key = (unsigned long) row * WORLD_SIZE + col;
+	key = (key << 8) | pos->type;
+	key = (key << 8) | (isAnimal(pos->type) ? pos->breeding_period : 0);
+	key = (key << 8) | ((pos->type == WOLF) ? pos->starvation_period : 0);
+	return mix64(key);
+}
+
+// Prints the digests of the world on a line: the generation, the digest
+// of the whole world and then the one of each region, row by row
+void printDigest(int generation) {
+	unsigned long total = 0;
+	unsigned long regions[DIGEST_REGIONS * DIGEST_REGIONS];
+	memset(regions, 0, sizeof(regions));
+
+	int row, col;
+	for (row = 0; row < WORLD_SIZE; row++) {
+		unsigned long *rowRegions = regions + (long) row * DIGEST_REGIONS / WORLD_SIZE * DIGEST_REGIONS;
+		for (col = 0; col < WORLD_SIZE; col++) {
+			if (cellType(row, col) != EMPTY) {
+				world_pos pos;
+				getCellState(row, col, &pos);
+				unsigned long digest = cellDigest(row, col, &pos);
+				total += digest;
+				rowRegions[(long) col * DIGEST_REGIONS / WORLD_SIZE] += digest;
+			}
+		}
+	}
+
+	fprintf(stderr, "Digest %d %016lx", generation, total);
+	int i;
+	for (i = 0; i < DIGEST_REGIONS * DIGEST_REGIONS; i++) {
+		fprintf(stderr, " %016lx", regions[i]);
+	}
+	fprintf(stderr, "\n");
+}
+
+// Writes the digits of a non negative integer, returning where they end
+char *formatInt(char *text, int value) {
+	char digits[10];
+	int n = 0;
+	do {
+		digits[n++] = '0' + value % 10;
+		value /= 10;
+	} while (value > 0);
+
+	while (n > 0) {
+		*text++ = digits[--n];
+	}
+	return text;
+}
+
+// Writes the "row col type" lines of a row of the world, returning where
+// they end
+char *formatRow(char *text, int row) {
+	char rowText[12];
+	int rowLength = formatInt(rowText, row) - rowText;
+	rowText[rowLength++] = ' ';
+
+	int col;
+	for (col = 0; col < WORLD_SIZE; col++) {
+		unsigned char type = (ENGINE == ENGINE_COMPACT) ? CELL_TYPE(compactRow(row)[col]) : new_world[row][col].type;
+		if (type != EMPTY) {
+			memcpy(text, rowText, rowLength);
+			text = formatInt(text + rowLength, col);
+			*text++ = ' ';
+			*text++ = ttoa(type);
+			*text++ = '\n';
+		}
+	}
+	return text;
+}
+
+// Writes blocks of text to stdout, as many at a time as the system takes
+void writeBlocks(struct iovec *blocks, int count) {
+	while (count > 0) {
+		ssize_t written = writev(STDOUT_FILENO, blocks, min(count, IOV_MAX));
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "Can't print the world\n");
+			exit(EXIT_FAILURE);
+		}
+
+		while ((count > 0) && ((size_t) written >= blocks->iov_len)) {
+			written -= blocks->iov_len;
+			blocks++;
+			count--;
+		}
+		if (count > 0) {
+			blocks->iov_base = (char *) blocks->iov_base + written;
+			blocks->iov_len -= written;
+		}
+	}
+}
+
+void printWorld() {
+	// Whatever is buffered goes first
+	fflush(stdout);
+
+	// A buffer holds at least a row
+	size_t bufferSize = max(OUTPUT_BUFFER, (size_t) WORLD_SIZE * MAX_CELL_TEXT);
+	char *buffer = malloc(bufferSize);
+	char *text = buffer;
+	struct iovec block;
+	int row;
+	for (row = 0; row < WORLD_SIZE; row++) {
+		if ((size_t) (text - buffer) + (size_t) WORLD_SIZE * MAX_CELL_TEXT > bufferSize) {
+			block.iov_base = buffer;
+			block.iov_len = text - buffer;
+			writeBlocks(&block, 1);
+			text = buffer;
+		}
+		text = formatRow(text, row);
+	}
+
+	block.iov_base = buffer;
+	block.iov_len = text - buffer;
+	writeBlocks(&block, 1);
+	free(buffer);
+}
+
+int isRedGen(int row, int col) {
+	return (row % 2) == (col % 2);
+}
+
+int isBlackGen(int row, int col) {
+	return !isRedGen(row, col);
+}
+
+
+void clean(world_pos_t pos) {
+	switch (pos->type) {
+		case TREE:
+		case SQUIRREL_ON_TREE:
+			pos->type = TREE;
+			break;
+
+		case ICE:
+			pos->type = ICE;
+			break;
+
+		default:
+			pos->type = EMPTY;
+	}
+
+	pos->breeding_period = 0;
+	pos->starvation_period = 0;
+	pos->has_moved = 0;
+}
+
+void cleanWorld() {
+	int i, j;
+	for (i = 0; i < WORLD_SIZE; i++) {
+		for (j = 0; j < WORLD_SIZE; j++) {
+			clean(&new_world[i][j]);
+		}
+	}
+}
+
+int canMoveTo(world_pos_t from, world_pos_t to) {
+	// Can't move to ice
+	if (to->type == ICE) {
+		return FALSE;
+	}
+
+	switch (from->type) {
+		case SQUIRREL:
+		case SQUIRREL_ON_TREE:
+			return (to->type == EMPTY) || (to->type == TREE);
+
+		case WOLF:
+			return (to->type == EMPTY) || (to->type == SQUIRREL);
+
+		default:
+			fprintf(stderr, "Can't move this type: %d\n", from->type);
+			exit(EXIT_FAILURE);
+	}
+
+	return FALSE;
+}
+
+int isWolfToSquirrel(world_pos_t from, world_pos_t to) {
+	return (from->type == WOLF) && (to->type == SQUIRREL);
+}
+
+move_e getMove(int row, int col) {
+	move_calls++;
+	const int NUM_OPTION = 4;
+	int available[NUM_OPTION];
+	memset( available, 0, NUM_OPTION*sizeof(int) );
+	int nAvailable = 0;
+    int nSquirrels = 0;
+
+    world_pos_t cur = &old_world[row][col];
+
+    // TOP
+    if ((row-1 >= 0) && canMoveTo(cur, &old_world[row-1][col])) {
+    	if (isWolfToSquirrel(cur, &old_world[row-1][col])) {
+			available[TOP] = 2;
+            nSquirrels++;
+		} else {
+            available[TOP] = 1;
+            nAvailable++;
+        }
+    }
+    
+    // RIGHT
+    if ((col+1 < WORLD_SIZE) && canMoveTo(cur, &old_world[row][col+1])) {
+    	if (isWolfToSquirrel(cur, &old_world[row][col+1])) {
+			available[RIGHT] = 2;
+            nSquirrels++;
+		} else {
+            available[RIGHT] = 1;
+            nAvailable++;
+        }
+    }
+
+    // BOTTOM
+    if ((row+1 < WORLD_SIZE) && canMoveTo(cur, &old_world[row+1][col])) {
+    	if (isWolfToSquirrel(cur, &old_world[row+1][col])) {
+			available[BOTTOM] = 2;
+            nSquirrels++;
+		} else {
+            available[BOTTOM] = 1;
+            nAvailable++;
+        }
+    } 
+
+    // LEFT
+    if ((col-1 >= 0) && canMoveTo(cur, &old_world[row][col-1])) {
+    	if (isWolfToSquirrel(cur, &old_world[row][col-1])) {
+			available[LEFT] = 2;
+            nSquirrels++;
+		} else {
+            available[LEFT] = 1;
+            nAvailable++;
+        }
+    }
+    
+    if (nAvailable == 0 && nSquirrels == 0)
+        return NONE;
+    
+    int n = 1;
+    if(nSquirrels != 0){
+        nAvailable = nSquirrels;
+        n = 2;
+    }
+    
+    int selected = numberOfPosition(row, col) % nAvailable;
+    int i;
+	for (i = 0; i < NUM_OPTION; i++) {
+		if (available[i] == n) {
+			if (selected == 0){
+				return i;
+			}
+			selected--;
+		}
+	}
+
+	return NONE;
+}
+
+world_pos_t getDestination(int row, int col, move_e move) {
+	switch (move) {
+		case TOP:
+			return &new_world[row-1][col];
+
+		case RIGHT:
+			return &new_world[row][col+1];
+
+		case BOTTOM:
+			return &new_world[row+1][col];
+
+		case LEFT:
+			return &new_world[row][col-1];
+
+		case NONE:
+			return &new_world[row][col];
+
+		default:
+			fprintf(stderr, "Unknown move: %d\n", move);
+			exit(EXIT_FAILURE);
+
+			// doesn't do anything
+			return &new_world[row][col];
+	}
+}
+
+void chooseBestSquirrel(world_pos_t from, world_pos_t to) {
+	to->breeding_period = max(from->breeding_period, to->breeding_period);
+}
+
+void chooseBestWolf(world_pos_t from, world_pos_t to) {
+	if (from->starvation_period == to->starvation_period) {
+		to->breeding_period = max(from->breeding_period, to->breeding_period);
+	} else if (from->starvation_period < to->starvation_period) {
+		to->breeding_period = from->breeding_period;
+		to->starvation_period = from->starvation_period;
+	}
+}
+
+
 /* 	Since animals avoid collisions by default,
 	if they encounter another animal, both have moved.
 
-	If an animal goes to an 'empty' position, it moves.
+	If an animal goes to an 'empty' position, it moves.
+
+	Since squirrels avoid wolfs, if a squirrel goes to
+	a position with a wolf, both have moved.
+
+	Since wolfs run after squirrels, he has moved.
+
+	Conclusion, in all cases, the animal in the end
+	always moves.
+*/
+void movePos(world_pos_t from, world_pos_t to) {
+	switch (from->type) {
+	   	case SQUIRREL:
+	   	case SQUIRREL_ON_TREE: {
+	   		switch (to->type) {
+	   		case WOLF:
+	   			to->starvation_period = 0;
+	   			break;
+
+	   		case SQUIRREL:
+	   		case SQUIRREL_ON_TREE:
+	   			chooseBestSquirrel(from, to);
+				break;
+
+			default:
+				copyPos(from, to);
+	   		}
+
+	   		break;
+	   	}
+
+		case WOLF: {
+			switch (to->type) {
+			case SQUIRREL:
+				copyPos(from, to);
+	    		to->starvation_period = 0;
+	    		break;
+
+			case WOLF:
+				chooseBestWolf(from, to);
+	    	 	break;
+
+	    	default:
+	    		copyPos(from, to);
+	    	}
+
+	    	break;
+	    }
+
+	    default:
+	    	fprintf(stderr, "Can't move %d!", from->type);
+	    	exit(EXIT_FAILURE);
+	}
+
+	to->has_moved = TRUE;
+}
+
+void updatePos(int row, int col) {
+	if ((old_world[row][col].type == EMPTY) || (old_world[row][col].type == TREE) || (old_world[row][col].type == ICE)) {
+		return;
+	}
+
+	move_e move = getMove(row, col);
+	world_pos_t from = &new_world[row][col];
+	world_pos_t to = getDestination(row, col, move);
+
+	if (from == to) {
+		return;
+	}
+
+	if (isBreeding(from)) {
+		from->breeding_period = 0;
+		movePos(from, to);
+		breed(from); // This is the inverse of what we had
+	} else {
+		movePos(from, to);
+		clean(from);
+	}
+}
+
+void copyPos(world_pos_t from, world_pos_t to) {
+	switch (from->type) {
+		case SQUIRREL:
+		case SQUIRREL_ON_TREE: {
+			switch (to->type) {
+				case SQUIRREL_ON_TREE:
+				case TREE:
+					to->type = SQUIRREL_ON_TREE;
+					break;
+
+				default:
+					to->type = SQUIRREL;
+			}
+			break;
+		}
+
+		default:
+			to->type = from->type;
+	}
+
+	to->breeding_period = from->breeding_period;
+	to->starvation_period = from->starvation_period;
+	to->has_moved = from->has_moved;
+}
+
+// Copies the new world to the old world
+// It's independent of init
+void copyWorld() {
+	int i;
+	for (i = 0; i < WORLD_SIZE; i++) {
+		memcpy(old_world[i], new_world[i], sizeof(world_pos)*WORLD_SIZE);
+	}
+}
+
+int isBreeding(world_pos_t pos) {
+	switch (pos->type) {
+		case WOLF:
+			return pos->breeding_period == WOLF_BREEDING_LEVEL;
+
+		case SQUIRREL:
+		case SQUIRREL_ON_TREE:
+			return pos->breeding_period == SQUIRREL_BREEDING_LEVEL;
 
-	Since squirrels avoid wolfs, if a squirrel goes to
-	a position with a wolf, both have moved.
+		default:
+			return FALSE;
+	}
+}
+
+int isStarving(world_pos_t pos) {
+	switch (pos->type) {
+		case WOLF:
+			return pos->starvation_period == WOLF_STARVING_LEVEL;
+
+		default:
+			return FALSE;
+	}
+}
+
+// Same as clean but the type remains
+void breed(world_pos_t pos) {
+	pos->breeding_period = 0;
+	pos->starvation_period = 0;
+	pos->has_moved = 0;
+}
+
+// Can be improved
+void playGen() {
+	// Before generation, cleans starving animals
+	int i, j;
+	for (i = 0; i < WORLD_SIZE; i++) {
+		for (j = 0; j < WORLD_SIZE; j++) {
+			if (isStarving(&new_world[i][j])) {
+				clean(&new_world[i][j]);
+			}
+		}
+	}
+	lap(PHASE_CULL);
+
+	// Must keep consistency between worlds
+	copyWorld();
+	lap(PHASE_COPY);
+
+	// Red sub-generation
+	for (i = 0; i < WORLD_SIZE; i++) {
+		// for (j = 0; j < WORLD_SIZE; j++) {
+		// 	if (isRedGen(i, j)) {
+		// 		updatePos(i, j);
+		// 	}
+		// }
+		for (j = (i % 2); j < WORLD_SIZE; j+=2) {
+			updatePos(i, j);
+		}
+	}
+	lap(PHASE_RED);
+
+	// Must keep consistency between worlds
+	copyWorld();
+	lap(PHASE_COPY);
+
+	// Black sub-generation
+	for (i = 0; i < WORLD_SIZE; i++) {
+		// for (j = 0; j < WORLD_SIZE; j++) {
+		// 	if (isBlackGen(i, j)) {
+		// 		updatePos(i, j);
+		// 	}
+		// }
+		for (j = !(i % 2); j < WORLD_SIZE; j+=2) {
+			updatePos(i, j);
+		}
+	}
+	lap(PHASE_BLACK);
+
+	// After generation, increase breeding_period to the animals
+	// that moved
+	for (i = 0; i < WORLD_SIZE; i++) {
+		for (j = 0; j < WORLD_SIZE; j++) {
+			if (new_world[i][j].has_moved) {
+				new_world[i][j].breeding_period++;
+				new_world[i][j].has_moved = FALSE;
+				animal_moves++;
+			}
+		}
+	}
+	lap(PHASE_BREED);
+}
+
+engine_e atoe(const char *name) {
+	if (strcmp(name, "dense") == 0) {
+		return ENGINE_DENSE;
+	}
+	if (strcmp(name, "fused") == 0) {
+		return ENGINE_FUSED;
+	}
+	if (strcmp(name, "sparse") == 0) {
+		return ENGINE_SPARSE;
+	}
+	if (strcmp(name, "compact") == 0) {
+		return ENGINE_COMPACT;
+	}
+	if (strcmp(name, "tiled") == 0) {
+		return ENGINE_TILED;
+	}
+
+	fprintf(stderr, "Unknown engine: %s\n", name);
+	exit(EXIT_FAILURE);
+}
+
+const char *etoa(engine_e engine) {
+	switch (engine) {
+		case ENGINE_DENSE:   return "dense";
+		case ENGINE_FUSED:   return "fused";
+		case ENGINE_SPARSE:  return "sparse";
+		case ENGINE_COMPACT: return "compact";
+		case ENGINE_TILED:   return "tiled";
+	}
+
+	return "unknown";
+}
+
+// Options come after the positional arguments
+void parseOptions(int argc, char **argv) {
+	const char *simd = "auto";
+	int i;
+	for (i = NUM_ARGUMENTS; i < argc; i++) {
+		if ((strcmp(argv[i], "--engine") == 0) && (i+1 < argc)) {
+			ENGINE = atoe(argv[++i]);
+		} else if ((strcmp(argv[i], "--simd") == 0) && (i+1 < argc)) {
+			simd = argv[++i];
+		} else if ((strcmp(argv[i], "--tile") == 0) && (i+1 < argc)) {
+			TILE_SIZE = atoi(argv[++i]);
+		} else if ((strcmp(argv[i], "--tile-generations") == 0) && (i+1 < argc)) {
+			TILE_GENERATIONS = atoi(argv[++i]);
+		} else if ((strcmp(argv[i], "--checkpoint") == 0) && (i+1 < argc)) {
+			checkpoint_file = argv[++i];
+		} else if ((strcmp(argv[i], "--checkpoint-every") == 0) && (i+1 < argc)) {
+			CHECKPOINT_EVERY = atoi(argv[++i]);
+		} else if ((strcmp(argv[i], "--checkpoint-buffers") == 0) && (i+1 < argc)) {
+			CHECKPOINT_BUFFERS = atoi(argv[++i]);
+		} else if ((strcmp(argv[i], "--restart") == 0) && (i+1 < argc)) {
+			restart_file = argv[++i];
+		} else if ((strcmp(argv[i], "--trajectory") == 0) && (i+1 < argc)) {
+			trajectory_file = argv[++i];
+		} else if ((strcmp(argv[i], "--keyframe-every") == 0) && (i+1 < argc)) {
+			KEYFRAME_EVERY = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--digest") == 0) {
+			print_digests = TRUE;
+		} else if ((strcmp(argv[i], "--timings") == 0) && (i+1 < argc)) {
+			timings_file = argv[++i];
+		} else if (strcmp(argv[i], "--counters") == 0) {
+			count_events = TRUE;
+		} else if ((strcmp(argv[i], "--sparse-threshold") == 0) && (i+1 < argc)) {
+			SPARSE_THRESHOLD = atof(argv[++i]);
+		} else {
+			fprintf(stderr, "Unknown option: %s\n", argv[i]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if ((TILE_SIZE < 1) || (TILE_GENERATIONS < 1)) {
+		fprintf(stderr, "Tiles must have at least a cell and a generation\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if ((CHECKPOINT_EVERY < 0) || ((CHECKPOINT_EVERY > 0) && (checkpoint_file == NULL))) {
+		fprintf(stderr, "Checkpoints need a --checkpoint file and a number of generations\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (CHECKPOINT_BUFFERS < 1) {
+		fprintf(stderr, "Checkpoints need at least a buffer\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (KEYFRAME_EVERY < 1) {
+		fprintf(stderr, "Keyframes need a number of generations\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (count_events && (timings_file == NULL)) {
+		fprintf(stderr, "Counters need a --timings file\n");
+		exit(EXIT_FAILURE);
+	}
+
+	moveMasks = atok(simd);
+}
+
+unsigned char *planeRow(int row) {
+	return type_plane + (size_t) (row+1)*(WORLD_SIZE+2) + 1;
+}
+
+// Bit per direction an animal can move to, in the low nibble, and
+// per direction with a squirrel for a wolf, in the high nibble.
+// Neighbours outside of the world must be ICE, which never matches
+// any type an animal can move to.
+unsigned char cellMoveMask(unsigned char cur, const unsigned char *neighbours) {
+	int freeMask = 0;
+	int preyMask = 0;
+	int i;
+	for (i = 0; i < 4; i++) {
+		unsigned char to = neighbours[i];
+		if (cur == WOLF) {
+			preyMask |= (to == SQUIRREL) << i;
+			freeMask |= (to == EMPTY) << i;
+		} else if ((cur == SQUIRREL) || (cur == SQUIRREL_ON_TREE)) {
+			freeMask |= ((to == EMPTY) || (to == TREE)) << i;
+		}
+	}
+
+	return freeMask | (preyMask << 4);
+}
+
+// Same as the end of getMove, given the types of the animal and of
+// its neighbours in move order
+move_e chooseMove(int row, int col, unsigned char cur, const unsigned char *neighbours) {
+	move_calls++;
+	unsigned char moveMask = cellMoveMask(cur, neighbours);
+
+	// squirrels are always preferred by wolves
+	int mask = (moveMask >> 4) ? (moveMask >> 4) : (moveMask & 0x0f);
+	if (mask == 0) {
+		return NONE;
+	}
+
+	int selected = numberOfPosition(row, col) % __builtin_popcount(mask);
+	int i;
+	for (i = 0; i < 4; i++) {
+		if (mask & (1 << i)) {
+			if (selected == 0) {
+				return i;
+			}
+			selected--;
+		}
+	}
+
+	return NONE;
+}
+
+// Same as chooseMove, from a mask and without branches. An empty
+// mask has a single option, NONE, to avoid dividing by zero.
+move_e maskedMove(int row, int col, unsigned char moveMask) {
+	move_calls++;
+	unsigned char prey = moveMask >> 4;
+	unsigned char mask = prey ? prey : (moveMask & 0x0f);
+	int selected = numberOfPosition(row, col) % MASK_OPTIONS[mask];
+	return (selected < 0) ? NONE : MASK_MOVES[mask][selected];
+}
+
+// Same as getMove, but the neighbours come from the type plane
+// and the animal from new_world, so there are no bounds checks
+move_e getMoveFused(int row, int col) {
+	unsigned char neighbours[4];
+	neighbours[TOP] = planeRow(row-1)[col];
+	neighbours[RIGHT] = planeRow(row)[col+1];
+	neighbours[BOTTOM] = planeRow(row+1)[col];
+	neighbours[LEFT] = planeRow(row)[col-1];
+
+	return chooseMove(row, col, new_world[row][col].type, neighbours);
+}
+
+// Move masks of n cells, given their types, the types above and below
+// them and the n+1 types between them, the one left of each cell and
+// then the one right of the last
+void moveMasksScalar(const unsigned char *up, const unsigned char *cur, const unsigned char *sides, const unsigned char *down, int n,
+		unsigned char *masks) {
+	int j;
+	for (j = 0; j < n; j++) {
+		unsigned char neighbours[4];
+		neighbours[TOP] = up[j];
+		neighbours[RIGHT] = sides[j+1];
+		neighbours[BOTTOM] = down[j];
+		neighbours[LEFT] = sides[j];
+		masks[j] = cellMoveMask(cur[j], neighbours);
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse4.2")))
+void moveMasksSSE(const unsigned char *up, const unsigned char *cur, const unsigned char *sides, const unsigned char *down, int n,
+		unsigned char *masks) {
+	const __m128i empty = _mm_setzero_si128();
+	const __m128i wolf = _mm_set1_epi8(WOLF);
+	const __m128i squirrel = _mm_set1_epi8(SQUIRREL);
+	const __m128i tree = _mm_set1_epi8(TREE);
+	const __m128i onTree = _mm_set1_epi8(SQUIRREL_ON_TREE);
+
+	int j, i;
+	for (j = 0; j + 16 <= n; j += 16) {
+		__m128i animals = _mm_loadu_si128((const __m128i *) (cur + j));
+		__m128i isWolf = _mm_cmpeq_epi8(animals, wolf);
+		__m128i isSquirrel = _mm_or_si128(_mm_cmpeq_epi8(animals, squirrel), _mm_cmpeq_epi8(animals, onTree));
+
+		__m128i neighbours[4];
+		neighbours[TOP] = _mm_loadu_si128((const __m128i *) (up + j));
+		neighbours[RIGHT] = _mm_loadu_si128((const __m128i *) (sides + j + 1));
+		neighbours[BOTTOM] = _mm_loadu_si128((const __m128i *) (down + j));
+		neighbours[LEFT] = _mm_loadu_si128((const __m128i *) (sides + j));
+
+		__m128i mask = empty;
+		for (i = 0; i < 4; i++) {
+			__m128i toEmpty = _mm_cmpeq_epi8(neighbours[i], empty);
+			__m128i toTree = _mm_cmpeq_epi8(neighbours[i], tree);
+			__m128i toSquirrel = _mm_cmpeq_epi8(neighbours[i], squirrel);
+			__m128i canMove = _mm_or_si128(_mm_and_si128(isWolf, toEmpty),
+					_mm_and_si128(isSquirrel, _mm_or_si128(toEmpty, toTree)));
+			__m128i prey = _mm_and_si128(isWolf, toSquirrel);
+			mask = _mm_or_si128(mask, _mm_and_si128(canMove, _mm_set1_epi8(1 << i)));
+			mask = _mm_or_si128(mask, _mm_and_si128(prey, _mm_set1_epi8(16 << i)));
+		}
+		_mm_storeu_si128((__m128i *) (masks + j), mask);
+	}
+
+	moveMasksScalar(up + j, cur + j, sides + j, down + j, n - j, masks + j);
+}
+
+__attribute__((target("avx2")))
+void moveMasksAVX2(const unsigned char *up, const unsigned char *cur, const unsigned char *sides, const unsigned char *down, int n,
+		unsigned char *masks) {
+	const __m256i empty = _mm256_setzero_si256();
+	const __m256i wolf = _mm256_set1_epi8(WOLF);
+	const __m256i squirrel = _mm256_set1_epi8(SQUIRREL);
+	const __m256i tree = _mm256_set1_epi8(TREE);
+	const __m256i onTree = _mm256_set1_epi8(SQUIRREL_ON_TREE);
+
+	int j, i;
+	for (j = 0; j + 32 <= n; j += 32) {
+		__m256i animals = _mm256_loadu_si256((const __m256i *) (cur + j));
+		__m256i isWolf = _mm256_cmpeq_epi8(animals, wolf);
+		__m256i isSquirrel = _mm256_or_si256(_mm256_cmpeq_epi8(animals, squirrel), _mm256_cmpeq_epi8(animals, onTree));
+
+		__m256i neighbours[4];
+		neighbours[TOP] = _mm256_loadu_si256((const __m256i *) (up + j));
+		neighbours[RIGHT] = _mm256_loadu_si256((const __m256i *) (sides + j + 1));
+		neighbours[BOTTOM] = _mm256_loadu_si256((const __m256i *) (down + j));
+		neighbours[LEFT] = _mm256_loadu_si256((const __m256i *) (sides + j));
+
+		__m256i mask = empty;
+		for (i = 0; i < 4; i++) {
+			__m256i toEmpty = _mm256_cmpeq_epi8(neighbours[i], empty);
+			__m256i toTree = _mm256_cmpeq_epi8(neighbours[i], tree);
+			__m256i toSquirrel = _mm256_cmpeq_epi8(neighbours[i], squirrel);
+			__m256i canMove = _mm256_or_si256(_mm256_and_si256(isWolf, toEmpty),
+					_mm256_and_si256(isSquirrel, _mm256_or_si256(toEmpty, toTree)));
+			__m256i prey = _mm256_and_si256(isWolf, toSquirrel);
+			mask = _mm256_or_si256(mask, _mm256_and_si256(canMove, _mm256_set1_epi8(1 << i)));
+			mask = _mm256_or_si256(mask, _mm256_and_si256(prey, _mm256_set1_epi8(16 << i)));
+		}
+		_mm256_storeu_si256((__m256i *) (masks + j), mask);
+	}
+
+	moveMasksScalar(up + j, cur + j, sides + j, down + j, n - j, masks + j);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+void moveMasksAVX512(const unsigned char *up, const unsigned char *cur, const unsigned char *sides, const unsigned char *down, int n,
+		unsigned char *masks) {
+	const __m512i empty = _mm512_setzero_si512();
+	const __m512i wolf = _mm512_set1_epi8(WOLF);
+	const __m512i squirrel = _mm512_set1_epi8(SQUIRREL);
+	const __m512i tree = _mm512_set1_epi8(TREE);
+	const __m512i onTree = _mm512_set1_epi8(SQUIRREL_ON_TREE);
+
+	int j, i;
+	for (j = 0; j + 64 <= n; j += 64) {
+		__m512i animals = _mm512_loadu_si512(cur + j);
+		__mmask64 isWolf = _mm512_cmpeq_epi8_mask(animals, wolf);
+		__mmask64 isSquirrel = _mm512_cmpeq_epi8_mask(animals, squirrel) | _mm512_cmpeq_epi8_mask(animals, onTree);
+
+		__m512i neighbours[4];
+		neighbours[TOP] = _mm512_loadu_si512(up + j);
+		neighbours[RIGHT] = _mm512_loadu_si512(sides + j + 1);
+		neighbours[BOTTOM] = _mm512_loadu_si512(down + j);
+		neighbours[LEFT] = _mm512_loadu_si512(sides + j);
+
+		__m512i mask = empty;
+		for (i = 0; i < 4; i++) {
+			__mmask64 toEmpty = _mm512_cmpeq_epi8_mask(neighbours[i], empty);
+			__mmask64 toTree = _mm512_cmpeq_epi8_mask(neighbours[i], tree);
+			__mmask64 toSquirrel = _mm512_cmpeq_epi8_mask(neighbours[i], squirrel);
+			__mmask64 canMove = (isWolf & toEmpty) | (isSquirrel & (toEmpty | toTree));
+			__mmask64 prey = isWolf & toSquirrel;
+			mask = _mm512_or_si512(mask, _mm512_maskz_set1_epi8(canMove, 1 << i));
+			mask = _mm512_or_si512(mask, _mm512_maskz_set1_epi8(prey, 16 << i));
+		}
+		_mm512_storeu_si512(masks + j, mask);
+	}
+
+	moveMasksScalar(up + j, cur + j, sides + j, down + j, n - j, masks + j);
+}
+#endif
+
+// Returns the move masks kernel with the given name, or NULL for
+// none, which makes the fused sweeps call getMoveFused cell by cell
+move_masks_f atok(const char *name) {
+	if (strcmp(name, "none") == 0) {
+		return NULL;
+	}
+	if (strcmp(name, "scalar") == 0) {
+		return moveMasksScalar;
+	}
+
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	int isAuto = (strcmp(name, "auto") == 0);
+	if ((isAuto || (strcmp(name, "avx512") == 0)) && __builtin_cpu_supports("avx512bw")) {
+		return moveMasksAVX512;
+	}
+	if ((isAuto || (strcmp(name, "avx2") == 0)) && __builtin_cpu_supports("avx2")) {
+		return moveMasksAVX2;
+	}
+	if ((isAuto || (strcmp(name, "sse4.2") == 0)) && __builtin_cpu_supports("sse4.2")) {
+		return moveMasksSSE;
+	}
+	if (isAuto) {
+		return moveMasksScalar;
+	}
+#else
+	if (strcmp(name, "auto") == 0) {
+		return moveMasksScalar;
+	}
+#endif
+
+	fprintf(stderr, "Unsupported SIMD kernel: %s\n", name);
+	exit(EXIT_FAILURE);
+}
+
+// Starvation cleanup of a row, which also publishes the row's
+// types for the red sub-generation
+void fusedCullRow(int row) {
+	unsigned char *types = planeRow(row);
+	int j;
+	for (j = 0; j < WORLD_SIZE; j++) {
+		if (isStarving(&new_world[row][j])) {
+			clean(&new_world[row][j]);
+		}
+		types[j] = new_world[row][j].type;
+	}
+}
+
+// Same as the end of updatePos, returning the move made. Only this
+// cell writes its own position during a sub-generation, so its type
+// in the plane is refreshed right away for the next sub-generation.
+move_e fusedApplyMove(int row, int col, move_e move) {
+	world_pos_t from = &new_world[row][col];
+	world_pos_t to = getDestination(row, col, move);
+
+	if (from == to) {
+		return NONE;
+	}
+
+	if (isBreeding(from)) {
+		from->breeding_period = 0;
+		movePos(from, to);
+		breed(from);
+	} else {
+		movePos(from, to);
+		clean(from);
+	}
+
+	planeRow(row)[col] = from->type;
+	return move;
+}
+
+move_e fusedUpdatePos(int row, int col) {
+	unsigned char type = new_world[row][col].type;
+	if ((type == EMPTY) || (type == TREE) || (type == ICE)) {
+		return NONE;
+	}
+
+	return fusedApplyMove(row, col, getMoveFused(row, col));
+}
+
+// Copies every other byte of a row, n of them, next to each other
+void gatherLane(unsigned char *lane, const unsigned char *row, int n) {
+	int k;
+	for (k = 0; k < n; k++) {
+		lane[k] = row[2*k];
+	}
+}
+
+// Allocates the lanes of the cells of one colour of a row
+void allocLanes(row_lanes_t *lanes) {
+	int half = WORLD_SIZE/2 + 2;
+	lanes->up = malloc((size_t) 5 * half);
+	lanes->cur = lanes->up + half;
+	lanes->sides = lanes->cur + half;
+	lanes->down = lanes->sides + half;
+	lanes->masks = lanes->down + half;
+}
+
+void fusedUpdateRow(int row, int start) {
+	int j;
+	if (moveMasks == NULL) {
+		for (j = start; j < WORLD_SIZE; j += 2) {
+			fusedUpdatePos(row, j);
+		}
+		return;
+	}
+
+	// Cells only ever write their own types to the plane, so the
+	// ones being updated may be behind and are brought up to date.
+	// Only their columns are gathered, and the rows above and below
+	// never write theirs during this sub-generation.
+	row_lanes_t *lanes = &row_lanes;
+	unsigned char *types = planeRow(row);
+	const unsigned char *up = planeRow(row-1);
+	const unsigned char *down = planeRow(row+1);
+	for (j = start; j < WORLD_SIZE; j += 2) {
+		types[j] = new_world[row][j].type;
+	}
+
+	int n = (WORLD_SIZE - start + 1) / 2;
+	int k;
+	gatherLane(lanes->up, up + start, n);
+	gatherLane(lanes->cur, types + start, n);
+	gatherLane(lanes->sides, types + start - 1, n+1);
+	gatherLane(lanes->down, down + start, n);
+
+	moveMasks(lanes->up, lanes->cur, lanes->sides, lanes->down, n, lanes->masks);
+	for (k = 0, j = start; k < n; k++, j += 2) {
+		if (isAnimal(lanes->cur[k])) {
+			fusedApplyMove(row, j, maskedMove(row, j, lanes->masks[k]));
+		}
+	}
+}
+
+// Returns the number of animals in the row
+int fusedBreedRow(int row) {
+	int j;
+	int count = 0;
+	for (j = 0; j < WORLD_SIZE; j++) {
+		if (new_world[row][j].has_moved) {
+			new_world[row][j].breeding_period++;
+			new_world[row][j].has_moved = FALSE;
+			animal_moves++;
+		}
+		count += isAnimal(new_world[row][j].type);
+	}
+	return count;
+}
+
+/*	Single pass version of playGen.
+
+	A red row only touches the rows next to it, so by the time
+	row k is red-updated, row k-1 has seen every red move it will
+	get and can be black-updated, and row k-2 has seen every move
+	of the generation and can breed. Row k+1 is culled just before
+	the red row above it reads its types. Each step is timed as the
+	phase it belongs to.
+*/
+void playGenFused() {
+	int k;
+	animal_count = 0;
+	for (k = -1; k <= WORLD_SIZE + 1; k++) {
+		if (k+1 < WORLD_SIZE) {
+			fusedCullRow(k+1);
+			lap(PHASE_CULL);
+		}
+		if ((k >= 0) && (k < WORLD_SIZE)) {
+			fusedUpdateRow(k, k % 2);
+			lap(PHASE_RED);
+		}
+		if ((k-1 >= 0) && (k-1 < WORLD_SIZE)) {
+			fusedUpdateRow(k-1, !((k-1) % 2));
+			lap(PHASE_BLACK);
+		}
+		if (k-2 >= 0) {
+			animal_count += fusedBreedRow(k-2);
+			lap(PHASE_BREED);
+		}
+	}
+}
+
+int isAnimal(unsigned char type) {
+	return (type == WOLF) || (type == SQUIRREL) || (type == SQUIRREL_ON_TREE);
+}
+
+// Makes room for a list of the given size. A sweep can at most
+// double the list, when every animal breeds.
+void sparseReserve(long size) {
+	if (2*size <= animals_capacity) {
+		return;
+	}
+
+	animals_capacity = max(4*size, 1024);
+	animals = realloc(animals, sizeof(long) * animals_capacity);
+	next_animals = realloc(next_animals, sizeof(long) * animals_capacity);
+	moved_top = realloc(moved_top, sizeof(long) * animals_capacity);
+	moved_bottom = realloc(moved_bottom, sizeof(long) * animals_capacity);
+}
+
+void collectAnimals() {
+	sparseReserve(animal_count);
+	num_animals = 0;
+
+	int i, j;
+	for (i = 0; i < WORLD_SIZE; i++) {
+		for (j = 0; j < WORLD_SIZE; j++) {
+			if (isAnimal(new_world[i][j].type)) {
+				animals[num_animals++] = (long) i*WORLD_SIZE + j;
+			}
+		}
+	}
+}
+
+// Starvation cleanup of the listed animals. The plane already holds
+// the right type for every cell without an animal.
+void sparseCull() {
+	long i;
+	for (i = 0; i < num_animals; i++) {
+		int row = animals[i] / WORLD_SIZE;
+		int col = animals[i] % WORLD_SIZE;
+		if (isStarving(&new_world[row][col])) {
+			clean(&new_world[row][col]);
+		}
+		planeRow(row)[col] = new_world[row][col].type;
+	}
+}
+
+/*	Updates the listed animals of one colour (0 for red, 1 for black)
+	and rebuilds the list from where they ended up.
+
+	Staying, breeding and sideways moves shift a position by at most
+	one and keep the list sorted, as do moves up or down among
+	themselves, so the new list is a merge of those three runs.
+*/
+void sparseSweep(int parity) {
+	long *stay = next_animals;
+	long nStay = 0;
+	long nTop = 0;
+	long nBottom = 0;
+
+	long i;
+	for (i = 0; i < num_animals; i++) {
+		long pos = animals[i];
+		int row = pos / WORLD_SIZE;
+		int col = pos % WORLD_SIZE;
+		world_pos_t cell = &new_world[row][col];
+
+		// starved during the cleanup
+		if (!isAnimal(cell->type)) {
+			continue;
+		}
+
+		if (((row + col) % 2) != parity) {
+			stay[nStay++] = pos;
+			continue;
+		}
+
+		move_e move = fusedUpdatePos(row, col);
+		int bred = (move != NONE) && isAnimal(cell->type);
+		switch (move) {
+			case TOP:
+				moved_top[nTop++] = pos - WORLD_SIZE;
+				break;
 
-	Since wolfs run after squirrels, he has moved.
+			case BOTTOM:
+				moved_bottom[nBottom++] = pos + WORLD_SIZE;
+				break;
 
-	Conclusion, in all cases, the animal in the end
-	always moves.
-*/
-void movePos(world_pos_t from, world_pos_t to) {
-	switch (from->type) {
-	   	case SQUIRREL:
-	   	case SQUIRREL_ON_TREE: {
-	   		switch (to->type) {
-	   		case WOLF:
-	   			to->starvation_period = 0;
-	   			break;
+			case LEFT:
+				stay[nStay++] = pos - 1;
+				break;
 
-	   		case SQUIRREL:
-	   		case SQUIRREL_ON_TREE:
-	   			chooseBestSquirrel(from, to);
+			case RIGHT:
+				if (bred) {
+					stay[nStay++] = pos;
+					bred = FALSE;
+				}
+				stay[nStay++] = pos + 1;
 				break;
 
 			default:
-				copyPos(from, to);
-	   		}
+				stay[nStay++] = pos;
+		}
 
-	   		break;
-	   	}
+		if (bred) {
+			stay[nStay++] = pos;
+		}
+	}
 
-		case WOLF: {
-			switch (to->type) {
-			case SQUIRREL:
-				copyPos(from, to);
-	    		to->starvation_period = 0;
-	    		break;
+	// merge the three runs dropping positions taken twice
+	long s = 0, t = 0, b = 0;
+	num_animals = 0;
+	while ((s < nStay) || (t < nTop) || (b < nBottom)) {
+		long pos = (s < nStay) ? stay[s] : -1;
+		if ((t < nTop) && ((pos < 0) || (moved_top[t] < pos))) {
+			pos = moved_top[t];
+		}
+		if ((b < nBottom) && ((pos < 0) || (moved_bottom[b] < pos))) {
+			pos = moved_bottom[b];
+		}
 
-			case WOLF:
-				chooseBestWolf(from, to);
-	    	 	break;
+		while ((s < nStay) && (stay[s] == pos)) s++;
+		while ((t < nTop) && (moved_top[t] == pos)) t++;
+		while ((b < nBottom) && (moved_bottom[b] == pos)) b++;
 
-	    	default:
-	    		copyPos(from, to);
-	    	}
+		animals[num_animals++] = pos;
+	}
+}
 
-	    	break;
-	    }
+// After generation, increase breeding_period to the listed animals
+// that moved and bring their types in the plane up to date
+void sparseBreed() {
+	long i;
+	for (i = 0; i < num_animals; i++) {
+		int row = animals[i] / WORLD_SIZE;
+		int col = animals[i] % WORLD_SIZE;
+		world_pos_t cell = &new_world[row][col];
+		if (cell->has_moved) {
+			cell->breeding_period++;
+			cell->has_moved = FALSE;
+			animal_moves++;
+		}
+		planeRow(row)[col] = cell->type;
+	}
+	animal_count = num_animals;
+}
 
-	    default:
-	    	fprintf(stderr, "Can't move %d!", from->type);
-	    	exit(EXIT_FAILURE);
+// Same as playGenFused, driven by the list of animals instead of
+// every cell while the world is sparse enough
+void playGenSparse() {
+	double limit = SPARSE_THRESHOLD * WORLD_SIZE * WORLD_SIZE;
+	if ((num_animals < 0) || (num_animals > limit)) {
+		playGenFused();
+		num_animals = -1;
+		if (animal_count <= limit) {
+			collectAnimals();
+			lap(PHASE_BREED);
+		}
+		return;
 	}
 
-	to->has_moved = TRUE;
+	sparseCull();
+	lap(PHASE_CULL);
+	sparseReserve(num_animals);
+	sparseSweep(0);
+	lap(PHASE_RED);
+	sparseReserve(num_animals);
+	sparseSweep(1);
+	lap(PHASE_BLACK);
+	sparseBreed();
+	lap(PHASE_BREED);
 }
 
-void updatePos(int row, int col) {
-	if ((old_world[row][col].type == EMPTY) || (old_world[row][col].type == TREE) || (old_world[row][col].type == ICE)) {
+unsigned char *compactRow(int row) {
+	return compact_world + (size_t) (row+1)*(WORLD_SIZE+2) + 1;
+}
+
+// Returns the slot holding the position's counters, or the empty
+// slot where they would go
+unsigned long counterSlot(unsigned long position) {
+	unsigned long mask = counters_capacity - 1;
+	unsigned long slot = (position * 0x9E3779B97F4A7C15UL) >> 20 & mask;
+	while ((counters[slot] != NO_COUNTERS) && ((counters[slot] & 0xffffffffffffUL) != position)) {
+		slot = (slot + 1) & mask;
+	}
+	return slot;
+}
+
+void growCounters() {
+	unsigned long *old = counters;
+	unsigned long oldCapacity = counters_capacity;
+
+	counters_capacity *= 2;
+	counters = malloc(sizeof(unsigned long) * counters_capacity);
+	memset(counters, 0xff, sizeof(unsigned long) * counters_capacity);
+
+	unsigned long i;
+	for (i = 0; i < oldCapacity; i++) {
+		if (old[i] != NO_COUNTERS) {
+			counters[counterSlot(old[i] & 0xffffffffffffUL)] = old[i];
+		}
+	}
+	free(old);
+}
+
+// Unpacks a cell into a world_pos so the usual rules can be applied
+void compactLoad(int row, int col, world_pos_t pos) {
+	unsigned char cell = compactRow(row)[col];
+	pos->type = CELL_TYPE(cell);
+	pos->has_moved = (cell & CELL_MOVED) != 0;
+	pos->breeding_period = 0;
+	pos->starvation_period = 0;
+
+	if (!isAnimal(pos->type)) {
 		return;
 	}
 
-	move_e move = getMove(row, col);
-	world_pos_t from = &new_world[row][col];
-	world_pos_t to = getDestination(row, col, move);
+	unsigned long entry = counters[counterSlot((unsigned long) row*WORLD_SIZE + col)];
+	if (entry != NO_COUNTERS) {
+		pos->breeding_period = entry >> 48;
+		pos->starvation_period = entry >> 56;
+	}
+}
 
-	if (from == to) {
+// Packs a world_pos back, keeping the old type of the cell.
+// Counters that are both zero are not stored.
+void compactStore(int row, int col, world_pos_t pos) {
+	unsigned char *cell = &compactRow(row)[col];
+	*cell = (*cell & 0x70) | pos->type | (pos->has_moved ? CELL_MOVED : 0);
+
+	unsigned long position = (unsigned long) row*WORLD_SIZE + col;
+	unsigned long slot = counterSlot(position);
+	if ((pos->breeding_period != 0) || (pos->starvation_period != 0)) {
+		if (counters[slot] == NO_COUNTERS) {
+			if (2*(counters_size+1) > counters_capacity) {
+				growCounters();
+				slot = counterSlot(position);
+			}
+			counters_size++;
+		}
+		counters[slot] = position | ((unsigned long) pos->breeding_period << 48)
+				| ((unsigned long) pos->starvation_period << 56);
 		return;
 	}
 
-	if (isBreeding(from)) {
-		from->breeding_period = 0;
-		movePos(from, to);
-		breed(from); // This is the inverse of what we had
+	if (counters[slot] == NO_COUNTERS) {
+		return;
+	}
+
+	// Linear probing removal, moving back the entries that can no
+	// longer be reached past the new hole
+	unsigned long mask = counters_capacity - 1;
+	unsigned long next = slot;
+	while (TRUE) {
+		next = (next + 1) & mask;
+		if (counters[next] == NO_COUNTERS) {
+			break;
+		}
+
+		unsigned long home = ((counters[next] & 0xffffffffffffUL) * 0x9E3779B97F4A7C15UL) >> 20 & mask;
+		if (((next > slot) && ((home <= slot) || (home > next)))
+				|| ((next < slot) && (home <= slot) && (home > next))) {
+			counters[slot] = counters[next];
+			slot = next;
+		}
+	}
+	counters[slot] = NO_COUNTERS;
+	counters_size--;
+}
+
+// Starvation cleanup of a row, which also makes the current types
+// the old ones for the red sub-generation
+void compactCullRow(int row) {
+	unsigned char *cells = compactRow(row);
+	int j;
+	for (j = 0; j < WORLD_SIZE; j++) {
+		if (CELL_TYPE(cells[j]) == WOLF) {
+			world_pos pos;
+			compactLoad(row, j, &pos);
+			if (isStarving(&pos)) {
+				clean(&pos);
+				compactStore(row, j, &pos);
+			}
+		}
+		cells[j] = (cells[j] & 0x0f) | (CELL_TYPE(cells[j]) << 4);
+	}
+}
+
+// Same as fusedUpdatePos, with the neighbours' types taken from the
+// old type of their cells
+void compactUpdatePos(int row, int col) {
+	unsigned char *cells = compactRow(row);
+	unsigned char type = CELL_TYPE(cells[col]);
+	if (!isAnimal(type)) {
+		return;
+	}
+
+	unsigned char neighbours[4];
+	neighbours[TOP] = CELL_OLD_TYPE(compactRow(row-1)[col]);
+	neighbours[RIGHT] = CELL_OLD_TYPE(cells[col+1]);
+	neighbours[BOTTOM] = CELL_OLD_TYPE(compactRow(row+1)[col]);
+	neighbours[LEFT] = CELL_OLD_TYPE(cells[col-1]);
+
+	move_e move = chooseMove(row, col, type, neighbours);
+	if (move == NONE) {
+		return;
+	}
+
+	int toRow = row + (move == BOTTOM) - (move == TOP);
+	int toCol = col + (move == RIGHT) - (move == LEFT);
+	world_pos from;
+	world_pos to;
+	compactLoad(row, col, &from);
+	compactLoad(toRow, toCol, &to);
+
+	if (isBreeding(&from)) {
+		from.breeding_period = 0;
+		movePos(&from, &to);
+		breed(&from);
 	} else {
-		movePos(from, to);
-		clean(from);
+		movePos(&from, &to);
+		clean(&from);
 	}
+
+	compactStore(toRow, toCol, &to);
+	compactStore(row, col, &from);
+	cells[col] = (cells[col] & 0x0f) | (CELL_TYPE(cells[col]) << 4);
 }
 
-void copyPos(world_pos_t from, world_pos_t to) {
-	switch (from->type) {
-		case SQUIRREL:
-		case SQUIRREL_ON_TREE: {
-			switch (to->type) {
-				case SQUIRREL_ON_TREE:
-				case TREE:
-					to->type = SQUIRREL_ON_TREE;
-					break;
+void compactUpdateRow(int row, int start) {
+	int j;
+	for (j = start; j < WORLD_SIZE; j += 2) {
+		compactUpdatePos(row, j);
+	}
+}
 
-				default:
-					to->type = SQUIRREL;
-			}
-			break;
+void compactBreedRow(int row) {
+	unsigned char *cells = compactRow(row);
+	int j;
+	for (j = 0; j < WORLD_SIZE; j++) {
+		if (cells[j] & CELL_MOVED) {
+			world_pos pos;
+			compactLoad(row, j, &pos);
+			pos.breeding_period++;
+			pos.has_moved = FALSE;
+			compactStore(row, j, &pos);
+			animal_moves++;
 		}
+	}
+}
 
-		default:
-			to->type = from->type;
+// Same wavefront as playGenFused over the compact cells
+void playGenCompact() {
+	int k;
+	for (k = -1; k <= WORLD_SIZE + 1; k++) {
+		if (k+1 < WORLD_SIZE) {
+			compactCullRow(k+1);
+			lap(PHASE_CULL);
+		}
+		if ((k >= 0) && (k < WORLD_SIZE)) {
+			compactUpdateRow(k, k % 2);
+			lap(PHASE_RED);
+		}
+		if ((k-1 >= 0) && (k-1 < WORLD_SIZE)) {
+			compactUpdateRow(k-1, !((k-1) % 2));
+			lap(PHASE_BLACK);
+		}
+		if (k-2 >= 0) {
+			compactBreedRow(k-2);
+			lap(PHASE_BREED);
+		}
 	}
+}
 
-	to->breeding_period = from->breeding_period;
-	to->starvation_period = from->starvation_period;
-	to->has_moved = from->has_moved;
+// Allocates a tile's buffers for a region of at most size x size cells
+void tileAlloc(tile_t *tile, int size) {
+	size_t cells = (size_t) size * size;
+	tile->cells = malloc(sizeof(world_pos) * cells);
+	tile->moves = malloc(cells);
 }
 
-// Copies the new world to the old world
-// It's independent of init
-void copyWorld() {
+// Copies a region of old_world to the tile
+void tileLoad(tile_t *tile, int row0, int col0, int rows, int cols) {
+	tile->row0 = row0;
+	tile->col0 = col0;
+	tile->rows = rows;
+	tile->cols = cols;
+
 	int i;
-	for (i = 0; i < WORLD_SIZE; i++) {
-		memcpy(old_world[i], new_world[i], sizeof(world_pos)*WORLD_SIZE);
+	for (i = 0; i < rows; i++) {
+		memcpy(tile->cells + (size_t) i*cols, &old_world[row0+i][col0], sizeof(world_pos)*cols);
 	}
 }
 
-int isBreeding(world_pos_t pos) {
-	switch (pos->type) {
-		case WOLF:
-			return pos->breeding_period == WOLF_BREEDING_LEVEL;
+// Same as getMove inside the rows top to bottom and the columns left to
+// right (not included) of the tile. Cells beyond them are taken as ICE,
+// which is only right at the world's edges; the halo around a tile
+// absorbs the wrong moves everywhere else.
+move_e tileGetMove(tile_t *tile, int row, int col, int top, int bottom, int left, int right) {
+	world_pos_t cell = tile->cells + (size_t) row*tile->cols + col;
+	unsigned char neighbours[4];
+	neighbours[TOP] = (row > top) ? (cell - tile->cols)->type : ICE;
+	neighbours[RIGHT] = (col+1 < right) ? (cell + 1)->type : ICE;
+	neighbours[BOTTOM] = (row+1 < bottom) ? (cell + tile->cols)->type : ICE;
+	neighbours[LEFT] = (col > left) ? (cell - 1)->type : ICE;
+
+	return chooseMove(tile->row0 + row, tile->col0 + col, cell->type, neighbours);
+}
 
-		case SQUIRREL:
-		case SQUIRREL_ON_TREE:
-			return pos->breeding_period == SQUIRREL_BREEDING_LEVEL;
+// Moves into a receiving cell of the tile from the neighbour at
+// the given offset if that neighbour's move points at it
+void tileArrive(tile_t *tile, world_pos_t to, size_t from, move_e move) {
+	if (tile->moves[from] != move) {
+		return;
+	}
 
-		default:
-			return FALSE;
+	world_pos animal = tile->cells[from];
+	if (isBreeding(&animal)) {
+		animal.breeding_period = 0;
 	}
+	movePos(&animal, to);
 }
 
-int isStarving(world_pos_t pos) {
-	switch (pos->type) {
-		case WOLF:
-			return pos->starvation_period == WOLF_STARVING_LEVEL;
+// The first column from left whose parity is the one of start
+int tileFirstCol(int left, int start) {
+	return left + (left + start) % 2;
+}
 
-		default:
-			return FALSE;
+void tileMoves(tile_t *tile, int row, int start, int top, int bottom, int left, int right) {
+	size_t base = (size_t) row*tile->cols;
+	int j;
+	for (j = tileFirstCol(left, start); j < right; j += 2) {
+		tile->moves[base + j] = isAnimal(tile->cells[base + j].type)
+			? tileGetMove(tile, row, j, top, bottom, left, right) : NONE;
 	}
 }
 
-// Same as clean but the type remains
-void breed(world_pos_t pos) {
-	pos->breeding_period = 0;
-	pos->starvation_period = 0;
-	pos->has_moved = 0;
+void tileArriveRow(tile_t *tile, int row, int start, int top, int bottom, int left, int right) {
+	int cols = tile->cols;
+	size_t base = (size_t) row*cols;
+	int j;
+	for (j = tileFirstCol(left, start); j < right; j += 2) {
+		world_pos_t cell = &tile->cells[base + j];
+		if (row > top) {
+			tileArrive(tile, cell, base + j - cols, BOTTOM);
+		}
+		if (j > left) {
+			tileArrive(tile, cell, base + j - 1, RIGHT);
+		}
+		if (j+1 < right) {
+			tileArrive(tile, cell, base + j + 1, LEFT);
+		}
+		if (row+1 < bottom) {
+			tileArrive(tile, cell, base + j + cols, TOP);
+		}
+	}
 }
 
-// Can be improved
-void playGen() {
-	// Before generation, cleans starving animals
-	int i, j;
-	for (i = 0; i < WORLD_SIZE; i++) {
-		for (j = 0; j < WORLD_SIZE; j++) {
-			if (isStarving(&new_world[i][j])) {
-				clean(&new_world[i][j]);
+void tileLeaveRow(tile_t *tile, int row, int start, int left, int right) {
+	size_t base = (size_t) row*tile->cols;
+	int j;
+	for (j = tileFirstCol(left, start); j < right; j += 2) {
+		world_pos_t cell = &tile->cells[base + j];
+		if (tile->moves[base + j] != NONE) {
+			if (isBreeding(cell)) {
+				breed(cell);
+			} else {
+				clean(cell);
 			}
 		}
 	}
+}
 
-	// Must keep consistency between worlds
-	copyWorld();
+/*	One sub-generation of the rows top to bottom and the columns left
+	to right (not included) of the tile, moving the cells whose column
+	in the tile starts at (row + parity) % 2. Each cell takes the
+	animals whose moves point at it, but in place: the moves of a row
+	are computed before the row above takes its animals, and the
+	animals of a row only leave once the row below has taken them.
+*/
+void tileSubGen(tile_t *tile, int parity, int top, int bottom, int left, int right) {
+	int i;
+	tileMoves(tile, top, (top + parity) % 2, top, bottom, left, right);
+	for (i = top; i <= bottom; i++) {
+		if (i+1 < bottom) {
+			tileMoves(tile, i+1, (i+1 + parity) % 2, top, bottom, left, right);
+		}
+		if (i < bottom) {
+			tileArriveRow(tile, i, (i + parity + 1) % 2, top, bottom, left, right);
+		}
+		if (i > top) {
+			tileLeaveRow(tile, i-1, (i-1 + parity) % 2, left, right);
+		}
+	}
+}
 
-	// Red sub-generation
-	for (i = 0; i < WORLD_SIZE; i++) {
-		// for (j = 0; j < WORLD_SIZE; j++) {
-		// 	if (isRedGen(i, j)) {
-		// 		updatePos(i, j);
-		// 	}
-		// }
-		for (j = (i % 2); j < WORLD_SIZE; j+=2) {
-			updatePos(i, j);
+// Same as playGen on the rows top to bottom and the columns left to
+// right (not included) of the tile, returning the moves into the tile's
+// own cells, the ones the halo doesn't make wrong
+long tileGen(tile_t *tile, int top, int bottom, int left, int right) {
+	int i, j;
+	for (i = top; i < bottom; i++) {
+		world_pos_t cells = tile->cells + (size_t) i*tile->cols;
+		for (j = left; j < right; j++) {
+			if (isStarving(&cells[j])) {
+				clean(&cells[j]);
+			}
 		}
 	}
 
-	// Must keep consistency between worlds
-	copyWorld();
+	// red cells have the same row and column parity in the world
+	int red = (tile->row0 + tile->col0) % 2;
+	tileSubGen(tile, red, top, bottom, left, right);
+	tileSubGen(tile, !red, top, bottom, left, right);
 
-	// Black sub-generation
-	for (i = 0; i < WORLD_SIZE; i++) {
-		// for (j = 0; j < WORLD_SIZE; j++) {
-		// 	if (isBlackGen(i, j)) {
-		// 		updatePos(i, j);
-		// 	}
-		// }
-		for (j = !(i % 2); j < WORLD_SIZE; j+=2) {
-			updatePos(i, j);
+	long moves = 0;
+	for (i = tile->own_row; i < tile->own_row + tile->own_rows; i++) {
+		world_pos_t cells = tile->cells + (size_t) i*tile->cols;
+		for (j = tile->own_col; j < tile->own_col + tile->own_cols; j++) {
+			moves += cells[j].has_moved;
 		}
 	}
 
-	// After generation, increase breeding_period to the animals
-	// that moved
-	for (i = 0; i < WORLD_SIZE; i++) {
-		for (j = 0; j < WORLD_SIZE; j++) {
-			if (new_world[i][j].has_moved) {
-				new_world[i][j].breeding_period++;
-				new_world[i][j].has_moved = FALSE;
+	for (i = top; i < bottom; i++) {
+		world_pos_t cells = tile->cells + (size_t) i*tile->cols;
+		for (j = left; j < right; j++) {
+			if (cells[j].has_moved) {
+				cells[j].breeding_period++;
+				cells[j].has_moved = FALSE;
 			}
 		}
 	}
+	return moves;
+}
+
+// Advances the tile of new_world at (row, col) by the given number of
+// generations, working on a copy of old_world that reaches far enough
+// around it: each sub-generation can only move an animal one cell
+// based on what's one cell further, so 4 cells per generation. The
+// cells within 4 of a side that isn't the world's edge are wrong after
+// a generation, so each generation computes 4 cells less on that side.
+// Returns the moves into the tile.
+long advanceTile(tile_t *tile, int row, int col, int generations) {
+	int halo = 4 * generations;
+	int row0 = max(row - halo, 0);
+	int col0 = max(col - halo, 0);
+	int row1 = min(row + TILE_SIZE + halo, WORLD_SIZE);
+	int col1 = min(col + TILE_SIZE + halo, WORLD_SIZE);
+	tileLoad(tile, row0, col0, row1 - row0, col1 - col0);
+
+	int rows = min(TILE_SIZE, WORLD_SIZE - row);
+	int cols = min(TILE_SIZE, WORLD_SIZE - col);
+	tile->own_row = row - row0;
+	tile->own_col = col - col0;
+	tile->own_rows = rows;
+	tile->own_cols = cols;
+
+	int top = 0;
+	int bottom = tile->rows;
+	int left = 0;
+	int right = tile->cols;
+	long moves = 0;
+	int gen;
+	for (gen = 0; gen < generations; gen++) {
+		moves += tileGen(tile, top, bottom, left, right);
+		top += (row0 > 0) ? 4 : 0;
+		bottom -= (row1 < WORLD_SIZE) ? 4 : 0;
+		left += (col0 > 0) ? 4 : 0;
+		right -= (col1 < WORLD_SIZE) ? 4 : 0;
+	}
+
+	int i;
+	for (i = 0; i < rows; i++) {
+		world_pos_t src = tile->cells + (size_t) (row - row0 + i)*tile->cols + (col - col0);
+		memcpy(&new_world[row+i][col], src, sizeof(world_pos)*cols);
+	}
+	return moves;
+}
+
+// Same as calling playGen the given number of times, a tile at a time
+void playGensTiled(int generations) {
+	world_t swap = old_world;
+	old_world = new_world;
+	new_world = swap;
+
+	if (tiles == NULL) {
+		tiles = malloc(sizeof(tile_t));
+		tileAlloc(tiles, TILE_SIZE + 8*TILE_GENERATIONS);
+	}
+
+	int i, j;
+	for (i = 0; i < WORLD_SIZE; i += TILE_SIZE) {
+		for (j = 0; j < WORLD_SIZE; j += TILE_SIZE) {
+			animal_moves += advanceTile(tiles, i, j, generations);
+		}
+	}
+	lap(PHASE_SWEEP);
 }
 
 int main(int argc, char **argv) {
@@ -532,24 +2883,112 @@ int main(int argc, char **argv) {
 		exit(EXIT_FAILURE);
 	}
 
-	FILE *input = fopen(argv[1], "r");
-	if (input == NULL) {
-		fprintf(stderr, "File %s not found...\n", argv[1]);
-		exit(EXIT_FAILURE);
+	parseOptions(argc, argv);
+
+	if (count_events) {
+		startEvents();
+	}
+	phase_clock = omp_get_wtime();
+	int first = 0;
+	if (restart_file != NULL) {
+		first = restart(restart_file, argv);
+	} else {
+		size_t size;
+		const char *map = mapFile(argv[1], &size);
+		init(map, size, argv);
+		munmap((void *) map, size);
+	}
+	lap(PHASE_PARSE);
+	fprintf(stderr, "Init took %f\n", phase_times[PHASE_PARSE]);
+
+	double start = phase_clock;
+	if (checkpoint_file != NULL) {
+		startCheckpoints();
+		lap(PHASE_CHECKPOINT);
 	}
 
-	init(input, argv);
-	fclose(input);
+	if (trajectory_file != NULL) {
+		openTrajectory();
+		writeFrame(first);
+		lap(PHASE_TRAJECTORY);
+	}
+	if (print_digests) {
+		printDigest(first);
+		lap(PHASE_DIGEST);
+	}
 
-	double start = omp_get_wtime();
+	int saved = -1;
 	int gen;
-	for (gen = 0; gen < NUM_GENERATIONS; gen++) {
-		playGen();
+	for (gen = first; gen < NUM_GENERATIONS; gen++) {
+		if (ENGINE == ENGINE_TILED) {
+			// Stops at every checkpoint, and at every generation for
+			// the trajectory and the digests
+			int generations = min(TILE_GENERATIONS, NUM_GENERATIONS - gen);
+			if (CHECKPOINT_EVERY > 0) {
+				generations = min(generations, CHECKPOINT_EVERY - gen % CHECKPOINT_EVERY);
+			}
+			if ((trajectory_file != NULL) || print_digests) {
+				generations = 1;
+			}
+			playGensTiled(generations);
+			gen += generations - 1;
+		} else if (ENGINE == ENGINE_FUSED) {
+			playGenFused();
+		} else if (ENGINE == ENGINE_SPARSE) {
+			playGenSparse();
+		} else if (ENGINE == ENGINE_COMPACT) {
+			playGenCompact();
+		} else {
+			playGen();
+		}
+
+		if ((CHECKPOINT_EVERY > 0) && ((gen+1) % CHECKPOINT_EVERY == 0)) {
+			checkpoint(gen+1);
+			lap(PHASE_CHECKPOINT);
+			saved = gen+1;
+		}
+
+		if (trajectory_file != NULL) {
+			writeFrame(gen+1);
+			lap(PHASE_TRAJECTORY);
+		}
+		if (print_digests) {
+			printDigest(gen+1);
+			lap(PHASE_DIGEST);
+		}
+	}
+
+	if (trajectory_file != NULL) {
+		closeTrajectory();
+		lap(PHASE_TRAJECTORY);
 	}
 
-	double end = omp_get_wtime();
-	printf("Took %f\n", end - start);
+	if (checkpoint_file != NULL) {
+		if (saved != gen) {
+			checkpoint(gen);
+		}
+		finishCheckpoints();
+		lap(PHASE_CHECKPOINT);
+	}
+
+	double took = phase_clock - start - phase_times[PHASE_CHECKPOINT] - phase_times[PHASE_TRAJECTORY]
+		- phase_times[PHASE_DIGEST];
+	printf("Took %f\n", took);
+	if (checkpoint_file != NULL) {
+		fprintf(stderr, "Checkpoints took %f\n", phase_times[PHASE_CHECKPOINT]);
+	}
+	if (trajectory_file != NULL) {
+		fprintf(stderr, "Trajectory took %f\n", phase_times[PHASE_TRAJECTORY]);
+	}
 
 	printWorld();
+	lap(PHASE_OUTPUT);
+
+	if (timings_file != NULL) {
+		writeTimings(took, max(NUM_GENERATIONS - first, 0));
+	}
+	if (count_events) {
+		closeEvents();
+	}
 	return 0;
 }
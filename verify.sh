@@ -0,0 +1,164 @@
+#!/bin/bash
+
+# Compare every version against the serial one on generated worlds.
+# Each version prints the digest of the world after every generation
+# (--digest), so a run is checked at every generation and not only at
+# the end. The first generation where a run diverges is reported with
+# the regions of the world it diverges in.
+# The worlds are kept in test/verify, with a .header holding the
+# variables given to the programs.
+
+# Environment variables
+SERIAL_PROGRAM=${SERIAL_PROGRAM:-"bin/wolves-squirrels-serial"}
+OMP_PROGRAM=${OMP_PROGRAM:-"bin/wolves-squirrels-omp"}
+MPI_PROGRAM=${MPI_PROGRAM:-"bin/wolves-squirrels-mpi"}
+GENERATOR_PROGRAM=${GENERATOR_PROGRAM:-"bin/gen-world"}
+OUTPUT_DIR="test/verify"
+MPIRUN=${MPIRUN:-mpirun}
+
+# Simulator variables
+NUMBER_TESTS=${NUMBER_TESTS:-4}
+MIN_WORLD_SIZE=8
+MAX_WORLD_SIZE=${MAX_WORLD_SIZE:-300}
+MAX_WOLF_BREEDING_PERIOD=5
+MAX_SQUIRREL_BREEDING_PERIOD=5
+MAX_WOLF_STARVATION_PERIOD=5
+MAX_NUMBER_GENERATIONS=20
+
+# Versions compared
+SERIAL_ENGINES=${SERIAL_ENGINES:-"fused sparse compact tiled"}
+OMP_ENGINES=${OMP_ENGINES:-"dense fused gather tiled occupancy"}
+OMP_THREADS=${OMP_THREADS:-"1 2 4"}
+MPI_RANKS=${MPI_RANKS:-"1 2 4"}
+DIGEST_REGIONS=4
+
+failures=0
+
+# Prints the digest lines of a run
+digests() {
+	"$@" 2>&1 > /dev/null < /dev/null | grep '^Digest'
+}
+
+# Compares the digests of a run with the serial ones, printing the first
+# generation they differ at and the rows and columns of the regions
+# that differ
+compare() {
+	name=$1
+	expected=$2
+	actual=$3
+
+	report=$(awk -v size=$world_size -v regions=$DIGEST_REGIONS '
+		function first(region) {
+			return int((region * size + regions - 1) / regions)
+		}
+		NR == FNR { expected[FNR] = $0; lines = FNR; next }
+		!diverged && ($0 != expected[FNR]) {
+			diverged = 1
+			split(expected[FNR], fields)
+			if (NF == 0) {
+				printf "generation %d: no digest\n", fields[2]
+				exit
+			}
+
+			count = 0
+			text = ""
+			for (i = 0; i < regions * regions; i++) {
+				if ($(i+4) != fields[i+4]) {
+					row = int(i / regions)
+					col = i % regions
+					text = text sprintf("%s rows %d-%d cols %d-%d", (count++ > 0) ? "," : "",
+							first(row), first(row+1) - 1, first(col), first(col+1) - 1)
+				}
+			}
+			printf "generation %d:%s\n", fields[2], (count == regions * regions) ? " everywhere" : text
+			exit
+		}
+		END {
+			if (!diverged && (FNR < lines)) {
+				split(expected[FNR+1], fields)
+				printf "generation %d: no digest\n", fields[2]
+			}
+		}' <(echo "$expected") <(echo "$actual"))
+
+	if [ -z "$report" ]
+	then
+		echo "ok   $name"
+	else
+		echo "FAIL $name diverges at $report"
+		let "failures += 1"
+	fi
+}
+
+if [ -x $SERIAL_PROGRAM ] && [ -x $OMP_PROGRAM ] && [ -x $MPI_PROGRAM ] && [ -x $GENERATOR_PROGRAM ]
+then
+	rm -rf $OUTPUT_DIR
+	mkdir -p $OUTPUT_DIR
+
+	for (( count = 0; count < $NUMBER_TESTS; count++ ));
+	do
+		file="${OUTPUT_DIR}/${count}"
+
+		# generating .in
+		layouts=('uniform' 'clustered' 'striped')
+		input="${file}.in"
+
+		world_size=$RANDOM
+		let "world_size %= $MAX_WORLD_SIZE - $MIN_WORLD_SIZE + 1"
+		let "world_size += $MIN_WORLD_SIZE"
+		layout=$RANDOM
+		let "layout %= ${#layouts[@]}"
+		seed=$RANDOM
+
+		$GENERATOR_PROGRAM $world_size --seed $seed \
+				--layout ${layouts[${layout}]} > $input 2> /dev/null
+
+		# generating .header
+		header="${file}.header"
+
+		wolf_breeding_period=$RANDOM
+		squirrel_breeding_period=$RANDOM
+		wolf_starvation_period=$RANDOM
+		number_generations=$RANDOM
+		let "wolf_breeding_period %= $MAX_WOLF_BREEDING_PERIOD"
+		let "squirrel_breeding_period %= $MAX_SQUIRREL_BREEDING_PERIOD"
+		let "wolf_starvation_period %= $MAX_WOLF_STARVATION_PERIOD"
+		let "number_generations %= $MAX_NUMBER_GENERATIONS"
+		let "wolf_breeding_period += 1"
+		let "squirrel_breeding_period += 1"
+		let "wolf_starvation_period += 1"
+		let "number_generations += 1"
+
+		arguments="$wolf_breeding_period $squirrel_breeding_period $wolf_starvation_period $number_generations"
+		echo "$arguments" > $header
+		echo "world $count: size $world_size, ${layouts[${layout}]} (seed $seed), $arguments"
+
+		# comparing every version with the serial one
+		expected=$(digests $SERIAL_PROGRAM $input $arguments --digest)
+
+		for engine in $SERIAL_ENGINES; do
+			compare "serial --engine $engine" "$expected" \
+					"$(digests $SERIAL_PROGRAM $input $arguments --digest --engine $engine)"
+		done
+
+		for threads in $OMP_THREADS; do
+			for engine in $OMP_ENGINES; do
+				compare "omp --engine $engine ($threads threads)" "$expected" \
+						"$(OMP_NUM_THREADS=$threads digests $OMP_PROGRAM $input $arguments --digest --engine $engine)"
+			done
+		done
+
+		for ranks in $MPI_RANKS; do
+			compare "mpi ($ranks processes)" "$expected" \
+					"$(digests $MPIRUN -np $ranks $MPI_PROGRAM $input $arguments --digest)"
+		done
+	done
+
+	if [ $failures -gt 0 ]
+	then
+		echo "$failures runs diverged."
+		exit 1
+	fi
+else
+	echo "$SERIAL_PROGRAM, $OMP_PROGRAM, $MPI_PROGRAM or $GENERATOR_PROGRAM doesn't exist."
+	exit 1
+fi